@@ -0,0 +1,116 @@
+/*
+ * Times the r/m, r opcode of each ALU family with a register operand and
+ * with a memory operand, as a straight run of the same instruction.
+ * make bench_alu builds it with -DSPLIT_FORMS=0 and 1 to compare the opcode
+ * handlers with the register and memory form handlers. Single timings move
+ * by 20% or more from run to run, so each cell is timed over PASSES passes
+ * and shown as the minimum / median; compare minimums first.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "emulator.h"
+#include "emulator_function.h"
+#include "instruction.h"
+#include "decode_cache.h"
+#include "guest_memory.h"
+
+#define CODE (0x00400000)
+/* Instructions in the run, few enough that the decode cache holds them all */
+#define COPIES (1024)
+/* Locals at [ebp - 8] */
+#define STACK (0x00120000)
+/* Timings of each cell, interleaved over the families so a slow moment of the host hits them all */
+#define PASSES (9)
+
+typedef struct {
+	const char* name;
+	uint8_t opcode;
+} Family;
+
+static const Family families[] = {
+	{ "add", 0x01 }, { "or", 0x09 }, { "and", 0x21 }, { "sub", 0x29 },
+	{ "xor", 0x31 }, { "cmp", 0x3B }, { "test", 0x85 }, { "mov", 0x89 },
+};
+
+/* ModRM of ecx and eax, and of ecx and [ebp - 8] */
+static const uint8_t register_form[] = { 0xC8 };
+static const uint8_t memory_form[] = { 0x4D, 0xF8 };
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Nanoseconds per instruction over runs of COPIES times opcode with the ModRM bytes of form */
+static double time_form(Emulator* emu, uint8_t opcode, const uint8_t* form, int form_length, int runs) {
+	uint32_t address = CODE;
+	double start;
+	int i, run;
+
+	for (i = 0; i < COPIES; i++) {
+		set_memory8(emu, address, opcode);
+		write_memory(emu, address + 1, form, form_length);
+		address += 1 + form_length;
+	}
+
+	start = now();
+	for (run = 0; run < runs; run++) {
+		emu->eip = CODE;
+		if (run_instructions(emu, address) != 0) {
+			printf("%02X: not implemented\n", opcode);
+			exit(1);
+		}
+	}
+	return (now() - start) / ((double)runs * COPIES) * 1e9;
+}
+
+static int compare_doubles(const void* a, const void* b) {
+	double x = *(const double*)a, y = *(const double*)b;
+	return x < y ? -1 : x > y;
+}
+
+/* Minimum / median of the passes of a cell */
+static void print_cell(double* passes) {
+	qsort(passes, PASSES, sizeof(double), compare_doubles);
+	printf(" %7.2f / %-7.2f", passes[0], passes[PASSES / 2]);
+}
+
+int main(int argc, char* argv[]) {
+	enum { FAMILIES = sizeof(families) / sizeof(families[0]) };
+	int runs = argc > 1 ? atoi(argv[1]) : 2000;
+	double reg[FAMILIES][PASSES], mem[FAMILIES][PASSES];
+	Emulator* emu;
+	int i, pass;
+
+	init_instructions();
+	emu = create_emu();
+	emu->registers[EAX] = 0x12345678;
+	emu->registers[ECX] = 0x9ABCDEF0;
+	emu->registers[ESP] = STACK;
+	emu->registers[EBP] = STACK;
+	set_memory32(emu, STACK - 8, 0x0F0F0F0F);
+
+	for (pass = 0; pass < PASSES; pass++) {
+		for (i = 0; i < FAMILIES; i++) {
+			reg[i][pass] = time_form(emu, families[i].opcode, register_form, sizeof(register_form), runs);
+			mem[i][pass] = time_form(emu, families[i].opcode, memory_form, sizeof(memory_form), runs);
+		}
+	}
+
+	printf("%s handlers, ns per instruction, min / median of %d passes:\n",
+		SPLIT_FORMS ? "register / memory form" : "opcode", PASSES);
+	printf("  %-6s %-17s %-17s\n", "", " register", " memory");
+	for (i = 0; i < FAMILIES; i++) {
+		printf("  %-6s", families[i].name);
+		print_cell(reg[i]);
+		print_cell(mem[i]);
+		printf("\n");
+	}
+
+	destroy_emu(emu);
+	return 0;
+}
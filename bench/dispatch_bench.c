@@ -0,0 +1,98 @@
+/*
+ * Times the Continuum key routine under run_instructions.
+ * make bench_dispatch builds it with -DTHREADED_DISPATCH=0 and 1 to compare
+ * the function table loop with the computed goto loop.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "emulator.h"
+#include "emulator_function.h"
+#include "instruction.h"
+#include "decode_cache.h"
+#include "continuum.h"
+#include "snapshot.h"
+#include "guest_memory.h"
+
+#define KEY (0xF53E944B)
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Guest instructions executed by one run of the routine */
+static long count_instructions(Emulator* emu) {
+	long count = 0;
+
+	setup_continuum(emu, KEY);
+	while (emu->eip != CONTINUUM_STOP_EIP) {
+		DecodedInstruction* insn = fetch_decoded(emu);
+		if (insn->func == NULL || emu->eip == 0x00) {
+			return -1;
+		}
+		emu->insn = insn;
+		insn->func(emu);
+		count++;
+	}
+	emu->insn = NULL;
+	return count;
+}
+
+int main(int argc, char* argv[]) {
+	int runs = argc > 1 ? atoi(argv[1]) : 2000;
+	uint8_t expected[CONTINUUM_BUFFER_SIZE];
+	uint8_t buffer[CONTINUUM_BUFFER_SIZE];
+	double total = 0;
+	long count;
+	Snapshot* snapshot;
+	Emulator* emu;
+	int run;
+
+	init_instructions();
+	emu = create_emu();
+	if (read_binary(emu, CONTINUUM_IMAGE) < 0) {
+		return 1;
+	}
+	snapshot = take_snapshot(emu);
+	destroy_emu(emu);
+	emu = create_emu_from_snapshot(snapshot);
+
+	count = count_instructions(emu);
+	if (count < 0) {
+		printf("the key routine did not reach its return address\n");
+		return 1;
+	}
+	read_memory(emu, CONTINUUM_BUFFER, expected, CONTINUUM_BUFFER_SIZE);
+
+	for (run = 0; run < runs; run++) {
+		double start;
+
+		restore_snapshot(emu);
+		setup_continuum(emu, KEY);
+
+		start = now();
+		if (run_instructions(emu, CONTINUUM_STOP_EIP) != 0) {
+			return 1;
+		}
+		total += now() - start;
+
+		read_memory(emu, CONTINUUM_BUFFER, buffer, CONTINUUM_BUFFER_SIZE);
+		if (memcmp(expected, buffer, CONTINUUM_BUFFER_SIZE) != 0) {
+			printf("run %d: buffer differs from the reference run\n", run);
+			return 1;
+		}
+	}
+
+	printf("%s dispatch: %d runs, %ld instructions per run, %.1f us per run, %.1f M instructions/s\n",
+		THREADED_DISPATCH ? "threaded" : "function table",
+		runs, count, total / runs * 1e6, count * (double)runs / total / 1e6);
+
+	destroy_emu(emu);
+	destroy_snapshot(snapshot);
+	return 0;
+}
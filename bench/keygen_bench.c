@@ -0,0 +1,161 @@
+/*
+ * End-to-end throughput of the Continuum key routine (0x457D60 until it
+ * returns to 0x458BD0) with tracing off. make bench runs it; measure every
+ * performance change to the interpreter against it.
+ *   keygen_bench [RUNS]
+ * Each runner (instruction loop, blocks, translated blocks, emu_call through
+ * the final ret 4) runs the routine
+ * RUNS times from a fresh snapshot. Every run's buffer is checked against
+ * the golden output, and a mismatch fails the benchmark.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "emulator.h"
+#include "emulator_function.h"
+#include "instruction.h"
+#include "decode_cache.h"
+#include "block_cache.h"
+#include "continuum.h"
+#include "snapshot.h"
+#include "guest_memory.h"
+#include "libx86emu.h"
+
+#define KEY (0xF53E944B)
+
+/* Buffer the routine leaves for KEY */
+static const uint8_t golden[CONTINUUM_BUFFER_SIZE] = {
+	0x47, 0xC4, 0xB6, 0xEF, 0x44, 0x0E, 0xC8, 0x3D, 0xD4, 0xD5, 0x2B, 0xA2, 0xA7, 0x81, 0xCD, 0x2C,
+	0x46, 0xBE, 0x15, 0xE0, 0x06, 0x52, 0x3E, 0xFB, 0x2E, 0x3A, 0x83, 0xB3, 0xF1, 0x3C, 0xF5, 0xA4,
+	0x1C, 0x13, 0x16, 0x89, 0xB2, 0xBF, 0xFA, 0xA3, 0xD4, 0x49, 0x24, 0x63, 0x63, 0x46, 0xBC, 0x96,
+	0xC9, 0xD4, 0x04, 0xC9, 0x4D, 0xFE, 0x2C, 0x0A, 0x10, 0x73, 0x82, 0x92, 0x87, 0xA5, 0xCC, 0xCF,
+	0x63, 0xAD, 0x28, 0xEB, 0xD5, 0x65, 0x66, 0xB6, 0xF8, 0x01, 0x4A, 0xF0, 0x30, 0x74, 0x89, 0x69,
+};
+
+#define RUN_INSTRUCTIONS (0)
+#define RUN_BLOCKS (1)
+#define RUN_JIT (2)
+#define RUN_CALL (3)
+
+static const char* runner_names[] = { "instructions", "blocks", "jit", "call" };
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_doubles(const void* a, const void* b) {
+	double x = *(const double*)a, y = *(const double*)b;
+	return x < y ? -1 : x > y ? 1 : 0;
+}
+
+/* Guest instructions executed by one run of the routine */
+static long count_instructions(Snapshot* snapshot) {
+	Emulator* emu = create_emu_from_snapshot(snapshot);
+	long count = 0;
+
+	setup_continuum(emu, KEY);
+	while (emu->eip != CONTINUUM_STOP_EIP) {
+		DecodedInstruction* insn = fetch_decoded(emu);
+		if (insn->func == NULL || emu->eip == 0x00) {
+			count = -1;
+			break;
+		}
+		emu->insn = insn;
+		insn->func(emu);
+		count++;
+	}
+	destroy_emu(emu);
+	return count;
+}
+
+/* Run the routine runs times with runner. Returns 0, or -1 when a run fails or its buffer differs */
+static int bench_runner(Snapshot* snapshot, int runner, int runs, long count, double* latency) {
+	Emulator* emu = create_emu_from_snapshot(snapshot);
+	uint8_t buffer[CONTINUUM_BUFFER_SIZE];
+	double total = 0;
+	int run, status;
+
+	if (runner == RUN_JIT && !set_block_jit(emu, 1)) {
+		printf("%-12s  JIT not supported on this host\n", runner_names[runner]);
+		destroy_emu(emu);
+		return 0;
+	}
+
+	for (run = 0; run < runs; run++) {
+		double start;
+
+		restore_snapshot(emu);
+		setup_continuum(emu, KEY);
+
+		start = now();
+		if (runner == RUN_CALL) {
+			uint32_t args[2] = { CONTINUUM_THIS, KEY };
+			status = emu_call(emu, CONTINUUM_START_EIP, args, 2, EMU_THISCALL);
+		} else if (runner == RUN_INSTRUCTIONS) {
+			status = run_instructions(emu, CONTINUUM_STOP_EIP);
+		} else {
+			status = run_blocks(emu, CONTINUUM_STOP_EIP);
+		}
+		latency[run] = now() - start;
+		total += latency[run];
+
+		read_memory(emu, CONTINUUM_BUFFER, buffer, CONTINUUM_BUFFER_SIZE);
+		if (status != 0 || memcmp(buffer, golden, CONTINUUM_BUFFER_SIZE) != 0) {
+			printf("%s run %d: buffer differs from the golden output\n", runner_names[runner], run);
+			destroy_emu(emu);
+			return -1;
+		}
+	}
+
+	qsort(latency, runs, sizeof(double), compare_doubles);
+	printf("%-12s %8.1f M instructions/s %9.0f runs/s   p50 %7.1f us   p99 %7.1f us\n",
+		runner_names[runner], count * (double)runs / total / 1e6, runs / total,
+		latency[runs / 2] * 1e6, latency[(runs * 99) / 100] * 1e6);
+
+	destroy_emu(emu);
+	return 0;
+}
+
+int main(int argc, char* argv[]) {
+	int runs = argc > 1 ? atoi(argv[1]) : 2000;
+	Snapshot* snapshot;
+	double* latency;
+	Emulator* emu;
+	long count;
+	int runner, failed = 0;
+
+	if (runs <= 0) {
+		runs = 1;
+	}
+
+	init_instructions();
+	emu = create_emu();
+	if (read_binary(emu, CONTINUUM_IMAGE) < 0) {
+		return 1;
+	}
+	snapshot = take_snapshot(emu);
+	destroy_emu(emu);
+
+	count = count_instructions(snapshot);
+	if (count < 0) {
+		printf("the key routine did not reach its return address\n");
+		return 1;
+	}
+	printf("%d runs of the key routine, %ld instructions per run\n", runs, count);
+
+	latency = malloc(runs * sizeof(double));
+	for (runner = RUN_INSTRUCTIONS; runner <= RUN_CALL; runner++) {
+		if (bench_runner(snapshot, runner, runs, count, latency) != 0) {
+			failed = 1;
+		}
+	}
+
+	free(latency);
+	destroy_snapshot(snapshot);
+	return failed;
+}
@@ -0,0 +1,88 @@
+/*
+ * Times the guest memory accessors.
+ * make bench_memory builds it with -DWORD_MEMORY_ACCESS=0 and 1 to compare
+ * the byte by byte accessors with the single load / store ones.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "emulator.h"
+#include "emulator_function.h"
+#include "guest_memory.h"
+
+/* Accesses walk a 64 KB region like a stack and its locals */
+#define REGION (0x00120000)
+#define REGION_SIZE (0x10000)
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static volatile uint32_t sink;
+
+static void report(const char* name, double seconds, long accesses) {
+	printf("  %-14s %6.2f ns per access\n", name, seconds / accesses * 1e9);
+}
+
+int main(int argc, char* argv[]) {
+	long accesses = argc > 1 ? atol(argv[1]) : 20000000;
+	Emulator* emu = create_emu();
+	uint32_t sum = 0;
+	double start;
+	long i;
+
+	/* Touch the region so that every write hits an allocated page */
+	for (i = 0; i < REGION_SIZE; i += GUEST_PAGE_SIZE) {
+		set_memory8(emu, REGION + i, 0);
+	}
+
+	printf("%s accessors:\n", WORD_MEMORY_ACCESS ? "word" : "byte by byte");
+
+	start = now();
+	for (i = 0; i < accesses; i++) {
+		set_memory32(emu, REGION + ((i * 4) & (REGION_SIZE - 1)), i);
+	}
+	report("set_memory32", now() - start, accesses);
+
+	start = now();
+	for (i = 0; i < accesses; i++) {
+		sum += get_memory32(emu, REGION + ((i * 4) & (REGION_SIZE - 1)));
+	}
+	report("get_memory32", now() - start, accesses);
+
+	/* Odd addresses: still one access, except where a page ends */
+	start = now();
+	for (i = 0; i < accesses; i++) {
+		sum += get_memory32(emu, REGION + ((i * 4 + 1) & (REGION_SIZE - 1)));
+	}
+	report("unaligned32", now() - start, accesses);
+
+	start = now();
+	for (i = 0; i < accesses; i++) {
+		sum += get_memory16(emu, REGION + ((i * 2) & (REGION_SIZE - 1)));
+	}
+	report("get_memory16", now() - start, accesses);
+
+	start = now();
+	for (i = 0; i < accesses; i++) {
+		emu->eip = REGION + ((i * 4) & (REGION_SIZE - 1));
+		sum += get_code32(emu, 1);
+	}
+	report("get_code32", now() - start, accesses);
+
+	emu->registers[ESP] = REGION + REGION_SIZE;
+	start = now();
+	for (i = 0; i < accesses / 2; i++) {
+		push32(emu, i);
+		sum += pop32(emu);
+	}
+	report("push32 + pop32", now() - start, accesses / 2 * 2);
+
+	sink = sum;
+	destroy_emu(emu);
+	return 0;
+}
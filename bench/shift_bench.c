@@ -0,0 +1,181 @@
+/*
+ * Checks the shift and rotate handlers (0xC1, 0xD1 and 0xD3) against the
+ * host running the same instructions, for every count, then times each one
+ * as a straight run of the same instruction. make bench_shift runs it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "emulator.h"
+#include "emulator_function.h"
+#include "instruction.h"
+#include "decode_cache.h"
+#include "guest_memory.h"
+
+#define CODE (0x00400000)
+/* Instructions in the timed run, few enough that the decode cache holds them all */
+#define COPIES (1024)
+
+/* Operations by ModRM reg field; /6 is sal, the same as shl */
+static const char* names[8] = { "rol", "ror", "rcl", "rcr", "shl", "shr", "sal", "sar" };
+
+/* Operands every count is checked with */
+static const uint32_t values[] = {
+	0x00000000, 0x00000001, 0x80000000, 0xFFFFFFFF, 0x7FFFFFFF,
+	0x12345678, 0x9ABCDEF0, 0xF53E944B, 0x0000FF00, 0x55AA55AA,
+};
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Run op on eax by count through the handler of opcode (0xC1 with count as ib, 0xD1, or 0xD3 with count in cl) */
+static uint32_t emulate(Emulator* emu, uint8_t opcode, int op, uint32_t value, uint8_t count, int carry) {
+	set_memory8(emu, CODE, opcode);
+	set_memory8(emu, CODE + 1, 0xC0 | op << 3);
+	set_memory8(emu, CODE + 2, count);
+
+	emu->registers[EAX] = value;
+	emu->registers[ECX] = count;
+	emu->eflags = 0;
+	emu->lazy_op = LAZY_NONE;
+	set_carry(emu, carry);
+	emu->eip = CODE;
+	if (run_instructions(emu, CODE + (opcode == 0xC1 ? 3 : 2)) != 0) {
+		printf("%02X /%d: not implemented\n", opcode, op);
+		exit(1);
+	}
+	return emu->registers[EAX];
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* Guest flags of the host flags after the reference instruction */
+#define HOST_FLAG(flags, bit, flag) ((flags) >> (bit) & 1 ? (flag) : 0)
+
+#define HOST_SHIFT(insn) \
+	__asm__("bt $0, %k[carry]\n\t" insn " %%cl, %k[value]\n\t" "pushf\n\t" "pop %[flags]" \
+		: [value] "+r" (value), [flags] "=r" (flags) : [carry] "r" (carry), "c" (count) : "cc")
+
+/* op on value by count on the host, with its CF, PF, ZF, SF and OF */
+static uint32_t reference(int op, uint32_t value, uint8_t count, uint32_t carry, uint32_t* guest_flags) {
+	uintptr_t flags;
+
+	switch (op) {
+		case 0: HOST_SHIFT("roll"); break;
+		case 1: HOST_SHIFT("rorl"); break;
+		case 2: HOST_SHIFT("rcll"); break;
+		case 3: HOST_SHIFT("rcrl"); break;
+		case 4: HOST_SHIFT("shll"); break;
+		case 6: HOST_SHIFT("sall"); break;
+		case 5: HOST_SHIFT("shrl"); break;
+		default: HOST_SHIFT("sarl"); break;
+	}
+	*guest_flags = HOST_FLAG(flags, 0, CARRY_FLAG) | HOST_FLAG(flags, 2, PARITY_FLAG) | HOST_FLAG(flags, 6, ZERO_FLAG)
+		| HOST_FLAG(flags, 7, SIGN_FLAG) | HOST_FLAG(flags, 11, OVERFLOW_FLAG);
+	return value;
+}
+
+/*
+ * Every count from 0 to 255 through 0xC1 and 0xD3, and 1 through 0xD1,
+ * with CF clear and set.
+ * CF must match for each count (a count of 0 leaves it), OF for a count of
+ * 1, the only one it is defined for, and SF, ZF and PF for shifts by a
+ * count that is not 0.
+ */
+static long check(Emulator* emu) {
+	static const uint8_t opcodes[] = { 0xC1, 0xD1, 0xD3 };
+	long failures = 0;
+	size_t i, v;
+	int op, count, carry;
+
+	for (i = 0; i < sizeof(opcodes); i++) {
+		for (op = 0; op < 8; op++) {
+			for (count = 0; count < 256; count++) {
+				if (opcodes[i] == 0xD1 && count != 1) {
+					continue;
+				}
+				for (v = 0; v < sizeof(values) / sizeof(values[0]); v++) {
+					for (carry = 0; carry < 2; carry++) {
+						uint32_t expected_flags, mask = CARRY_FLAG;
+						uint32_t expected = reference(op, values[v], count, carry, &expected_flags);
+						uint32_t res = emulate(emu, opcodes[i], op, values[v], count, carry);
+						uint32_t flags = (is_carry(emu) ? CARRY_FLAG : 0) | (is_parity(emu) ? PARITY_FLAG : 0)
+							| (is_zero(emu) ? ZERO_FLAG : 0) | (is_sign(emu) ? SIGN_FLAG : 0)
+							| (is_overflow(emu) ? OVERFLOW_FLAG : 0);
+
+						if ((count & 31) == 1) {
+							mask |= OVERFLOW_FLAG;
+						}
+						if ((count & 31) != 0 && op >= 4) {
+							mask |= PARITY_FLAG | ZERO_FLAG | SIGN_FLAG;
+						}
+						if (res != expected || (flags & mask) != (expected_flags & mask)) {
+							if (failures++ < 10) {
+								printf("  %02X %s %08X, %d with CF %d: %08X flags %03X, host %08X flags %03X\n",
+									opcodes[i], names[op], values[v], count, carry, res, flags & mask, expected, expected_flags & mask);
+							}
+						}
+					}
+				}
+			}
+		}
+	}
+	return failures;
+}
+#endif
+
+/* Nanoseconds per instruction over runs of COPIES times C1 /op ib */
+static double time_op(Emulator* emu, int op, uint8_t count, int runs) {
+	uint32_t address = CODE;
+	double start;
+	int i, run;
+
+	for (i = 0; i < COPIES; i++) {
+		set_memory8(emu, address, 0xC1);
+		set_memory8(emu, address + 1, 0xC0 | op << 3);
+		set_memory8(emu, address + 2, count);
+		address += 3;
+	}
+
+	emu->registers[EAX] = 0xF53E944B;
+	start = now();
+	for (run = 0; run < runs; run++) {
+		emu->eip = CODE;
+		if (run_instructions(emu, address) != 0) {
+			return -1;
+		}
+	}
+	return (now() - start) / ((double)runs * COPIES) * 1e9;
+}
+
+int main(int argc, char* argv[]) {
+	int runs = argc > 1 ? atoi(argv[1]) : 20000;
+	Emulator* emu;
+	int op;
+
+	init_instructions();
+	emu = create_emu();
+
+#if defined(__x86_64__) || defined(__i386__)
+	long failures = check(emu);
+	if (failures != 0) {
+		printf("%ld results differ from the host\n", failures);
+		return 1;
+	}
+	printf("every count matches the host\n");
+#endif
+
+	printf("ns per instruction, count 1 / 5:\n");
+	for (op = 0; op < 8; op++) {
+		double one = time_op(emu, op, 1, runs);
+		double five = time_op(emu, op, 5, runs);
+		printf("  %-4s %7.2f %7.2f\n", names[op], one, five);
+	}
+
+	destroy_emu(emu);
+	return 0;
+}
@@ -0,0 +1,299 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "block_cache.h"
+#include "emulator_function.h"
+#include "jit.h"
+#include "profile.h"
+
+BlockCache* create_block_cache(void) {
+	BlockCache* cache = malloc(sizeof(BlockCache));
+	memset(cache, 0, sizeof(BlockCache));
+	return cache;
+}
+
+/* Free every block, keeping the cache settings */
+static void flush_blocks(BlockCache* cache) {
+	int i;
+
+	for (i = 0; i < BLOCK_TABLE_SIZE; i++) {
+		Block* block = cache->table[i];
+
+		while (block != NULL) {
+			Block* next = block->next_slot;
+			free(block);
+			block = next;
+		}
+	}
+	memset(cache->table, 0, sizeof(cache->table));
+	memset(cache->pages, 0, sizeof(cache->pages));
+	jit_reset(cache);
+}
+
+void destroy_block_cache(BlockCache* cache) {
+	flush_blocks(cache);
+	jit_release(cache);
+	free(cache);
+}
+
+int set_block_jit(Emulator* emu, int enabled) {
+	if (emu->block_cache == NULL) {
+		emu->block_cache = create_block_cache();
+	}
+	emu->block_cache->jit_enabled = enabled && jit_supported();
+	return emu->block_cache->jit_enabled == enabled;
+}
+
+/* Instructions after which EIP is not simply the next address */
+static int ends_block(uint8_t opcode) {
+	if (opcode >= 0x70 && opcode <= 0x7F) {
+		return 1; /* Jcc */
+	}
+
+	switch (opcode) {
+		case 0xC2: /* ret_imm16 */
+		case 0xC3: /* ret */
+		case 0xCD: /* int */
+		case 0xE8: /* call_rel32 */
+		case 0xE9: /* near_jump_rel32 */
+		case 0xEB: /* short_jump_rel8 */
+		case 0xFF: /* call_rm32 */
+		/* Prefixes change the mode the next instruction decodes in */
+		case 0x66:
+		case 0x67:
+		case 0xF2:
+		case 0xF3:
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+/* Decode the straight line code at EIP into a new block. Returns NULL if the first opcode is not implemented */
+static Block* build_block(Emulator* emu, uint32_t mode) {
+	BlockCache* cache = emu->block_cache;
+	DecodedInstruction insns[BLOCK_MAX_INSNS];
+	uint32_t start = emu->eip;
+	int count = 0;
+	Block* block;
+
+	while (count < BLOCK_MAX_INSNS) {
+		DecodedInstruction* insn = fetch_decoded(emu);
+
+		if (insn->func == NULL) {
+			break;
+		}
+
+		insns[count++] = *insn;
+		emu->eip += insn->length;
+
+		/* Only the default mode carries over from one instruction to the next */
+		if (ends_block(insn->opcode) || emu->eip == cache->stop_eip || mode != DEFAULT_MODE) {
+			break;
+		}
+	}
+
+	block = NULL;
+	if (count > 0) {
+		block = malloc(sizeof(Block) + count * sizeof(DecodedInstruction));
+		memset(block, 0, sizeof(Block));
+		block->eip = start;
+		block->mode = mode;
+		block->end_eip = emu->eip;
+		block->valid = 1;
+		block->count = count;
+		memcpy(block->insns, insns, count * sizeof(DecodedInstruction));
+
+		block->next_page = cache->pages[(start >> DECODE_PAGE_SHIFT) & (BLOCK_PAGE_CHAINS - 1)];
+		cache->pages[(start >> DECODE_PAGE_SHIFT) & (BLOCK_PAGE_CHAINS - 1)] = block;
+		block->next_slot = cache->table[start & (BLOCK_TABLE_SIZE - 1)];
+		cache->table[start & (BLOCK_TABLE_SIZE - 1)] = block;
+	}
+
+	emu->eip = start;
+	return block;
+}
+
+/* Get the block starting at EIP, translating it on a miss */
+static Block* lookup_block(Emulator* emu) {
+	uint32_t mode = emu->prefix_mode & DECODE_MODE_MASK;
+	Block* block;
+
+	for (block = emu->block_cache->table[emu->eip & (BLOCK_TABLE_SIZE - 1)]; block != NULL; block = block->next_slot) {
+		if (block->eip == emu->eip && block->mode == mode) {
+			return block;
+		}
+	}
+	return build_block(emu, mode);
+}
+
+/* Take link out of the incoming links of its successor */
+static void unlink_exit(BlockLink* link) {
+	if (link->block != NULL) {
+		*link->prev_in = link->next_in;
+		if (link->next_in != NULL) {
+			link->next_in->prev_in = link->prev_in;
+		}
+		link->block = NULL;
+	}
+}
+
+/* Point link at next, entered at eip */
+static void link_exit(BlockLink* link, Block* next, uint32_t eip) {
+	unlink_exit(link);
+	link->block = next;
+	link->eip = eip;
+	link->next_in = next->incoming;
+	link->prev_in = &next->incoming;
+	if (next->incoming != NULL) {
+		next->incoming->prev_in = &link->next_in;
+	}
+	next->incoming = link;
+}
+
+/* Follow the exit of block to its successor, linking them on first use */
+static Block* next_block(Emulator* emu, Block* block) {
+	uint32_t mode = emu->prefix_mode & DECODE_MODE_MASK;
+	Block* next;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		next = block->link[i].block;
+		if (next != NULL && block->link[i].eip == emu->eip && next->mode == mode) {
+			return next;
+		}
+	}
+
+	next = lookup_block(emu);
+	if (next != NULL) {
+		i = block->link_next;
+		link_exit(&block->link[i], next, emu->eip);
+		block->link_next = i ^ 1;
+	}
+	return next;
+}
+
+/* Take block out of its table slot, so that lookups no longer find it */
+static void unlink_slot(BlockCache* cache, Block* block) {
+	Block** p = &cache->table[block->eip & (BLOCK_TABLE_SIZE - 1)];
+
+	while (*p != NULL && *p != block) {
+		p = &(*p)->next_slot;
+	}
+	if (*p != NULL) {
+		*p = block->next_slot;
+	}
+}
+
+/* Drop the blocks of the page chain of chain_page overlapping page */
+static void invalidate_chain(BlockCache* cache, uint32_t chain_page, uint32_t page) {
+	Block** p = &cache->pages[chain_page & (BLOCK_PAGE_CHAINS - 1)];
+	Block* block;
+	int i;
+
+	while ((block = *p) != NULL) {
+		if ((block->eip >> DECODE_PAGE_SHIFT) <= page
+				&& ((block->end_eip - 1) >> DECODE_PAGE_SHIFT) >= page) {
+			*p = block->next_page;
+			unlink_slot(cache, block);
+			while (block->incoming != NULL) {
+				unlink_exit(block->incoming);
+			}
+			for (i = 0; i < 2; i++) {
+				unlink_exit(&block->link[i]);
+			}
+			block->valid = 0;
+			/* The running block is freed by run_blocks once it exits */
+			if (block != cache->running) {
+				free(block);
+			}
+			continue;
+		}
+		p = &block->next_page;
+	}
+}
+
+void invalidate_blocks(Emulator* emu, uint32_t address) {
+	BlockCache* cache = emu->block_cache;
+	uint32_t page = address >> DECODE_PAGE_SHIFT;
+
+	if (cache == NULL) {
+		return;
+	}
+
+	/* Blocks starting on the page, and blocks of the page before running into it */
+	invalidate_chain(cache, page, page);
+	invalidate_chain(cache, page - 1, page);
+}
+
+int run_blocks(Emulator* emu, uint32_t stop_eip) {
+	Block* block;
+	int i;
+
+	if (emu->block_cache == NULL) {
+		emu->block_cache = create_block_cache();
+	}
+
+	/* Blocks were cut for another stop address */
+	if (emu->block_cache->stop_eip != stop_eip) {
+		flush_blocks(emu->block_cache);
+		emu->block_cache->stop_eip = stop_eip;
+	}
+
+	if (emu->eip == stop_eip) {
+		return 0;
+	}
+
+	block = lookup_block(emu);
+	for (;;) {
+		if (block == NULL) {
+			printf("\n\nNot Implemented: %x\n", get_code8(emu, 0));
+			return -1;
+		}
+
+		if (block->jit == NULL && emu->block_cache->jit_enabled
+				&& ++block->exec_count == JIT_THRESHOLD) {
+			/* Host code is only reclaimed all at once: with the buffer full, drop every block and start over */
+			if (jit_buffer_full(emu->block_cache, block)) {
+				flush_blocks(emu->block_cache);
+				block = lookup_block(emu);
+				continue;
+			}
+			block->jit = jit_translate(emu->block_cache, block);
+		}
+
+		emu->block_cache->running = block;
+		if (block->jit != NULL) {
+			block->jit(emu);
+		} else {
+			for (i = 0; i < block->count; i++) {
+				emu->insn = &block->insns[i];
+				PROFILE_BEGIN(emu);
+				block->insns[i].func(emu);
+				PROFILE_END();
+			}
+		}
+		emu->insn = NULL;
+		emu->block_cache->running = NULL;
+
+		/* The block overwrote its own code; nothing links to it any more */
+		if (!block->valid) {
+			free(block);
+			block = NULL;
+		}
+
+		if (emu->eip == stop_eip) {
+			return 0;
+		}
+
+		/* EIP - The end of the program Once but becomes 0 */
+		if (emu->eip == 0x00) {
+			printf("\n\nEnd of program.\n\n");
+			return -1;
+		}
+
+		block = block != NULL ? next_block(emu, block) : lookup_block(emu);
+	}
+}
@@ -0,0 +1,83 @@
+#ifndef BLOCK_CACHE_H_
+#define BLOCK_CACHE_H_
+
+#include <stdint.h>
+
+#include "emulator.h"
+#include "decode_cache.h"
+
+/* Longest run of instructions translated into one block */
+#define BLOCK_MAX_INSNS (64)
+
+/* Number of block table slots, indexed by the low bits of EIP */
+#define BLOCK_TABLE_SIZE (1 << 12)
+
+/* Number of page chains, indexed by the low bits of the page of a block's EIP */
+#define BLOCK_PAGE_CHAINS (1 << 10)
+
+struct Block;
+
+/* Exit of a block linked to the successor entered at eip */
+typedef struct BlockLink {
+  struct Block* block;
+  uint32_t eip;
+  /* Other links into the same successor */
+  struct BlockLink* next_in;
+  struct BlockLink** prev_in;
+} BlockLink;
+
+/* Straight line run of decoded instructions ending at a control transfer */
+typedef struct Block {
+  /* Guest address of the first instruction */
+  uint32_t eip;
+  /* Operand / address size mode at entry */
+  uint32_t mode;
+  /* Guest address following the last instruction */
+  uint32_t end_eip;
+  /* Cleared when the guest overwrites the code */
+  int valid;
+  /* Successors seen at the exit */
+  BlockLink link[2];
+  int link_next;
+  /* Links of other blocks into this one, dropped with it */
+  BlockLink* incoming;
+  /* Next block in the same table slot, at another EIP or mode */
+  struct Block* next_slot;
+  /* Next block in the same page chain, for invalidation */
+  struct Block* next_page;
+  /* Host code of the block once it is hot, see jit.h */
+  void (*jit)(Emulator* emu);
+  uint32_t exec_count;
+  int count;
+  DecodedInstruction insns[];
+} Block;
+
+typedef struct BlockCache {
+  Block* table[BLOCK_TABLE_SIZE];
+  /* Blocks by the page of their EIP; a block reaches at most into the page after */
+  Block* pages[BLOCK_PAGE_CHAINS];
+  /* Block being executed, which invalidation must not free */
+  Block* running;
+  /* Address blocks are cut at, so that the run loop can stop there */
+  uint32_t stop_eip;
+  /* Translate hot blocks into host code */
+  int jit_enabled;
+  uint8_t* jit_code;
+  uint32_t jit_used;
+} BlockCache;
+
+/* To create an empty block cache */
+BlockCache* create_block_cache(void);
+/* Discard the block cache and every block in it */
+void destroy_block_cache(BlockCache* cache);
+
+/* Turn translation of hot blocks to host code on or off. Returns 0 if the host has no JIT */
+int set_block_jit(Emulator* emu, int enabled);
+
+/* Drop every block overlapping the page of address */
+void invalidate_blocks(Emulator* emu, uint32_t address);
+
+/* Execute block by block until EIP reaches stop_eip. Returns 0 on stop, -1 on an unimplemented opcode or EIP 0 */
+int run_blocks(Emulator* emu, uint32_t stop_eip);
+
+#endif
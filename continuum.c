@@ -0,0 +1,44 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "continuum.h"
+#include "emulator_function.h"
+#include "guest_memory.h"
+
+long read_binary(Emulator* emu, const char* filename) {
+	long size = load_file(emu, filename, PROGRAM_ORIGIN);
+
+	if (size < 0) {
+		printf("%s file can not be opened\n", filename);
+	}
+	return size;
+}
+
+void setup_continuum(Emulator* emu, uint32_t key) {
+	uint32_t i;
+
+	emu->eip = CONTINUUM_START_EIP; //start of function 0x457D60
+	emu->eflags = 0;
+	emu->lazy_op = LAZY_NONE;
+	emu->prefix_mode = PREFIX_OPSIZE_MODE_32_BIT | PREFIX_ADDRESS_MODE_32_BIT;
+	emu->registers[EAX] = CONTINUUM_THIS;
+	emu->registers[ECX] = CONTINUUM_THIS;
+	emu->registers[EDX] = key; //<-- Key
+	emu->registers[EBX] = 0xFFFFFFFF;
+	emu->registers[ESP] = 0x0012E8D0;
+	emu->registers[EBP] = 0x0012F91C;
+	emu->registers[ESI] = key; //<-- Key
+	emu->registers[EDI] = 0x00000400;
+
+	//Fix esp and [esp+4] value this is to fake emulate passing key into function
+	set_memory32(emu, 0x0012E8D0, key);
+	set_memory32(emu, 0x0012E8D4, key);
+
+	//Write pointer at 0x0012F8F8 that goes to address 0x0012F880 where virtual buffer
+	set_memory32(emu, CONTINUUM_THIS, CONTINUUM_BUFFER);
+
+	//zero the 80 byte virtual buffer
+	for (i = CONTINUUM_BUFFER; i < CONTINUUM_BUFFER + CONTINUUM_BUFFER_SIZE; i++)
+		set_memory8(emu, i, 0);
+}
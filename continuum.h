@@ -0,0 +1,27 @@
+#ifndef CONTINUUM_H_
+#define CONTINUUM_H_
+
+#include <stdint.h>
+
+#include "emulator.h"
+
+/* Program image holding the key routine of Continuum 4.0 */
+#define CONTINUUM_IMAGE "Continuum40.bin"
+
+/* Entry of the key routine, and the return address it is run up to */
+#define CONTINUUM_START_EIP (0x00457D60)
+#define CONTINUUM_STOP_EIP (0x00458BD0)
+
+/* Virtual buffer the routine fills from the key */
+#define CONTINUUM_BUFFER (0x0012F880)
+#define CONTINUUM_BUFFER_SIZE (80)
+/* Object the routine is a thiscall method of; its first field points at the buffer */
+#define CONTINUUM_THIS (0x0012F8F8)
+
+/* Emulator To 512 bytes copy the contents of the binary file to the memory. Returns the size read, or -1 if the file can not be opened */
+long read_binary(Emulator* emu, const char* filename);
+
+/* To those specified the initial value of the registers and the stack to call the key routine with key */
+void setup_continuum(Emulator* emu, uint32_t key);
+
+#endif
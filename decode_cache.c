@@ -0,0 +1,251 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "decode_cache.h"
+#include "block_cache.h"
+#include "emulator_function.h"
+#include "guest_memory.h"
+
+/* Operand format of each primary opcode, as the handlers in instruction.c consume it */
+#define F_MODRM (1)
+#define F_IMM8  (1 << 1)
+/* 32-bit immediate whatever the operand size */
+#define F_IMM32 (1 << 2)
+/* 32-bit immediate, 16-bit under the operand size prefix */
+#define F_IMMV  (1 << 3)
+/* Immediate only present for ModRM opcode field 0 (0xF7 /0 TEST) */
+#define F_REG0  (1 << 4)
+/* Two byte opcode */
+#define F_0F    (1 << 5)
+/* 16-bit immediate whatever the operand size */
+#define F_IMM16 (1 << 6)
+
+static const uint8_t opcode_format[256] = {
+	[0x01] = F_MODRM, [0x03] = F_MODRM, [0x04] = F_IMM8, [0x05] = F_IMM32,
+	[0x09] = F_MODRM, [0x0B] = F_MODRM, [0x0D] = F_IMM32, [0x0F] = F_0F,
+	[0x21] = F_MODRM, [0x23] = F_MODRM, [0x25] = F_IMM32,
+	[0x29] = F_MODRM, [0x2B] = F_MODRM, [0x2D] = F_IMM32,
+	[0x31] = F_MODRM, [0x33] = F_MODRM, [0x35] = F_IMM32,
+	[0x3B] = F_MODRM, [0x3C] = F_IMM8, [0x3D] = F_IMM32,
+	[0x68] = F_IMM32, [0x69] = F_MODRM | F_IMMV, [0x6A] = F_IMM8,
+	[0x70 ... 0x7F] = F_IMM8,
+	[0x81] = F_MODRM | F_IMM32, [0x83] = F_MODRM | F_IMM8, [0x85] = F_MODRM,
+	[0x88 ... 0x8B] = F_MODRM, [0x8D] = F_MODRM,
+	[0xB0 ... 0xB7] = F_IMM8, [0xB8 ... 0xBF] = F_IMM32,
+	[0xC1] = F_MODRM | F_IMM8, [0xC2] = F_IMM16, [0xC7] = F_MODRM | F_IMM32, [0xCD] = F_IMM8,
+	[0xD1] = F_MODRM, [0xD3] = F_MODRM,
+	[0xE4] = F_IMM8, [0xE8] = F_IMM32, [0xE9] = F_IMM32, [0xEB] = F_IMM8,
+	[0xF7] = F_MODRM | F_IMMV | F_REG0, [0xFF] = F_MODRM,
+};
+
+#if FUSE_PAIRS
+/*
+ * Fused handler of the instruction when a Jcc rel8 follows it, 0 when none:
+ * only cmp and test, whose pairs compute the flags from the decoded
+ * operands. Other ALU instructions would still run their own handler, which
+ * saves nothing over dispatching the Jcc.
+ */
+static int jcc_pair(const DecodedInstruction* insn) {
+	switch (insn->opcode) {
+		case 0x3B: case 0x3D:
+			return FUSED_CMP_JCC;
+		case 0x81: case 0x83:
+			return insn->modrm.opcode == 7 ? FUSED_CMP_JCC : 0;
+		case 0x85:
+			return FUSED_TEST_JCC;
+		default:
+			return 0;
+	}
+}
+
+/* Pair the instruction with the one after it when they fuse */
+static void fuse_pair(Emulator* emu, DecodedInstruction* insn) {
+	uint8_t next = get_code8(emu, insn->length);
+
+	/* The next instruction decodes in the default mode only after a default mode one */
+	if (insn->mode != DEFAULT_MODE) {
+		return;
+	}
+
+	if (next >= 0x70 && next <= 0x7F && instructions[next] != NULL && jcc_pair(insn) != 0) {
+		insn->handler = jcc_pair(insn);
+		insn->fused_length = insn->length + 2;
+		insn->condition = next & 0x0F;
+		insn->target = insn->eip + insn->fused_length + get_sign_code8(emu, insn->length + 1);
+	} else if (insn->opcode == 0x55 && ((next == 0x8B && get_code8(emu, 2) == 0xEC) || (next == 0x89 && get_code8(emu, 2) == 0xE5))) {
+		insn->handler = FUSED_PUSH_EBP_MOV;
+		insn->fused_length = 3;
+	} else {
+		return;
+	}
+
+	/* Writing to the second instruction must drop the pair too */
+	set_code_page(emu, insn->eip + insn->fused_length - 1, 1);
+}
+#endif
+
+DecodeCache* create_decode_cache(void) {
+	DecodeCache* cache = malloc(sizeof(DecodeCache));
+	memset(cache, 0, sizeof(DecodeCache));
+	return cache;
+}
+
+void destroy_decode_cache(DecodeCache* cache) {
+	free(cache);
+}
+
+#define PAGE_CHAIN(eip) (((eip) >> DECODE_PAGE_SHIFT) & (DECODE_PAGE_CHAINS - 1))
+
+/* Put entry i, just filled, on the chain of its page */
+static void link_page(DecodeCache* cache, int i) {
+	uint16_t* head = &cache->pages[PAGE_CHAIN(cache->entries[i].eip)];
+
+	cache->prev_on_page[i] = 0;
+	cache->next_on_page[i] = *head;
+	if (*head != 0) {
+		cache->prev_on_page[*head - 1] = i + 1;
+	}
+	*head = i + 1;
+}
+
+/* Take entry i off the chain of its page and empty it */
+static void unlink_page(DecodeCache* cache, int i) {
+	uint16_t prev = cache->prev_on_page[i];
+	uint16_t next = cache->next_on_page[i];
+
+	if (prev != 0) {
+		cache->next_on_page[prev - 1] = next;
+	} else {
+		cache->pages[PAGE_CHAIN(cache->entries[i].eip)] = next;
+	}
+	if (next != 0) {
+		cache->prev_on_page[next - 1] = prev;
+	}
+	cache->entries[i].length = 0;
+}
+
+/* Decode the instruction at the program counter into insn */
+static void decode_instruction(Emulator* emu, DecodedInstruction* insn, uint32_t mode) {
+	uint8_t format;
+	int index = 1;
+
+	memset(insn, 0, sizeof(DecodedInstruction));
+	insn->eip = emu->eip;
+	insn->mode = mode;
+	insn->opcode = get_code8(emu, 0);
+	insn->func = select_instruction(insn->opcode, mode);
+	insn->handler = insn->func == instructions[insn->opcode] ? insn->opcode : PREFIXED;
+	format = opcode_format[insn->opcode];
+
+	if (format & F_0F) {
+		/* 0x0F AF is the only two byte opcode implemented */
+		if (get_code8(emu, 1) == 0xAF) {
+			format = F_MODRM;
+		}
+		index = 2;
+	}
+
+	if (format & F_MODRM) {
+		/* mov_r_rm is the only handler parsing 16-bit address forms */
+		insn->modrm_16bit = insn->opcode == 0x8B && !(mode & PREFIX_ADDRESS_MODE_32_BIT);
+		insn->modrm_offset = index;
+		insn->modrm_length = decode_modrm(emu, &insn->modrm, index, insn->modrm_16bit);
+		index += insn->modrm_length;
+
+		/* A group opcode goes straight to the handler of its sub-opcode */
+		if (insn->handler == insn->opcode && group_instructions[insn->opcode << 3 | insn->modrm.opcode] != NULL) {
+			insn->func = group_instructions[insn->opcode << 3 | insn->modrm.opcode];
+			insn->handler = GROUP_HANDLER(insn->opcode, insn->modrm.opcode);
+		}
+#if SPLIT_FORMS
+		/* So does an r/m opcode to the handler of its register or memory form */
+		if (insn->handler == insn->opcode && form_instructions[insn->opcode << 1 | (insn->modrm.mod != 3)] != NULL) {
+			insn->func = form_instructions[insn->opcode << 1 | (insn->modrm.mod != 3)];
+			insn->handler = FORM_HANDLER(insn->opcode, insn->modrm.mod != 3);
+		}
+#endif
+	}
+
+	if ((format & F_REG0) && insn->modrm.opcode != 0) {
+		format &= ~F_IMMV;
+	}
+
+	if (format & F_IMM8) {
+		insn->imm = get_code8(emu, index);
+		index += 1;
+	} else if (format & F_IMM16) {
+		insn->imm = get_code16(emu, index);
+		index += 2;
+	} else if (format & F_IMM32) {
+		insn->imm = get_code32(emu, index);
+		index += 4;
+	} else if (format & F_IMMV) {
+		if (mode & PREFIX_OPSIZE_MODE_32_BIT) {
+			insn->imm = get_code32(emu, index);
+			index += 4;
+		} else {
+			insn->imm = get_code16(emu, index);
+			index += 2;
+		}
+	}
+
+	insn->length = index;
+
+	/* Remember the pages so that writing to them drops this entry */
+	set_code_page(emu, insn->eip, 1);
+	set_code_page(emu, insn->eip + index - 1, 1);
+
+#if FUSE_PAIRS
+	if (insn->func != NULL) {
+		fuse_pair(emu, insn);
+	}
+#endif
+}
+
+DecodedInstruction* fetch_decoded(Emulator* emu) {
+	uint32_t mode = emu->prefix_mode & DECODE_MODE_MASK;
+	DecodedInstruction* insn = &emu->decode_cache->entries[emu->eip & (DECODE_CACHE_SIZE - 1)];
+
+	if (insn->length == 0 || insn->eip != emu->eip || insn->mode != mode) {
+		int i = insn - emu->decode_cache->entries;
+
+		if (insn->length != 0) {
+			unlink_page(emu->decode_cache, i);
+		}
+		decode_instruction(emu, insn, mode);
+		link_page(emu->decode_cache, i);
+	}
+
+	return insn;
+}
+
+/* Drop the entries of the page chain of chain_page overlapping page */
+static void invalidate_chain(DecodeCache* cache, uint32_t chain_page, uint32_t page) {
+	uint16_t next = cache->pages[chain_page & (DECODE_PAGE_CHAINS - 1)];
+
+	while (next != 0) {
+		int i = next - 1;
+		DecodedInstruction* insn = &cache->entries[i];
+
+		next = cache->next_on_page[i];
+		if ((insn->eip >> DECODE_PAGE_SHIFT) == page
+				|| ((insn->eip + insn->length - 1) >> DECODE_PAGE_SHIFT) == page
+				|| (insn->fused_length != 0 && ((insn->eip + insn->fused_length - 1) >> DECODE_PAGE_SHIFT) == page)) {
+			unlink_page(cache, i);
+		}
+	}
+}
+
+void invalidate_decoded(Emulator* emu, uint32_t address) {
+	uint32_t page = address >> DECODE_PAGE_SHIFT;
+
+	/* Entries starting on the page, and entries of the page before running into it */
+	invalidate_chain(emu->decode_cache, page, page);
+	invalidate_chain(emu->decode_cache, page - 1, page);
+
+	set_code_page(emu, address, 0);
+
+	invalidate_blocks(emu, address);
+}
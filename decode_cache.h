@@ -0,0 +1,91 @@
+#ifndef DECODE_CACHE_H_
+#define DECODE_CACHE_H_
+
+#include <stdint.h>
+
+#include "emulator.h"
+#include "instruction.h"
+#include "modrm.h"
+
+/* Number of cached instructions (direct mapped on the low bits of EIP) */
+#define DECODE_CACHE_SIZE (1 << 13)
+
+/* Granularity of the self-modifying code check: guest pages carry a PAGE_CODE flag */
+#define DECODE_PAGE_SHIFT (GUEST_PAGE_SHIFT)
+
+/* Number of page chains, indexed by the low bits of the page of an instruction's first byte */
+#define DECODE_PAGE_CHAINS (1 << 10)
+
+/*
+ * Decode cmp or test followed by a Jcc rel8, and push ebp
+ * followed by mov ebp, esp, as a fused pair that run_instructions runs in
+ * one dispatch. The second instruction keeps an entry of its own for jumps
+ * to it and for the other runners; -DFUSE_PAIRS=0 turns fusion off.
+ */
+#ifndef FUSE_PAIRS
+#define FUSE_PAIRS (1)
+#endif
+
+/*
+ * Point an r/m, r or r, r/m instruction at the handler for its register
+ * form or its memory form, which skip the mod == 3 test of get_rm32 and
+ * compute the address once; -DSPLIT_FORMS=0 keeps the opcode handler.
+ */
+#ifndef SPLIT_FORMS
+#define SPLIT_FORMS (1)
+#endif
+
+/* One instruction decoded at a guest address */
+typedef struct DecodedInstruction {
+  /* Guest address of the first byte (prefixes are instructions of their own) */
+  uint32_t eip;
+  /* Prefix bits (DECODE_MODE_MASK) the instruction was decoded under */
+  uint32_t mode;
+  /* Handler from instructions[] (NULL when not implemented) */
+  instruction_func_t* func;
+  /* Primary opcode */
+  uint8_t opcode;
+  /* Total length in bytes, 0 marks an empty slot */
+  uint8_t length;
+  /* Position of the ModRM byte from eip, 0 when there is none */
+  uint8_t modrm_offset;
+  /* ModRM + SIB + displacement bytes */
+  uint8_t modrm_length;
+  /* mode_16bit value the ModRM was decoded with */
+  uint8_t modrm_16bit;
+  /* Decoded ModRM, SIB and displacement */
+  ModRM modrm;
+  /* Immediate operand (zero extended) */
+  uint32_t imm;
+  /* What run_instructions dispatches on: the opcode, PREFIXED to run func, a GROUP_HANDLER or FORM_HANDLER, or a FUSED_* handler also running the next instruction */
+  uint16_t handler;
+  /* Bytes of both instructions of a fused pair, 0 when not fused */
+  uint8_t fused_length;
+  /* Condition of a fused Jcc (low nibble of its opcode), and where it jumps */
+  uint8_t condition;
+  uint32_t target;
+} DecodedInstruction;
+
+typedef struct DecodeCache {
+  DecodedInstruction entries[DECODE_CACHE_SIZE];
+  /*
+   * Filled entries by the page of their first byte, so that a write drops
+   * only the entries of its page. Chains hold entry index + 1, 0 ends one.
+   */
+  uint16_t pages[DECODE_PAGE_CHAINS];
+  uint16_t next_on_page[DECODE_CACHE_SIZE];
+  uint16_t prev_on_page[DECODE_CACHE_SIZE];
+} DecodeCache;
+
+/* To create an empty decode cache */
+DecodeCache* create_decode_cache(void);
+/* Discard the decode cache */
+void destroy_decode_cache(DecodeCache* cache);
+
+/* Get the decoded instruction at the program counter, decoding it on a miss */
+DecodedInstruction* fetch_decoded(Emulator* emu);
+
+/* Drop every cached instruction overlapping the page of address */
+void invalidate_decoded(Emulator* emu, uint32_t address);
+
+#endif
@@ -3,8 +3,12 @@
 
 #include <stdint.h>
 
-/* Memory 10 MB */
-#define MEMORY_SIZE ((1024 * 1024) * 10)
+/* Guest memory: the full 32-bit space in 4 KB pages, allocated on first write (see memory.h) */
+#define GUEST_PAGE_SHIFT (12)
+#define GUEST_PAGE_SIZE (1 << GUEST_PAGE_SHIFT)
+#define GUEST_TABLE_SHIFT (10)
+#define GUEST_TABLE_ENTRIES (1 << GUEST_TABLE_SHIFT)
+#define GUEST_DIRECTORY_ENTRIES (1 << (32 - GUEST_PAGE_SHIFT - GUEST_TABLE_SHIFT))
 
 /* Program starting address */
 #define PROGRAM_ORIGIN (0x00401000)
@@ -24,24 +28,49 @@
 #define PREFIX_REPNE (1 << 9)
 #define PREFIX_REPE (1 << 10)
 #define PREFIX_REP (PREFIX_REPE | PREFIX_REPNE)
+/* No prefix pending: if current segment is CS (CODE) default modes are 32 bit */
+#define DEFAULT_MODE (PREFIX_OPSIZE_MODE_32_BIT | PREFIX_ADDRESS_MODE_32_BIT)
+/* Prefix bits an instruction is decoded under (decode_cache.h) */
+#define DECODE_MODE_MASK (PREFIX_OPSIZE_MODE_32_BIT | PREFIX_ADDRESS_MODE_32_BIT | PREFIX_REP)
 
 enum Register { EAX, ECX, EDX, EBX, ESP, EBP, ESI, EDI, REGISTERS_COUNT,
   AL = EAX, CL = ECX, DL = EDX, BL = EBX,
   AH = AL + 4, CH = CL + 4, DH = DL + 4, BH = BL + 4,
   AX = EAX, CX = ECX, DX = EDX, BX = EBX,
-  SP = ESP, BP = EBP, SI = ESI, DI = ESI };
+  SP = ESP, BP = EBP, SI = ESI, DI = EDI };
 
 typedef struct {
   /* General-purpose register */
   uint32_t registers[REGISTERS_COUNT];
   /* EFLAGS register */
   uint32_t eflags;
+  /* Last flag setting operation not yet folded into eflags (see emulator_function.h) */
+  uint32_t lazy_op;
+  uint32_t lazy_bits;
+  uint32_t lazy_dst;
+  uint32_t lazy_src;
+  uint32_t lazy_res;
   /* mode */
   uint32_t prefix_mode;
   /* The program counter */
   uint32_t eip;
-  /* Memory (byte sequence) */
-  uint8_t* memory;
+  /* Decoded instruction cache (NULL when not used) */
+  struct DecodeCache* decode_cache;
+  /* Basic block cache of run_blocks (NULL until first used) */
+  struct BlockCache* block_cache;
+  /* Cache entry of the instruction being executed (NULL when not decoded) */
+  struct DecodedInstruction* insn;
+  /* Snapshot the pages are shared with until written (NULL when every page is private) */
+  struct Snapshot* snapshot;
+  /* Page numbers written since the snapshot was made or restored */
+  uint32_t* dirty_list;
+  uint32_t dirty_count;
+  uint32_t dirty_size;
+  /* Files load_file mapped pages of (see guest_memory.h) */
+  struct FileMapping** mappings;
+  uint32_t mapping_count;
+  /* Memory: page tables of 4 MB each, NULL where nothing was written */
+  struct PageTable* page_directory[GUEST_DIRECTORY_ENTRIES];
 } Emulator;
 
 #endif
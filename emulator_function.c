@@ -1,8 +1,14 @@
+#include <string.h>
+
 #include "emulator_function.h"
+#include "decode_cache.h"
+#include "block_cache.h"
+#include "guest_memory.h"
 
 uint8_t get_code8(Emulator* emu, int index)
 {
-	return emu->memory[emu->eip + index];
+	uint32_t address = emu->eip + index;
+	return get_page(emu, address)[GUEST_PAGE_OFFSET(address)];
 }
 
 int8_t get_sign_code8(Emulator* emu, int index)
@@ -15,6 +21,14 @@ uint32_t get_code16(Emulator* emu, int index)
 {
   int i;
   uint32_t ret = 0;
+  uint32_t address = emu->eip + index;
+
+#if WORD_MEMORY_ACCESS
+  /* One load unless the value crosses into the next page */
+  if (GUEST_IN_PAGE(address, 2)) {
+    return load_le16(get_page(emu, address) + GUEST_PAGE_OFFSET(address));
+  }
+#endif
 
   /* Get the value of the memory in little-endian */
   for (i = 0; i < 2; i++) {
@@ -33,6 +47,14 @@ uint32_t get_code32(Emulator* emu, int index)
 {
   int i;
   uint32_t ret = 0;
+  uint32_t address = emu->eip + index;
+
+#if WORD_MEMORY_ACCESS
+  /* One load unless the value crosses into the next page */
+  if (GUEST_IN_PAGE(address, 4)) {
+    return load_le32(get_page(emu, address) + GUEST_PAGE_OFFSET(address));
+  }
+#endif
 
   /* Get the value of the memory in little-endian */
   for (i = 0; i < 4; i++) {
@@ -90,20 +112,12 @@ void set_register8(Emulator* emu, int index, uint8_t value)
 
 uint32_t get_memory8(Emulator* emu, uint32_t address)
 {
-	if(address > MEMORY_SIZE) {
-		printf("error cant access this memory: %X\n", address);
-		return;
-	}
-	 return emu->memory[address];
+	return get_page(emu, address)[GUEST_PAGE_OFFSET(address)];
 }
 
 void set_memory8(Emulator* emu, uint32_t address, uint32_t value)
 {
-	if(address > MEMORY_SIZE) {
-		printf("error cant set this memory: %X = %X\n", address, value);
-		return;
-	}
-	emu->memory[address] = value & 0xFF;
+	get_writable_page(emu, address)[GUEST_PAGE_OFFSET(address)] = value & 0xFF;
 }
 
 uint32_t get_memory16(Emulator* emu, uint32_t address)
@@ -111,6 +125,13 @@ uint32_t get_memory16(Emulator* emu, uint32_t address)
   int i;
   uint32_t ret = 0;
 
+#if WORD_MEMORY_ACCESS
+  /* One load unless the value crosses into the next page */
+  if (GUEST_IN_PAGE(address, 2)) {
+    return load_le16(get_page(emu, address) + GUEST_PAGE_OFFSET(address));
+  }
+#endif
+
   /* To get the value of the memory in little-endian */
   for (i = 0; i < 2; i++) {
     ret |= get_memory8(emu, address + i) << (8 * i);
@@ -123,6 +144,14 @@ void set_memory16(Emulator* emu, uint32_t address, uint32_t value)
 {
   int i;
 
+#if WORD_MEMORY_ACCESS
+  /* One store unless the value crosses into the next page */
+  if (GUEST_IN_PAGE(address, 2)) {
+    store_le16(get_writable_page(emu, address) + GUEST_PAGE_OFFSET(address), value);
+    return;
+  }
+#endif
+
   /* To set the value of the memory in little-endian */
   for (i = 0; i < 2; i++) {
     set_memory8(emu, address + i, value >> (i * 8));
@@ -134,6 +163,13 @@ uint32_t get_memory32(Emulator* emu, uint32_t address)
   int i;
   uint32_t ret = 0;
 
+#if WORD_MEMORY_ACCESS
+  /* One load unless the value crosses into the next page */
+  if (GUEST_IN_PAGE(address, 4)) {
+    return load_le32(get_page(emu, address) + GUEST_PAGE_OFFSET(address));
+  }
+#endif
+
   /* To get the value of the memory in little-endian */
   for (i = 0; i < 4; i++) {
     ret |= get_memory8(emu, address + i) << (8 * i);
@@ -146,6 +182,14 @@ void set_memory32(Emulator* emu, uint32_t address, uint32_t value)
 {
   int i;
 
+#if WORD_MEMORY_ACCESS
+  /* One store unless the value crosses into the next page */
+  if (GUEST_IN_PAGE(address, 4)) {
+    store_le32(get_writable_page(emu, address) + GUEST_PAGE_OFFSET(address), value);
+    return;
+  }
+#endif
+
   /* To set the value of the memory in little-endian */
   for (i = 0; i < 4; i++) {
     set_memory8(emu, address + i, value >> (i * 8));
@@ -184,8 +228,162 @@ uint16_t pop16(Emulator* emu)
   return (uint16_t)ret;
 }
 
+/* SF, ZF and PF of each byte value */
+const uint8_t szp_table[256] = {
+  0x0A, 0x00, 0x00, 0x02, 0x00, 0x02, 0x02, 0x00, 0x00, 0x02, 0x02, 0x00, 0x02, 0x00, 0x00, 0x02,
+  0x00, 0x02, 0x02, 0x00, 0x02, 0x00, 0x00, 0x02, 0x02, 0x00, 0x00, 0x02, 0x00, 0x02, 0x02, 0x00,
+  0x00, 0x02, 0x02, 0x00, 0x02, 0x00, 0x00, 0x02, 0x02, 0x00, 0x00, 0x02, 0x00, 0x02, 0x02, 0x00,
+  0x02, 0x00, 0x00, 0x02, 0x00, 0x02, 0x02, 0x00, 0x00, 0x02, 0x02, 0x00, 0x02, 0x00, 0x00, 0x02,
+  0x00, 0x02, 0x02, 0x00, 0x02, 0x00, 0x00, 0x02, 0x02, 0x00, 0x00, 0x02, 0x00, 0x02, 0x02, 0x00,
+  0x02, 0x00, 0x00, 0x02, 0x00, 0x02, 0x02, 0x00, 0x00, 0x02, 0x02, 0x00, 0x02, 0x00, 0x00, 0x02,
+  0x02, 0x00, 0x00, 0x02, 0x00, 0x02, 0x02, 0x00, 0x00, 0x02, 0x02, 0x00, 0x02, 0x00, 0x00, 0x02,
+  0x00, 0x02, 0x02, 0x00, 0x02, 0x00, 0x00, 0x02, 0x02, 0x00, 0x00, 0x02, 0x00, 0x02, 0x02, 0x00,
+  0x10, 0x12, 0x12, 0x10, 0x12, 0x10, 0x10, 0x12, 0x12, 0x10, 0x10, 0x12, 0x10, 0x12, 0x12, 0x10,
+  0x12, 0x10, 0x10, 0x12, 0x10, 0x12, 0x12, 0x10, 0x10, 0x12, 0x12, 0x10, 0x12, 0x10, 0x10, 0x12,
+  0x12, 0x10, 0x10, 0x12, 0x10, 0x12, 0x12, 0x10, 0x10, 0x12, 0x12, 0x10, 0x12, 0x10, 0x10, 0x12,
+  0x10, 0x12, 0x12, 0x10, 0x12, 0x10, 0x10, 0x12, 0x12, 0x10, 0x10, 0x12, 0x10, 0x12, 0x12, 0x10,
+  0x12, 0x10, 0x10, 0x12, 0x10, 0x12, 0x12, 0x10, 0x10, 0x12, 0x12, 0x10, 0x12, 0x10, 0x10, 0x12,
+  0x10, 0x12, 0x12, 0x10, 0x12, 0x10, 0x10, 0x12, 0x12, 0x10, 0x10, 0x12, 0x10, 0x12, 0x12, 0x10,
+  0x10, 0x12, 0x12, 0x10, 0x12, 0x10, 0x10, 0x12, 0x12, 0x10, 0x10, 0x12, 0x10, 0x12, 0x12, 0x10,
+  0x12, 0x10, 0x10, 0x12, 0x10, 0x12, 0x12, 0x10, 0x10, 0x12, 0x12, 0x10, 0x12, 0x10, 0x10, 0x12,
+};
+
+/* Flags each kind of lazy operation defines */
+static const uint32_t lazy_mask[] = {
+  [LAZY_NONE] = 0,
+  [LAZY_ADD] = CARRY_FLAG | PARITY_FLAG | AUX_FLAG | ZERO_FLAG | SIGN_FLAG | OVERFLOW_FLAG,
+  [LAZY_SUB] = CARRY_FLAG | PARITY_FLAG | AUX_FLAG | ZERO_FLAG | SIGN_FLAG | OVERFLOW_FLAG,
+  [LAZY_LOGIC] = CARRY_FLAG | PARITY_FLAG | AUX_FLAG | ZERO_FLAG | SIGN_FLAG | OVERFLOW_FLAG,
+  [LAZY_TEST] = CARRY_FLAG | PARITY_FLAG | ZERO_FLAG | SIGN_FLAG | OVERFLOW_FLAG,
+  [LAZY_INC] = PARITY_FLAG | AUX_FLAG | ZERO_FLAG | SIGN_FLAG | OVERFLOW_FLAG,
+  [LAZY_DEC] = PARITY_FLAG | AUX_FLAG | ZERO_FLAG | SIGN_FLAG | OVERFLOW_FLAG,
+};
+
+uint32_t lazy_flags_mask(uint32_t op)
+{
+  return lazy_mask[op];
+}
+
+/* Compute the flags in mask the pending operation defines */
+static uint32_t eval_lazy_flags(Emulator* emu, uint32_t mask)
+{
+  uint32_t v1 = emu->lazy_dst;
+  uint32_t v2 = emu->lazy_src;
+  uint32_t res = emu->lazy_res;
+  uint32_t sign_bit = 1u << (emu->lazy_bits - 1);
+  uint32_t chain = 0;
+  uint32_t flags;
+
+  mask &= lazy_mask[emu->lazy_op];
+
+  switch (emu->lazy_op) {
+    case LAZY_ADD:
+    case LAZY_INC:
+      /* calculate the carry chain. */
+      chain = (v1 & v2) | ((~res) & (v1 | v2));
+      break;
+    case LAZY_SUB:
+    case LAZY_DEC:
+      /* calculate the borrow chain. */
+      chain = (res & (~v1 | v2)) | (~v1 & v2);
+      break;
+  }
+
+  /* Every flag at once, then the ones asked for */
+  flags = szp_flags(res, emu->lazy_bits)
+    | ((chain & sign_bit) != 0) * CARRY_FLAG
+    | ((chain >> 3) & 1) * AUX_FLAG
+    | XOR2(chain >> (emu->lazy_bits - 2)) * OVERFLOW_FLAG;
+  return flags & mask;
+}
+
+void flush_lazy_flags(Emulator* emu)
+{
+  uint32_t mask = lazy_mask[emu->lazy_op];
+
+  if (mask != 0) {
+    emu->eflags = (emu->eflags & ~mask) | eval_lazy_flags(emu, mask);
+  }
+  emu->lazy_op = LAZY_NONE;
+}
+
+/* Flags in mask, from the pending operation when it defines them */
+static uint32_t read_flags(Emulator* emu, uint32_t mask)
+{
+  if (lazy_mask[emu->lazy_op] & mask) {
+    return eval_lazy_flags(emu, mask);
+  }
+  return emu->eflags & mask;
+}
+
+static void set_lazy_flags(Emulator* emu, uint32_t op, uint32_t v1, uint32_t v2, uint32_t result, int bits)
+{
+  /* Flags the new operation leaves alone still come from the pending one */
+  if (lazy_mask[emu->lazy_op] & ~lazy_mask[op]) {
+    flush_lazy_flags(emu);
+  }
+
+  emu->lazy_op = op;
+  emu->lazy_bits = bits;
+  emu->lazy_dst = v1;
+  emu->lazy_src = v2;
+  emu->lazy_res = result;
+
+#if !LAZY_FLAGS
+  flush_lazy_flags(emu);
+#endif
+}
+
+void set_flags_add(Emulator* emu, uint32_t v1, uint32_t v2, uint32_t result, int bits)
+{
+  set_lazy_flags(emu, LAZY_ADD, v1, v2, result, bits);
+}
+
+void set_flags_sub(Emulator* emu, uint32_t v1, uint32_t v2, uint32_t result, int bits)
+{
+  set_lazy_flags(emu, LAZY_SUB, v1, v2, result, bits);
+}
+
+void set_flags_logic(Emulator* emu, uint32_t result, int bits)
+{
+  set_lazy_flags(emu, LAZY_LOGIC, 0, 0, result, bits);
+}
+
+void set_flags_test(Emulator* emu, uint32_t result, int bits)
+{
+  set_lazy_flags(emu, LAZY_TEST, 0, 0, result, bits);
+}
+
+void set_flags_inc(Emulator* emu, uint32_t v1, uint32_t result, int bits)
+{
+  set_lazy_flags(emu, LAZY_INC, v1, 1, result, bits);
+}
+
+void set_flags_dec(Emulator* emu, uint32_t v1, uint32_t result, int bits)
+{
+  set_lazy_flags(emu, LAZY_DEC, v1, 1, result, bits);
+}
+
+void set_flags_szp(Emulator* emu, uint32_t result, int bits)
+{
+  merge_flags(emu, SIGN_FLAG | ZERO_FLAG | PARITY_FLAG, szp_flags(result, bits));
+}
+
+void merge_flags(Emulator* emu, uint32_t mask, uint32_t flags)
+{
+  if (emu->lazy_op != LAZY_NONE) {
+    flush_lazy_flags(emu);
+  }
+
+  emu->eflags = (emu->eflags & ~mask) | (flags & mask);
+}
+
 void set_carry(Emulator* emu, int is_carry)
 {
+  if (emu->lazy_op != LAZY_NONE) {
+    flush_lazy_flags(emu);
+  }
+
   if (is_carry) {
     emu->eflags |= CARRY_FLAG;
   } else {
@@ -195,6 +393,10 @@ void set_carry(Emulator* emu, int is_carry)
 
 void set_parity(Emulator* emu, int is_parity)
 {
+  if (emu->lazy_op != LAZY_NONE) {
+    flush_lazy_flags(emu);
+  }
+
   if (is_parity) {
     emu->eflags |= PARITY_FLAG;
   } else {
@@ -204,6 +406,10 @@ void set_parity(Emulator* emu, int is_parity)
 
 void set_aux(Emulator* emu, int is_aux)
 {
+  if (emu->lazy_op != LAZY_NONE) {
+    flush_lazy_flags(emu);
+  }
+
   if (is_aux) {
     emu->eflags |= AUX_FLAG;
   } else {
@@ -213,6 +419,10 @@ void set_aux(Emulator* emu, int is_aux)
 
 void set_zero(Emulator* emu, int is_zero)
 {
+  if (emu->lazy_op != LAZY_NONE) {
+    flush_lazy_flags(emu);
+  }
+
   if (is_zero) {
     emu->eflags |= ZERO_FLAG;
   } else {
@@ -222,6 +432,10 @@ void set_zero(Emulator* emu, int is_zero)
 
 void set_sign(Emulator* emu, int is_sign)
 {
+  if (emu->lazy_op != LAZY_NONE) {
+    flush_lazy_flags(emu);
+  }
+
   if (is_sign) {
     emu->eflags |= SIGN_FLAG;
   } else {
@@ -258,6 +472,10 @@ void set_direction(Emulator* emu, int is_direction)
 
 void set_overflow(Emulator* emu, int is_overflow)
 {
+  if (emu->lazy_op != LAZY_NONE) {
+    flush_lazy_flags(emu);
+  }
+
   if (is_overflow) {
     emu->eflags |= OVERFLOW_FLAG;
   } else {
@@ -267,27 +485,27 @@ void set_overflow(Emulator* emu, int is_overflow)
 
 int is_carry(Emulator* emu)
 {
-  return (emu->eflags & CARRY_FLAG) != 0;
+  return read_flags(emu, CARRY_FLAG) != 0;
 }
 
 int is_parity(Emulator* emu)
 {
-  return (emu->eflags & PARITY_FLAG) != 0;
+  return read_flags(emu, PARITY_FLAG) != 0;
 }
 
 int is_aux(Emulator* emu)
 {
-  return (emu->eflags & AUX_FLAG) != 0;
+  return read_flags(emu, AUX_FLAG) != 0;
 }
 
 int is_zero(Emulator* emu)
 {
-  return (emu->eflags & ZERO_FLAG) != 0;
+  return read_flags(emu, ZERO_FLAG) != 0;
 }
 
 int is_sign(Emulator* emu)
 {
-  return (emu->eflags & SIGN_FLAG) != 0;
+  return read_flags(emu, SIGN_FLAG) != 0;
 }
 
 int is_trap(Emulator* emu)
@@ -307,25 +525,96 @@ int is_direction(Emulator* emu)
 
 int is_overflow(Emulator* emu)
 {
-  return (emu->eflags & OVERFLOW_FLAG) != 0;
+  return read_flags(emu, OVERFLOW_FLAG) != 0;
+}
+
+int test_condition(Emulator* emu, int condition)
+{
+  uint32_t v1 = emu->lazy_dst;
+  uint32_t v2 = emu->lazy_src;
+  uint32_t res = emu->lazy_res;
+  int holds;
+
+  if (emu->lazy_op == LAZY_SUB && emu->lazy_bits == 32) {
+    /* Compare the operands rather than building the flags */
+    switch (condition >> 1) {
+      case 0: holds = ((v1 ^ v2) & (v1 ^ res)) >> 31; break;
+      case 1: holds = v1 < v2; break;
+      case 2: holds = v1 == v2; break;
+      case 3: holds = v1 <= v2; break;
+      case 4: holds = res >> 31; break;
+      case 5: holds = PARITY(res & 0xff); break;
+      case 6: holds = (int32_t)v1 < (int32_t)v2; break;
+      default: holds = (int32_t)v1 <= (int32_t)v2; break;
+    }
+  } else if ((emu->lazy_op == LAZY_LOGIC || emu->lazy_op == LAZY_TEST) && emu->lazy_bits == 32) {
+    /* CF and OF are clear */
+    switch (condition >> 1) {
+      case 0: case 1: holds = 0; break;
+      case 2: case 3: holds = res == 0; break;
+      case 4: case 6: holds = res >> 31; break;
+      case 5: holds = PARITY(res & 0xff); break;
+      default: holds = res == 0 || (res >> 31); break;
+    }
+  } else {
+    switch (condition >> 1) {
+      case 0: holds = is_overflow(emu); break;
+      case 1: holds = is_carry(emu); break;
+      case 2: holds = is_zero(emu); break;
+      case 3: holds = is_carry(emu) || is_zero(emu); break;
+      case 4: holds = is_sign(emu); break;
+      case 5: holds = is_parity(emu); break;
+      case 6: holds = is_sign(emu) != is_overflow(emu); break;
+      default: holds = is_zero(emu) || is_sign(emu) != is_overflow(emu); break;
+    }
+  }
+
+  /* Odd conditions are the negations */
+  return holds ^ (condition & 1);
 }
 
 void update_eflags_sub(Emulator* emu, uint32_t v1, uint32_t v2, uint64_t result)
 {
-  /* Get the code of each value */
-  int sign1 = v1 >> 31;
-  int sign2 = v2 >> 31;
-  int signr = (result >> 31) & 1;
+  /* The borrow out of bit 31 (result >> 32) comes from the borrow chain when read */
+  set_flags_sub(emu, v1, v2, (uint32_t)result, 32);
+}
 
-  /* Carry flag set if there is a carry on the calculation results */
-  set_carry(emu, result >> 32);
+/* To create an emulator */
+Emulator* create_emu(void) {
+	Emulator* emu = malloc(sizeof(Emulator));
+	emu->decode_cache = create_decode_cache();
+	emu->block_cache = NULL;
+	emu->insn = NULL;
+	emu->snapshot = NULL;
+	emu->dirty_list = NULL;
+	emu->dirty_count = 0;
+	emu->dirty_size = 0;
+	emu->mappings = NULL;
+	emu->mapping_count = 0;
 
-  /* The result is 0, the zero flag set */
-  set_zero(emu, result == 0);
+	/* No memory until it is written */
+	memset(emu->page_directory, 0, sizeof(emu->page_directory));
 
-  /* Sign flag set if there is a sign on the calculation results */
-  set_sign(emu, signr);
+	emu->eflags = 0;
+	emu->lazy_op = LAZY_NONE;
+	emu->prefix_mode = 0;
 
-  /* Overflow flag setting result of the operation when I was overflow */
-  set_overflow(emu, sign1 != sign2 && sign1 != signr);
+	//if current segment is CS (CODE) default modes are 32 bit.
+	emu->prefix_mode |= PREFIX_OPSIZE_MODE_32_BIT | PREFIX_ADDRESS_MODE_32_BIT;
+
+	/* All the initial value of the general-purpose register to 0 */
+	memset(emu->registers, 0, sizeof(emu->registers));
+
+	return emu;
+}
+
+/* Discard the emulator */
+void destroy_emu(Emulator* emu) {
+	destroy_decode_cache(emu->decode_cache);
+	if (emu->block_cache != NULL) {
+		destroy_block_cache(emu->block_cache);
+	}
+	free_memory(emu);
+	free(emu->dirty_list);
+	free(emu);
 }
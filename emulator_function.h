@@ -6,19 +6,9 @@
 
 #include "emulator.h"
 
-static uint32_t parity_table[8] =
-{
-	0x96696996,
-	0x69969669,
-	0x69969669,
-	0x96696996,
-	0x69969669,
-	0x96696996,
-	0x96696996,
-	0x69969669,
-};
-
-#define PARITY(x)   (((parity_table[(x) / 32] >> ((x) % 32)) & 1) == 0)
+/* SF, ZF and PF of each byte value */
+extern const uint8_t szp_table[256];
+
 #define XOR2(x) 	(((x) ^ ((x)>>1)) & 0x1)
 
 #define CARRY_FLAG (1)
@@ -31,6 +21,44 @@ static uint32_t parity_table[8] =
 #define DIR_FLAG (1 << 7)
 #define OVERFLOW_FLAG (1 << 8)
 
+#define PARITY(x)   ((szp_table[(x) & 0xff] & PARITY_FLAG) != 0)
+
+/* SF, ZF and PF of a bits wide result: the table covers the low byte, and ZF also needs the bits above it clear */
+static inline uint32_t szp_flags(uint32_t res, int bits)
+{
+  uint32_t sign_bit = 1u << (bits - 1);
+  uint32_t upper = res & (sign_bit | (sign_bit - 1)) & ~0xffu;
+  uint32_t flags = szp_table[res & 0xff];
+
+  return (flags & PARITY_FLAG) | (flags & ZERO_FLAG & -(uint32_t)(upper == 0)) | ((res & sign_bit) != 0) * SIGN_FLAG;
+}
+
+/*
+ * Lazy EFLAGS: the ALU handlers only record the operation, its operands and
+ * its result, and each flag is computed when is_carry, is_zero, ... read it.
+ * Build with -DLAZY_FLAGS=0 to fold the flags into eflags right away.
+ */
+#ifndef LAZY_FLAGS
+#define LAZY_FLAGS (1)
+#endif
+
+/* Kind of operation pending in lazy_op */
+#define LAZY_NONE  (0)
+#define LAZY_ADD   (1)
+#define LAZY_SUB   (2)
+/* and / or / xor: CF, OF and AF cleared */
+#define LAZY_LOGIC (3)
+/* test: like LAZY_LOGIC but AF is left alone */
+#define LAZY_TEST  (4)
+/* inc / dec: CF is left alone */
+#define LAZY_INC   (5)
+#define LAZY_DEC   (6)
+
+/* To create an emulator with nothing in memory */
+Emulator* create_emu(void);
+/* Discard the emulator */
+void destroy_emu(Emulator* emu);
+
 /* Get an unsigned 8-bit value from the program counter to the relative position */
 uint8_t get_code8(Emulator* emu, int index);
 /* Get a signed 8-bit value from the program counter to the relative position */
@@ -110,7 +138,30 @@ int32_t is_interrupt_enable(Emulator* emu);
 int32_t is_direction(Emulator* emu);
 int32_t is_overflow(Emulator* emu);
 
+/* Whether the x86 condition (low nibble of a Jcc opcode) holds, straight from a pending 32-bit sub or logic operation */
+int test_condition(Emulator* emu, int condition);
+
 /* Update function of EFLAGS by subtraction */
 void update_eflags_sub(Emulator* emu, uint32_t v1, uint32_t v2, uint64_t result);
 
+/* Flags of result = v1 + v2 / v1 - v2 on bits wide operands */
+void set_flags_add(Emulator* emu, uint32_t v1, uint32_t v2, uint32_t result, int bits);
+void set_flags_sub(Emulator* emu, uint32_t v1, uint32_t v2, uint32_t result, int bits);
+/* Flags of an and / or / xor, and of a test */
+void set_flags_logic(Emulator* emu, uint32_t result, int bits);
+void set_flags_test(Emulator* emu, uint32_t result, int bits);
+/* Flags of result = v1 + 1 / v1 - 1 */
+void set_flags_inc(Emulator* emu, uint32_t v1, uint32_t result, int bits);
+void set_flags_dec(Emulator* emu, uint32_t v1, uint32_t result, int bits);
+/* SF, ZF and PF of result alone, for the handlers setting the other flags themselves */
+void set_flags_szp(Emulator* emu, uint32_t result, int bits);
+/* Replace the flags in mask with those in flags, e.g. the CF and OF of a rotate */
+void merge_flags(Emulator* emu, uint32_t mask, uint32_t flags);
+
+/* Fold the pending operation into eflags, for code reading eflags directly */
+void flush_lazy_flags(Emulator* emu);
+
+/* Flags a lazy operation LAZY_* defines */
+uint32_t lazy_flags_mask(uint32_t op);
+
 #endif
@@ -0,0 +1,385 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "guest_memory.h"
+#include "decode_cache.h"
+
+#if MAP_FILES
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+const uint8_t zero_page[GUEST_PAGE_SIZE];
+
+/* Page table covering address, allocated empty if there is none */
+static PageTable* get_table(Emulator* emu, uint32_t address) {
+	PageTable** slot = &emu->page_directory[GUEST_DIRECTORY_INDEX(address)];
+
+	if (*slot == NULL) {
+		*slot = calloc(1, sizeof(PageTable));
+	}
+	return *slot;
+}
+
+uint8_t* touch_page(Emulator* emu, uint32_t address) {
+	PageTable* table = get_table(emu, address);
+	uint32_t index = GUEST_TABLE_INDEX(address);
+	uint8_t* page = table->pages[index];
+
+	if (table->flags[index] & PAGE_CODE) {
+		/* Decoded instructions may come from the bytes about to change */
+		invalidate_decoded(emu, address);
+	}
+
+	if (page == NULL || (table->flags[index] & PAGE_SHARED)) {
+		uint8_t* copy = malloc(GUEST_PAGE_SIZE);
+
+		memcpy(copy, page != NULL ? page : zero_page, GUEST_PAGE_SIZE);
+		table->pages[index] = copy;
+		table->flags[index] &= ~(PAGE_SHARED | PAGE_MAPPED);
+		page = copy;
+
+		/* restore_snapshot puts back the pages listed here */
+		if (emu->snapshot != NULL) {
+			if (emu->dirty_count == emu->dirty_size) {
+				emu->dirty_size = emu->dirty_size != 0 ? emu->dirty_size * 2 : 16;
+				emu->dirty_list = realloc(emu->dirty_list, emu->dirty_size * sizeof(uint32_t));
+			}
+			emu->dirty_list[emu->dirty_count++] = address >> GUEST_PAGE_SHIFT;
+		}
+	}
+
+	return page;
+}
+
+void read_memory(Emulator* emu, uint32_t address, void* data, size_t size) {
+	uint8_t* out = data;
+
+	while (size > 0) {
+		uint32_t offset = GUEST_PAGE_OFFSET(address);
+		size_t count = GUEST_PAGE_SIZE - offset < size ? GUEST_PAGE_SIZE - offset : size;
+
+		memcpy(out, get_page(emu, address) + offset, count);
+		out += count;
+		address += count;
+		size -= count;
+	}
+}
+
+void write_memory(Emulator* emu, uint32_t address, const void* data, size_t size) {
+	const uint8_t* in = data;
+
+	while (size > 0) {
+		uint32_t offset = GUEST_PAGE_OFFSET(address);
+		size_t count = GUEST_PAGE_SIZE - offset < size ? GUEST_PAGE_SIZE - offset : size;
+
+		memcpy(get_writable_page(emu, address) + offset, in, count);
+		in += count;
+		address += count;
+		size -= count;
+	}
+}
+
+void fill_memory(Emulator* emu, uint32_t address, uint32_t value, int size, uint32_t length) {
+	uint32_t repeated = (value & 0xFF) * 0x01010101;
+	uint8_t pattern[4];
+	uint32_t phase = 0;
+
+	store_le32(pattern, value);
+	while (length > 0) {
+		uint32_t offset = GUEST_PAGE_OFFSET(address);
+		uint32_t count = GUEST_PAGE_SIZE - offset < length ? GUEST_PAGE_SIZE - offset : length;
+		uint8_t* out = get_writable_page(emu, address) + offset;
+		uint32_t done, i;
+
+		if (size == 1 || (size == 2 && (value & 0xFFFF) == (repeated & 0xFFFF)) || (size == 4 && value == repeated)) {
+			/* Every byte the same */
+			memset(out, pattern[0], count);
+		} else {
+			/* One element from the phase the page starts at, then doubled; the prefix stays a whole number of elements */
+			done = count < (uint32_t)size ? count : size;
+			for (i = 0; i < done; i++) {
+				out[i] = pattern[(phase + i) % size];
+			}
+			while (done < count) {
+				uint32_t copy = count - done < done ? count - done : done;
+				memcpy(out + done, out, copy);
+				done += copy;
+			}
+		}
+
+		phase = (phase + count) % size;
+		address += count;
+		length -= count;
+	}
+}
+
+void move_memory(Emulator* emu, uint32_t dst, uint32_t src, uint32_t length, int down) {
+	if (down) {
+		dst += length;
+		src += length;
+	}
+
+	while (length > 0) {
+		/* The part of this page of both source and destination, from the low end going up or the high end going down */
+		uint32_t dst_room = down ? GUEST_PAGE_OFFSET(dst - 1) + 1 : GUEST_PAGE_SIZE - GUEST_PAGE_OFFSET(dst);
+		uint32_t src_room = down ? GUEST_PAGE_OFFSET(src - 1) + 1 : GUEST_PAGE_SIZE - GUEST_PAGE_OFFSET(src);
+		uint32_t count = dst_room < src_room ? dst_room : src_room;
+		uint32_t dst_start, src_start;
+		uint8_t* out;
+
+		if (count > length) {
+			count = length;
+		}
+		dst_start = down ? dst - count : dst;
+		src_start = down ? src - count : src;
+
+		/* Writable first: copying a shared page may move the source too */
+		out = get_writable_page(emu, dst_start) + GUEST_PAGE_OFFSET(dst_start);
+		memmove(out, get_page(emu, src_start) + GUEST_PAGE_OFFSET(src_start), count);
+
+		dst = down ? dst - count : dst + count;
+		src = down ? src - count : src + count;
+		length -= count;
+	}
+}
+
+uint32_t match_memory(Emulator* emu, uint32_t a, uint32_t b, uint32_t length) {
+	uint32_t matched = 0;
+
+	while (matched < length) {
+		uint32_t a_room = GUEST_PAGE_SIZE - GUEST_PAGE_OFFSET(a + matched);
+		uint32_t b_room = GUEST_PAGE_SIZE - GUEST_PAGE_OFFSET(b + matched);
+		uint32_t count = a_room < b_room ? a_room : b_room;
+		const uint8_t* x = get_page(emu, a + matched) + GUEST_PAGE_OFFSET(a + matched);
+		const uint8_t* y = get_page(emu, b + matched) + GUEST_PAGE_OFFSET(b + matched);
+		uint32_t i;
+
+		if (count > length - matched) {
+			count = length - matched;
+		}
+		if (memcmp(x, y, count) != 0) {
+			for (i = 0; x[i] == y[i]; i++) {
+			}
+			return matched + i;
+		}
+		matched += count;
+	}
+
+	return length;
+}
+
+uint32_t scan_memory(Emulator* emu, uint32_t address, uint32_t value, int size, uint32_t count, int equal) {
+	uint32_t index = 0;
+
+	while (index < count) {
+		uint32_t offset = GUEST_PAGE_OFFSET(address);
+		uint32_t fit = (GUEST_PAGE_SIZE - offset) / size;
+		const uint8_t* page = get_page(emu, address) + offset;
+		uint32_t i;
+
+		if (fit == 0) {
+			/* The element crosses into the next page */
+			uint8_t bytes[4] = { 0 };
+			uint32_t element;
+
+			read_memory(emu, address, bytes, size);
+			element = load_le32(bytes);
+			if ((element == value) == equal) {
+				return index;
+			}
+			index++;
+			address += size;
+			continue;
+		}
+
+		if (fit > count - index) {
+			fit = count - index;
+		}
+		if (size == 1 && equal) {
+			const uint8_t* found = memchr(page, value, fit);
+			if (found != NULL) {
+				return index + (found - page);
+			}
+		} else {
+			for (i = 0; i < fit; i++) {
+				uint32_t element = size == 1 ? page[i] : size == 2 ? load_le16(page + 2 * i) : load_le32(page + 4 * i);
+				if ((element == value) == equal) {
+					return index + i;
+				}
+			}
+		}
+		index += fit;
+		address += fit * size;
+	}
+
+	return count;
+}
+
+/* Copy the file to guest memory at address */
+static long copy_file(Emulator* emu, const char* filename, uint32_t address) {
+	FILE* file = fopen(filename, "rb");
+	uint8_t block[0x200];
+	long size = 0;
+	size_t count;
+
+	if (file == NULL) {
+		return -1;
+	}
+
+	/* Read the machine language file (up to 512 Bytes) at a time */
+	while ((count = fread(block, 1, sizeof(block), file)) > 0) {
+		write_memory(emu, address + size, block, count);
+		size += count;
+	}
+
+	fclose(file);
+	return size;
+}
+
+FileMapping* open_mapping(const char* filename) {
+	FileMapping* mapping;
+	uint8_t* data;
+	size_t size;
+#if MAP_FILES
+	int fd = open(filename, O_RDONLY);
+	struct stat status;
+
+	if (fd < 0) {
+		return NULL;
+	}
+	if (fstat(fd, &status) != 0 || status.st_size <= 0) {
+		close(fd);
+		return NULL;
+	}
+
+	/* The mapping stays valid once the file is closed */
+	size = status.st_size;
+	data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		return NULL;
+	}
+#else
+	FILE* file = fopen(filename, "rb");
+
+	if (file == NULL) {
+		return NULL;
+	}
+	fseek(file, 0, SEEK_END);
+	size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	data = size > 0 ? malloc(size) : NULL;
+	if (data == NULL || fread(data, 1, size, file) != size) {
+		free(data);
+		fclose(file);
+		return NULL;
+	}
+	fclose(file);
+#endif
+
+	mapping = malloc(sizeof(FileMapping));
+	mapping->data = data;
+	mapping->size = size;
+	mapping->references = 0;
+	return mapping;
+}
+
+long load_file(Emulator* emu, const char* filename, uint32_t address) {
+#if MAP_FILES
+	FileMapping* mapping;
+	size_t offset;
+
+	if (GUEST_PAGE_OFFSET(address) != 0 || emu->snapshot != NULL || (mapping = open_mapping(filename)) == NULL) {
+		return copy_file(emu, filename, address);
+	}
+	if (mapping->size > 0x100000000ULL - address) {
+		/* Runs past the top of the address space: copied, wrapping around */
+		munmap(mapping->data, mapping->size);
+		free(mapping);
+		return copy_file(emu, filename, address);
+	}
+	hold_mapping(&emu->mappings, &emu->mapping_count, mapping);
+
+	for (offset = 0; offset < mapping->size; offset += GUEST_PAGE_SIZE) {
+		PageTable* table = get_table(emu, address + offset);
+		uint32_t index = GUEST_TABLE_INDEX(address + offset);
+		size_t count = mapping->size - offset < GUEST_PAGE_SIZE ? mapping->size - offset : GUEST_PAGE_SIZE;
+
+		/* The mapping reads as zero past the end of the file, as a new page would */
+		if (table->pages[index] == NULL && !(table->flags[index] & PAGE_CODE)) {
+			table->pages[index] = mapping->data + offset;
+			table->flags[index] = PAGE_SHARED | PAGE_MAPPED;
+		} else {
+			write_memory(emu, address + offset, mapping->data + offset, count);
+		}
+	}
+
+	return mapping->size;
+#else
+	return copy_file(emu, filename, address);
+#endif
+}
+
+void hold_mapping(FileMapping*** list, uint32_t* count, FileMapping* mapping) {
+	*list = realloc(*list, (*count + 1) * sizeof(FileMapping*));
+	(*list)[(*count)++] = mapping;
+	mapping->references++;
+}
+
+void release_mappings(FileMapping** list, uint32_t count) {
+	uint32_t i;
+
+	for (i = 0; i < count; i++) {
+		if (--list[i]->references == 0) {
+#if MAP_FILES
+			munmap(list[i]->data, list[i]->size);
+#else
+			free(list[i]->data);
+#endif
+			free(list[i]);
+		}
+	}
+	free(list);
+}
+
+void set_code_page(Emulator* emu, uint32_t address, int code) {
+	PageTable* table;
+
+	if (code) {
+		table = get_table(emu, address);
+		table->flags[GUEST_TABLE_INDEX(address)] |= PAGE_CODE;
+	} else {
+		table = emu->page_directory[GUEST_DIRECTORY_INDEX(address)];
+		if (table != NULL) {
+			table->flags[GUEST_TABLE_INDEX(address)] &= ~PAGE_CODE;
+		}
+	}
+}
+
+void free_memory(Emulator* emu) {
+	int i, j;
+
+	for (i = 0; i < GUEST_DIRECTORY_ENTRIES; i++) {
+		PageTable* table = emu->page_directory[i];
+
+		if (table == NULL) {
+			continue;
+		}
+		for (j = 0; j < GUEST_TABLE_ENTRIES; j++) {
+			if (!(table->flags[j] & PAGE_SHARED)) {
+				free(table->pages[j]);
+			}
+		}
+		free(table);
+		emu->page_directory[i] = NULL;
+	}
+
+	release_mappings(emu->mappings, emu->mapping_count);
+	emu->mappings = NULL;
+	emu->mapping_count = 0;
+}
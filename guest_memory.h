@@ -0,0 +1,170 @@
+#ifndef GUEST_MEMORY_H_
+#define GUEST_MEMORY_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "emulator.h"
+
+/*
+ * 16 and 32-bit accesses within one page are a single load or store.
+ * Build with -DWORD_MEMORY_ACCESS=0 to go byte by byte through
+ * get_memory8 / set_memory8 everywhere.
+ */
+#ifndef WORD_MEMORY_ACCESS
+#define WORD_MEMORY_ACCESS (1)
+#endif
+
+/* load_file maps the file's pages (mmap) instead of copying them; -DMAP_FILES=0 always copies */
+#ifndef MAP_FILES
+#if defined(_WIN32)
+#define MAP_FILES (0)
+#else
+#define MAP_FILES (1)
+#endif
+#endif
+
+/* Page flags */
+/* The page belongs to the snapshot and is copied on the first write */
+#define PAGE_SHARED (1)
+/* The page holds instructions of the decode cache; writing to it drops them */
+#define PAGE_CODE (1 << 1)
+/* The page lies in a file mapping; it is never freed, only released with the mapping */
+#define PAGE_MAPPED (1 << 2)
+
+/* Pages of 4 MB of the address space */
+typedef struct PageTable {
+  uint8_t* pages[GUEST_TABLE_ENTRIES];
+  uint8_t flags[GUEST_TABLE_ENTRIES];
+} PageTable;
+
+/* Read-only private mapping of a file that pages of emulators and snapshots point into */
+typedef struct FileMapping {
+  uint8_t* data;
+  size_t size;
+  /* Emulators and snapshots holding it; unmapped when none is left */
+  int references;
+} FileMapping;
+
+#define GUEST_DIRECTORY_INDEX(address) ((address) >> (GUEST_PAGE_SHIFT + GUEST_TABLE_SHIFT))
+#define GUEST_TABLE_INDEX(address) (((address) >> GUEST_PAGE_SHIFT) & (GUEST_TABLE_ENTRIES - 1))
+#define GUEST_PAGE_OFFSET(address) ((address) & (GUEST_PAGE_SIZE - 1))
+
+/* Contents of every page that was never written */
+extern const uint8_t zero_page[GUEST_PAGE_SIZE];
+
+/* Page holding address, to be written. Allocates it, copies a shared page and drops decoded code as needed */
+uint8_t* touch_page(Emulator* emu, uint32_t address);
+
+/* Page holding address, to be read */
+static inline const uint8_t* get_page(Emulator* emu, uint32_t address) {
+	PageTable* table = emu->page_directory[GUEST_DIRECTORY_INDEX(address)];
+	const uint8_t* page;
+
+	if (table == NULL || (page = table->pages[GUEST_TABLE_INDEX(address)]) == NULL) {
+		return zero_page;
+	}
+	return page;
+}
+
+/* Page holding address, to be written */
+static inline uint8_t* get_writable_page(Emulator* emu, uint32_t address) {
+	PageTable* table = emu->page_directory[GUEST_DIRECTORY_INDEX(address)];
+
+	if (table != NULL) {
+		uint32_t index = GUEST_TABLE_INDEX(address);
+		if (table->pages[index] != NULL && !(table->flags[index] & (PAGE_SHARED | PAGE_CODE))) {
+			return table->pages[index];
+		}
+	}
+	return touch_page(emu, address);
+}
+
+/* Little-endian values at any alignment in host memory */
+static inline uint32_t load_le16(const uint8_t* p) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	uint16_t value;
+	memcpy(&value, p, sizeof(value));
+	return value;
+#else
+	return p[0] | (p[1] << 8);
+#endif
+}
+
+static inline uint32_t load_le32(const uint8_t* p) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	uint32_t value;
+	memcpy(&value, p, sizeof(value));
+	return value;
+#else
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+#endif
+}
+
+static inline void store_le16(uint8_t* p, uint32_t value) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	uint16_t v = value;
+	memcpy(p, &v, sizeof(v));
+#else
+	p[0] = value;
+	p[1] = value >> 8;
+#endif
+}
+
+static inline void store_le32(uint8_t* p, uint32_t value) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	memcpy(p, &value, sizeof(value));
+#else
+	p[0] = value;
+	p[1] = value >> 8;
+	p[2] = value >> 16;
+	p[3] = value >> 24;
+#endif
+}
+
+/* Whether size bytes at address lie in one page */
+#define GUEST_IN_PAGE(address, size) (GUEST_PAGE_OFFSET(address) <= GUEST_PAGE_SIZE - (size))
+
+/* Copy size bytes of guest memory at address to data */
+void read_memory(Emulator* emu, uint32_t address, void* data, size_t size);
+/* Copy size bytes of data to guest memory at address */
+void write_memory(Emulator* emu, uint32_t address, const void* data, size_t size);
+
+/*
+ * Bulk accessors for the string instructions: one page lookup per page
+ * instead of per element. Sizes are 1, 2 or 4 bytes.
+ */
+/* Store length bytes from address that repeat the size byte little-endian value, as consecutive stores of it would */
+void fill_memory(Emulator* emu, uint32_t address, uint32_t value, int size, uint32_t length);
+/* Copy length bytes from src to dst, highest byte first when down. Equals a byte by byte copy in that order
+   unless the destination overlaps the part of the source still to be read */
+void move_memory(Emulator* emu, uint32_t dst, uint32_t src, uint32_t length, int down);
+/* How many bytes from the start of a and b are equal, at most length */
+uint32_t match_memory(Emulator* emu, uint32_t a, uint32_t b, uint32_t length);
+/* Index of the first of count elements from address that equals value (or differs when equal is 0); count if none */
+uint32_t scan_memory(Emulator* emu, uint32_t address, uint32_t value, int size, uint32_t count, int equal);
+
+/*
+ * Put the whole file in guest memory at address. Returns its size, or -1 if
+ * it can not be opened. With MAP_FILES, pages of a page aligned address
+ * that hold nothing yet point into a private mapping of the file, faulted
+ * in from the page cache on first read and copied on first write; the rest
+ * is copied. An emulator made from a snapshot always copies.
+ */
+long load_file(Emulator* emu, const char* filename, uint32_t address);
+
+/* Map a whole file (read into memory without MAP_FILES), with no reference held. Returns NULL if it can not be opened or is empty */
+FileMapping* open_mapping(const char* filename);
+/* Add a reference to mapping to the list of an emulator or snapshot */
+void hold_mapping(FileMapping*** list, uint32_t* count, FileMapping* mapping);
+/* Drop the references of a list, unmapping files no one holds, and free it */
+void release_mappings(FileMapping** list, uint32_t count);
+
+/* Mark or unmark the page of address as holding decoded instructions */
+void set_code_page(Emulator* emu, uint32_t address, int code);
+
+/* Release every page and page table of the emulator that is not shared, and its file mappings */
+void free_memory(Emulator* emu);
+
+#endif
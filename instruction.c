@@ -7,11 +7,116 @@
 #include "emulator.h"
 #include "emulator_function.h"
 #include "io.h"
+#include "decode_cache.h"
+#include "guest_memory.h"
+#include "profile.h"
 
 #include "modrm.h"
 
 instruction_func_t* instructions[256];
 
+/* Operand size 16 variant of the handlers that have one, for after 0x66 */
+static instruction_func_t* instructions16[256];
+
+instruction_func_t* group_instructions[256 * 8];
+
+instruction_func_t* form_instructions[256 * 2];
+
+/* The instruction used up its prefixes; if current segment is CS (CODE) default modes are 32 bit */
+static void end_prefixes(Emulator* emu) {
+	emu->prefix_mode &= ~PREFIX_REP;
+	emu->prefix_mode |= DEFAULT_MODE;
+}
+
+/*
+ * Operand size variants. A handler taking the operand size in bits is
+ * written once, and SIZED_HANDLERS makes name32 of it for the default mode
+ * and name16 for after 0x66. Only an instruction decoded under a prefix
+ * runs name16, so it is the one dropping the prefixes; BYTE_HANDLER makes
+ * name8 for the byte opcode of a pair.
+ */
+#define SIZED_HANDLERS(name) \
+	static void name##32(Emulator* emu) { name(emu, 32); } \
+	static void name##16(Emulator* emu) { name(emu, 16); end_prefixes(emu); }
+#define BYTE_HANDLER(name) \
+	static void name##8(Emulator* emu) { name(emu, 8); }
+
+/* Operands of a size in bits; the size is a constant in each variant, so the choice folds away */
+static inline uint32_t get_sized_register(Emulator* emu, int index, int bits) {
+	return bits == 8 ? get_register8(emu, index) : bits == 16 ? get_register16(emu, index) : get_register32(emu, index);
+}
+
+static inline void set_sized_register(Emulator* emu, int index, int bits, uint32_t value) {
+	if (bits == 8) {
+		set_register8(emu, index, value);
+	} else if (bits == 16) {
+		set_register16(emu, index, value);
+	} else {
+		set_register32(emu, index, value);
+	}
+}
+
+static inline uint32_t get_sized_rm(Emulator* emu, ModRM* modrm, int bits) {
+	return bits == 16 ? get_rm16(emu, modrm) : get_rm32(emu, modrm);
+}
+
+static inline void set_sized_rm(Emulator* emu, ModRM* modrm, int bits, uint32_t value) {
+	if (bits == 16) {
+		set_rm16(emu, modrm, value);
+	} else {
+		set_rm32(emu, modrm, value);
+	}
+}
+
+static inline uint32_t get_sized_memory(Emulator* emu, uint32_t address, int bits) {
+	return bits == 8 ? get_memory8(emu, address) : bits == 16 ? get_memory16(emu, address) : get_memory32(emu, address);
+}
+
+static inline void set_sized_memory(Emulator* emu, uint32_t address, int bits, uint32_t value) {
+	if (bits == 8) {
+		set_memory8(emu, address, value);
+	} else if (bits == 16) {
+		set_memory16(emu, address, value);
+	} else {
+		set_memory32(emu, address, value);
+	}
+}
+
+/*
+ * Immediate operands, index bytes from EIP. The decoder already read the
+ * immediate of the instruction running from the decode cache into insn->imm;
+ * it is the last bytes of the instruction, which is how a read is matched to
+ * it. Anything else is read from the code.
+ */
+static inline bool is_decoded_imm(Emulator* emu, int index, int size) {
+	DecodedInstruction* insn = emu->insn;
+	return insn != NULL && emu->eip + index + size == insn->eip + insn->length;
+}
+
+static inline uint8_t get_imm8(Emulator* emu, int index) {
+	return is_decoded_imm(emu, index, 1) ? (uint8_t)emu->insn->imm : get_code8(emu, index);
+}
+
+static inline int8_t get_sign_imm8(Emulator* emu, int index) {
+	return (int8_t)get_imm8(emu, index);
+}
+
+static inline uint16_t get_imm16(Emulator* emu, int index) {
+	return is_decoded_imm(emu, index, 2) ? (uint16_t)emu->insn->imm : get_code16(emu, index);
+}
+
+static inline uint32_t get_imm32(Emulator* emu, int index) {
+	return is_decoded_imm(emu, index, 4) ? emu->insn->imm : get_code32(emu, index);
+}
+
+static inline int32_t get_sign_imm32(Emulator* emu, int index) {
+	return (int32_t)get_imm32(emu, index);
+}
+
+static inline uint32_t get_sized_imm(Emulator* emu, int index, int bits) {
+	return bits == 16 ? get_imm16(emu, index) : get_imm32(emu, index);
+}
+
 /* 0x01 */
 static void add_rm32_r32(Emulator* emu) {
 	emu->eip += 1;
@@ -20,18 +125,9 @@ static void add_rm32_r32(Emulator* emu) {
 	uint32_t r32 = get_r32(emu, &modrm);
 	uint32_t rm32 = get_rm32(emu, &modrm);
 	
-	register uint32_t lo = (rm32 & 0xFFFF) + (r32 & 0xFFFF);
-	register uint32_t hi = (lo >> 16) + (rm32 >> 16) + (r32 >> 16);
 	register uint32_t res = rm32 + r32;
-	/* calculate the carry chain. */
-	register uint32_t cc = (rm32 & r32) | ((~res) & (rm32 | r32));
 	
-	set_carry(emu, hi & 0x10000);
-    set_zero(emu, (res & 0xffffffff) == 0);
-    set_sign(emu, res & 0x80000000);
-    set_parity(emu, PARITY(res & 0xff));
-    set_overflow(emu, XOR2(cc >> 30));
-    set_aux(emu, cc & 0x8);
+	set_flags_add(emu, rm32, r32, res, 32);
 	
 	set_rm32(emu, &modrm, res);
 }
@@ -44,18 +140,9 @@ static void add_r32_rm32(Emulator* emu) {
 	uint32_t r32 = get_r32(emu, &modrm);
 	uint32_t rm32 = get_rm32(emu, &modrm);
 	
-	register uint32_t lo = (r32 & 0xFFFF) + (rm32 & 0xFFFF);
-	register uint32_t hi = (lo >> 16) + (r32 >> 16) + (rm32 >> 16);
 	register uint32_t res = r32 + rm32;
-	/* calculate the carry chain. */
-	register uint32_t cc = (r32 & rm32) | ((~res) & (r32 | rm32));
 	
-	set_carry(emu, hi & 0x10000);
-    set_zero(emu, (res & 0xffffffff) == 0);
-    set_sign(emu, res & 0x80000000);
-    set_parity(emu, PARITY(res & 0xff));
-    set_overflow(emu, XOR2(cc >> 30));
-    set_aux(emu, cc & 0x8);
+	set_flags_add(emu, r32, rm32, res, 32);
 	
 	set_r32(emu, &modrm, res);
 }
@@ -63,18 +150,11 @@ static void add_r32_rm32(Emulator* emu) {
 /* 0x04 */
 static void add_al_imm8(Emulator* emu) {
 	uint8_t al = get_register8(emu, AL);
-	uint8_t value = get_code8(emu, 1);
+	uint8_t value = get_imm8(emu, 1);
 	
 	register uint32_t res = al + value;
-	/* calculate the carry chain. */
-	register uint32_t cc = (al & value) | ((~res) & (al | value));
-	
-	set_carry(emu, res & 0x100);
-    set_zero(emu, (res & 0xff) == 0);
-    set_sign(emu, res & 0x80);
-    set_parity(emu, PARITY(res & 0xff));
-    set_overflow(emu, XOR2(cc >> 6));
-    set_aux(emu, cc & 0x8);
+	
+	set_flags_add(emu, al, value, res, 8);
     
 	set_register8(emu, AL, (uint8_t)res);
 	emu->eip += 2;
@@ -82,21 +162,12 @@ static void add_al_imm8(Emulator* emu) {
 
 /* 0x05 */
 static void add_eax_imm32(Emulator* emu) {
-	uint32_t value = get_code32(emu, 1);
+	uint32_t value = get_imm32(emu, 1);
 	uint32_t eax = get_register32(emu, EAX);
 	
-	register uint32_t lo = (eax & 0xFFFF) + (value & 0xFFFF);
-	register uint32_t hi = (lo >> 16) + (eax >> 16) + (value >> 16);
 	register uint32_t res = eax + value;
-	/* calculate the carry chain. */
-	register uint32_t cc = (eax & value) | ((~res) & (eax | value));
 	
-	set_carry(emu, hi & 0x10000);
-    set_zero(emu, (res & 0xffffffff) == 0);
-    set_sign(emu, res & 0x80000000);
-    set_parity(emu, PARITY(res & 0xff));
-    set_overflow(emu, XOR2(cc >> 30));
-    set_aux(emu, cc & 0x8);
+	set_flags_add(emu, eax, value, res, 32);
 
 	set_register32(emu, EAX, res);
 	emu->eip += 5;
@@ -114,12 +185,7 @@ static void or_rm32_r32(Emulator* emu) {
 	set_rm32(emu, &modrm, res);
 	
 	/* set flags */
-	set_overflow(emu, 0);
-	set_carry(emu, 0);
-	set_aux(emu, 0);
-	set_sign(emu, res & 0x80000000);
-	set_zero(emu, res == 0);
-	set_parity(emu, PARITY(res & 0xff));
+	set_flags_logic(emu, res, 32);
 }
 
 /* 0x0B /r */
@@ -134,29 +200,19 @@ static void or_r32_rm32(Emulator* emu) {
 	set_r32(emu, &modrm, res);
 	
 	/* set flags */
-	set_overflow(emu, 0);
-	set_carry(emu, 0);
-	set_aux(emu, 0);
-	set_sign(emu, res & 0x80000000);
-	set_zero(emu, res == 0);
-	set_parity(emu, PARITY(res & 0xff));
+	set_flags_logic(emu, res, 32);
 }
 
 /* 0x0D       id */
 static void or_eax_imm32(Emulator* emu) {
-	uint32_t value = get_code32(emu, 1);
+	uint32_t value = get_imm32(emu, 1);
 	uint32_t eax = get_register32(emu, EAX);
 	
 	uint32_t res = eax | value;
 	set_register32(emu, EAX, res);
 	
 	/* set flags */
-	set_overflow(emu, 0);
-	set_carry(emu, 0);
-	set_aux(emu, 0);
-	set_sign(emu, res & 0x80000000);
-	set_zero(emu, res == 0);
-	set_parity(emu, PARITY(res & 0xff));
+	set_flags_logic(emu, res, 32);
 
 	emu->eip += 5;
 }
@@ -187,6 +243,7 @@ static void imul_r32_rm32(Emulator* emu) {
 static void code_0f(Emulator* emu) {
 	emu->eip += 1;
 	uint8_t second_code = get_code8(emu, 0);
+	PROFILE_GROUP(second_code);
 	switch (second_code) {
 		case 0xAF:
 			imul_r32_rm32(emu);
@@ -209,12 +266,7 @@ static void and_rm32_r32(Emulator* emu) {
 	set_rm32(emu, &modrm, res);
 	
 	/* set flags */
-	set_overflow(emu, 0);
-	set_carry(emu, 0);
-	set_aux(emu, 0);
-	set_sign(emu, res & 0x80000000);
-	set_zero(emu, res == 0);
-	set_parity(emu, PARITY(res & 0xff));
+	set_flags_logic(emu, res, 32);
 }
 
 /* 0x23 */
@@ -229,29 +281,19 @@ static void and_r32_rm32(Emulator* emu) {
 	set_r32(emu, &modrm, res);
 	
 	/* set flags */
-	set_overflow(emu, 0);
-	set_carry(emu, 0);
-	set_aux(emu, 0);
-	set_sign(emu, res & 0x80000000);
-	set_zero(emu, res == 0);
-	set_parity(emu, PARITY(res & 0xff));
+	set_flags_logic(emu, res, 32);
 }
 
 /* 0x25       id */
 static void and_eax_imm32(Emulator* emu) {
-	uint32_t value = get_code32(emu, 1);
+	uint32_t value = get_imm32(emu, 1);
 	uint32_t eax = get_register32(emu, EAX);
 	
 	uint32_t res = eax & value;
 	set_register32(emu, EAX, res);
 	
 	/* set flags */
-	set_overflow(emu, 0);
-	set_carry(emu, 0);
-	set_aux(emu, 0);
-	set_sign(emu, res & 0x80000000);
-	set_zero(emu, res == 0);
-	set_parity(emu, PARITY(res & 0xff));
+	set_flags_logic(emu, res, 32);
 	
 	emu->eip += 5;
 }
@@ -267,15 +309,7 @@ static void sub_rm32_r32(Emulator* emu) {
 	uint32_t res = rm32 - r32;
 	set_rm32(emu, &modrm, res);
 		
-	set_sign(emu, res & 0x80000000);
-	set_zero(emu, (res & 0xffffffff) == 0);
-	set_parity(emu, PARITY(res & 0xff));
-
-    /* calculate the borrow chain.  See note at top */
-    register uint32_t bc = (res & (~rm32 | r32)) | (~rm32 & r32);
-    set_carry(emu, bc & 0x80000000);
-    set_overflow(emu, XOR2(bc >> 30));
-    set_aux(emu, bc & 0x8);
+	set_flags_sub(emu, rm32, r32, res, 32);
 }
 
 /* 0x2B */
@@ -289,34 +323,18 @@ static void sub_r32_rm32(Emulator* emu) {
 	uint32_t res = r32 - rm32;
 	set_r32(emu, &modrm, res);
 		
-	set_sign(emu, res & 0x80000000);
-	set_zero(emu, (res & 0xffffffff) == 0);
-	set_parity(emu, PARITY(res & 0xff));
-
-    /* calculate the borrow chain.  See note at top */
-    register uint32_t bc = (res & (~r32 | rm32)) | (~r32 & rm32);
-    set_carry(emu, bc & 0x80000000);
-    set_overflow(emu, XOR2(bc >> 30));
-    set_aux(emu, bc & 0x8);
+	set_flags_sub(emu, r32, rm32, res, 32);
 }
 
 /* 0x2D */
 static void sub_eax_imm32(Emulator* emu) {
-	uint32_t value = get_code32(emu, 1);
+	uint32_t value = get_imm32(emu, 1);
 	uint32_t eax = get_register32(emu, EAX);
 	
 	uint32_t res = eax - value;
 	set_register32(emu, EAX, res);
 		
-	set_sign(emu, res & 0x80000000);
-	set_zero(emu, (res & 0xffffffff) == 0);
-	set_parity(emu, PARITY(res & 0xff));
-
-    /* calculate the borrow chain.  See note at top */
-    register uint32_t bc = (res & (~eax | value)) | (~eax & value);
-    set_carry(emu, bc & 0x80000000);
-    set_overflow(emu, XOR2(bc >> 30));
-    set_aux(emu, bc & 0x8);
+	set_flags_sub(emu, eax, value, res, 32);
 	
 	emu->eip += 5;
 }
@@ -332,12 +350,7 @@ static void xor_rm32_r32(Emulator* emu) {
 	uint32_t res = rm32 ^ r32;
 	set_rm32(emu, &modrm, res);
 	
-	set_overflow(emu, 0);
-    set_sign(emu, res & 0x80000000);
-    set_zero(emu, res == 0);
-    set_parity(emu, PARITY(res & 0xff));
-    set_carry(emu, 0);
-    set_aux(emu, 0);
+	set_flags_logic(emu, res, 32);
 }
 
 /* 0x33 */
@@ -351,28 +364,18 @@ static void xor_r32_rm32(Emulator* emu) {
 	uint32_t res = rm32 ^ r32;
 	set_r32(emu, &modrm, res);
 	
-	set_overflow(emu, 0);
-    set_sign(emu, res & 0x80000000);
-    set_zero(emu, res == 0);
-    set_parity(emu, PARITY(res & 0xff));
-    set_carry(emu, 0);
-    set_aux(emu, 0);
+	set_flags_logic(emu, res, 32);
 }
 
 /* 0x35 */
 static void xor_eax_imm32(Emulator* emu) {
-	uint32_t value = get_code32(emu, 1);
+	uint32_t value = get_imm32(emu, 1);
 	uint32_t eax = get_register32(emu, EAX);
 		
 	uint32_t res = eax ^ value;
 	set_register32(emu, EAX, res);
 	
-	set_overflow(emu, 0);
-    set_sign(emu, res & 0x80000000);
-    set_zero(emu, res == 0);
-    set_parity(emu, PARITY(res & 0xff));
-    set_carry(emu, 0);
-    set_aux(emu, 0);
+	set_flags_logic(emu, res, 32);
 	
 	emu->eip += 5;
 }
@@ -387,95 +390,47 @@ static void cmp_r32_rm32(Emulator* emu) {
 	
 	uint32_t res = r32 - rm32;
 	
-	set_sign(emu, res & 0x80000000);
-	set_zero(emu, (res & 0xffffffff) == 0);
-	set_parity(emu, PARITY(res & 0xff));
-
-    /* calculate the borrow chain.  See note at top */
-    register uint32_t bc = (res & (~r32 | rm32)) | (~r32 & rm32);
-    set_carry(emu, bc & 0x80000000);
-    set_overflow(emu, XOR2(bc >> 30));
-    set_aux(emu, bc & 0x8);
+	set_flags_sub(emu, r32, rm32, res, 32);
 }
 
 /* 0x3C */
 static void cmp_al_imm8(Emulator* emu) {
-	uint8_t value = get_code8(emu, 1);
+	uint8_t value = get_imm8(emu, 1);
 	uint8_t al = get_register8(emu, AL);
 	
 	register uint32_t res = al - value;
-	/* calculate the borrow chain. */
-    register uint32_t bc = (res & (~al | value)) | (~al & value);
 
-    set_sign(emu, res & 0x80);
-    set_zero(emu, (res & 0xff) == 0);
-    set_parity(emu, PARITY(res & 0xff));
-    set_carry(emu, bc & 0x80);
-    set_overflow(emu, XOR2(bc >> 6));
-    set_aux(emu, bc & 0x8);
+	set_flags_sub(emu, al, value, res, 8);
 
 	emu->eip += 2;
 }
 
 /* 0x3D */
 static void cmp_eax_imm32(Emulator* emu) {
-	uint32_t value = get_code32(emu, 1);
+	uint32_t value = get_imm32(emu, 1);
 	uint32_t eax = get_register32(emu, EAX);
 	
 	uint32_t res = eax - value;
 	
-	set_sign(emu, res & 0x80000000);
-	set_zero(emu, (res & 0xffffffff) == 0);
-	set_parity(emu, PARITY(res & 0xff));
-
-    /* calculate the borrow chain.  See note at top */
-    register uint32_t bc = (res & (~eax | value)) | (~eax & value);
-    set_carry(emu, bc & 0x80000000);
-    set_overflow(emu, XOR2(bc >> 30));
-    set_aux(emu, bc & 0x8);
+	set_flags_sub(emu, eax, value, res, 32);
 
 	emu->eip += 5;
 }
 
 /* 0x40 /r */
-static void inc_r32(Emulator* emu) {
+static inline void inc_r(Emulator* emu, int bits) {
 	uint8_t reg = get_code8(emu, 0) - 0x40;
-	
-	if( emu->prefix_mode & PREFIX_OPSIZE_MODE_32_BIT ) { //32-bit mode registers mode active
-		uint32_t register_value = get_register32(emu, reg);
-		
-		register uint32_t res = register_value + 1;
-		/* calculate the carry chain */
-		register uint32_t cc = (1 & register_value) | ((~res) & (1 | register_value));
-	    	
-		set_register32(emu, reg, res);
-	
-		set_zero(emu, (res & 0xffffffff) == 0);
-		set_sign(emu, res & 0x80000000);
-		set_parity(emu, PARITY(res & 0xff));
-		set_overflow(emu, XOR2(cc >> 30));
-		set_aux(emu, cc & 0x8);
-	} else {	//16-bit mode registers mode active
-		uint16_t register_value = get_register16(emu, reg);
-		
-		register uint32_t res = register_value + 1;
-		/* calculate the carry chain */
-		register uint32_t cc = (1 & register_value) | ((~res) & (1 | register_value));
-	    
-		set_register16(emu, reg, (uint16_t)res);
-		
-		set_zero(emu, (res & 0xffff) == 0);
-		set_sign(emu, res & 0x8000);
-		set_parity(emu, PARITY(res & 0xff));
-		set_overflow(emu, XOR2(cc >> 14));
-		set_aux(emu, cc & 0x8);
-	}
+	uint32_t register_value = get_sized_register(emu, reg, bits);
+
+	register uint32_t res = register_value + 1;
+
+	set_sized_register(emu, reg, bits, res);
 
-	//if current segment is CS (CODE) default modes are 32 bit.
-	emu->prefix_mode |= PREFIX_OPSIZE_MODE_32_BIT | PREFIX_ADDRESS_MODE_32_BIT;
+	set_flags_inc(emu, register_value, res, bits);
 
 	emu->eip += 1;
 }
+SIZED_HANDLERS(inc_r)
 
 /* 0x50 /r */
 static void push_r32(Emulator* emu) {
@@ -505,55 +460,33 @@ static void address_mode(Emulator* emu) {
 
 /* 0x68 */
 static void push_imm32(Emulator* emu) {
-	uint32_t value = get_code32(emu, 1);
+	uint32_t value = get_imm32(emu, 1);
 	push32(emu, value);
 	emu->eip += 5;
 }
 
 /* 0x69 / 2 */
-static void imul_r32_r32_imm32(Emulator* emu, ModRM* modrm) {
+static inline void imul_r_r_imm(Emulator* emu, ModRM* modrm, int bits) {
+	uint32_t rm = get_sized_rm(emu, modrm, bits); //register
+	uint32_t imm = get_sized_imm(emu, 0, bits); //hardcoded value
 
-	if( emu->prefix_mode & PREFIX_OPSIZE_MODE_32_BIT ) { //32-bit mode registers mode active
-		uint32_t rm32 = get_rm32(emu, modrm); //register
-		uint32_t imm32 = get_code32(emu, 0); //hardcoded value
+	int64_t res = (int64_t) (uint32_t) rm * (uint32_t) imm;
+	uint32_t res_lo = (uint32_t) res & (bits == 16 ? 0xffff : 0xffffffff);
+	uint32_t res_hi = (uint32_t) (res >> bits);
+	emu->eip += bits / 8;
+	set_sized_register(emu, modrm->reg_index, bits, res_lo);
 
-		int64_t res = (int64_t) (uint32_t) rm32 * (uint32_t) imm32;
-		uint32_t res_lo = (uint32_t) res;
-		uint32_t res_hi = (uint32_t) (res >> 32);
-		emu->eip += 4;
-		set_r32(emu, modrm, res_lo);
-		
-		if(res_hi != 0) {
-			set_carry(emu, 1);
-			set_overflow(emu, 1);
-		} else {
-			set_carry(emu, 0);
-			set_overflow(emu, 0);
-		}
-	} else {	//16-bit mode registers mode active
-		uint32_t rm16 = get_rm16(emu, modrm); //register
-		uint32_t imm16 = get_code16(emu, 0); //hardcoded value
-
-		int32_t res = (int32_t) (uint16_t) rm16 * (uint16_t) imm16;
-		uint16_t res_lo = (uint16_t) res;
-		uint16_t res_hi = (uint16_t) (res >> 16);
-		set_r16(emu, modrm, res_lo);
-		
-		if(res > 0xFFFF) {
-			set_carry(emu, 1);
-			set_overflow(emu, 1);
-		} else {
-			set_carry(emu, 0);
-			set_overflow(emu, 0);
-		}
+	if(res_hi != 0) {
+		set_carry(emu, 1);
+		set_overflow(emu, 1);
+	} else {
+		set_carry(emu, 0);
+		set_overflow(emu, 0);
 	}
-
-	//if current segment is CS (CODE) default modes are 32 bit.
-	emu->prefix_mode |= PREFIX_OPSIZE_MODE_32_BIT | PREFIX_ADDRESS_MODE_32_BIT;
 }
 
 /* 0x69 */
-static void imul_r32_rm32_imm32(Emulator* emu) {
+static inline void imul_r_rm_imm(Emulator* emu, int bits) {
 	emu->eip += 1;
 	ModRM modrm;
 	parse_modrm(emu, &modrm, false);
@@ -577,17 +510,18 @@ static void imul_r32_rm32_imm32(Emulator* emu) {
 		case 3:
 			//IMUL r16,rm16,imm16
 			/* register to register */
-			imul_r32_r32_imm32(emu, &modrm);
+			imul_r_r_imm(emu, &modrm, bits);
 			break;
 		default:
 			printf("not implemented: 69/default\n");
 			system("pause");
 	}
 }
+SIZED_HANDLERS(imul_r_rm_imm)
 
 /* 0x6A */
 static void push_imm8(Emulator* emu) {
-	uint8_t value = get_code8(emu, 1);
+	uint8_t value = get_imm8(emu, 1);
 	push32(emu, value);
 	emu->eip += 2;
 }
@@ -595,12 +529,12 @@ static void push_imm8(Emulator* emu) {
 #define DEFINE_JX(flag, is_flag) \
 	static void j ## flag(Emulator* emu) \
 	{ \
-		int diff = is_flag(emu) ? get_sign_code8(emu, 1) : 0; \
+		int diff = is_flag(emu) ? get_sign_imm8(emu, 1) : 0; \
 		emu->eip += (diff + 2); \
 	} \
 	static void jn ## flag(Emulator* emu) \
 	{ \
-		int diff = is_flag(emu) ? 0 : get_sign_code8(emu, 1); \
+		int diff = is_flag(emu) ? 0 : get_sign_imm8(emu, 1); \
 		emu->eip += (diff + 2); \
 	}
 
@@ -612,40 +546,31 @@ DEFINE_JX(o, is_overflow)
 #undef DEFINE_JX
 
 static void jl(Emulator* emu) {
-	int diff = (is_sign(emu) != is_overflow(emu)) ? get_sign_code8(emu, 1) : 0;
+	int diff = (is_sign(emu) != is_overflow(emu)) ? get_sign_imm8(emu, 1) : 0;
 	emu->eip += (diff + 2);
 }
 
 static void jle(Emulator* emu) {
-	int diff = (is_zero(emu) || (is_sign(emu) != is_overflow(emu))) ? get_sign_code8(emu, 1) : 0;
+	int diff = (is_zero(emu) || (is_sign(emu) != is_overflow(emu))) ? get_sign_imm8(emu, 1) : 0;
 	emu->eip += (diff + 2);
 }
 
 static void jg(Emulator* emu) {
-	int diff = (!is_zero(emu) && is_sign(emu) == is_overflow(emu)) ? get_sign_code8(emu, 1) : 0;
+	int diff = (!is_zero(emu) && is_sign(emu) == is_overflow(emu)) ? get_sign_imm8(emu, 1) : 0;
 	emu->eip += (diff + 2);
 }
 
 /* 0x81 /0 */
 static void add_rm32_imm32(Emulator* emu, ModRM* modrm) {
 	uint32_t rm32 = get_rm32(emu, modrm);
-	uint32_t imm32 = get_code32(emu, 0);
+	uint32_t imm32 = get_imm32(emu, 0);
 	
 	
-	register uint32_t lo = (rm32 & 0xFFFF) + (imm32 & 0xFFFF);
-	register uint32_t hi = (lo >> 16) + (rm32 >> 16) + (imm32 >> 16);
 	register uint32_t res = rm32 + imm32;
-	/* calculate the carry chain. */
-	register uint32_t cc = (imm32 & rm32) | ((~res) & (imm32 | rm32));
 	
 	set_rm32(emu, modrm, res);
 	
-	set_carry(emu, hi & 0x10000);
-    set_zero(emu, (res & 0xffffffff) == 0);
-    set_sign(emu, res & 0x80000000);
-    set_parity(emu, PARITY(res & 0xff));
-    set_overflow(emu, XOR2(cc >> 30));
-    set_aux(emu, cc & 0x8);
+	set_flags_add(emu, rm32, imm32, res, 32);
 	
 	emu->eip += 4;
 }
@@ -653,18 +578,13 @@ static void add_rm32_imm32(Emulator* emu, ModRM* modrm) {
 /* 0x81 /1 */
 static void or_rm32_imm32(Emulator* emu, ModRM* modrm) {
 	uint32_t rm32 = get_rm32(emu, modrm);
-	uint32_t imm32 = get_code32(emu, 0);
+	uint32_t imm32 = get_imm32(emu, 0);
 	
 	uint32_t res = rm32 | imm32;
 	set_rm32(emu, modrm, res);
 	
 	/* set flags */
-	set_overflow(emu, 0);
-	set_carry(emu, 0);
-	set_aux(emu, 0);
-	set_sign(emu, res & 0x80000000);
-	set_zero(emu, res == 0);
-	set_parity(emu, PARITY(res & 0xff));
+	set_flags_logic(emu, res, 32);
 	
 	emu->eip += 4;
 }
@@ -682,18 +602,13 @@ static void sbb_rm32_imm32(Emulator* emu, ModRM* modrm) {
 /* 0x81 /4 */
 static void and_rm32_imm32(Emulator* emu, ModRM* modrm) {
 	uint32_t rm32 = get_rm32(emu, modrm);
-	uint32_t imm32 = get_code32(emu, 0);
+	uint32_t imm32 = get_imm32(emu, 0);
 	
 	uint32_t res = rm32 & imm32;
 	set_rm32(emu, modrm, res);
 	
 	/* set flags */
-	set_overflow(emu, 0);
-	set_carry(emu, 0);
-	set_aux(emu, 0);
-	set_sign(emu, res & 0x80000000);
-	set_zero(emu, res == 0);
-	set_parity(emu, PARITY(res & 0xff));
+	set_flags_logic(emu, res, 32);
 	
 	emu->eip += 4;
 }
@@ -701,20 +616,12 @@ static void and_rm32_imm32(Emulator* emu, ModRM* modrm) {
 /* 0x81 /5 */
 static void sub_rm32_imm32(Emulator* emu, ModRM* modrm) {
 	uint32_t rm32 = get_rm32(emu, modrm);
-	uint32_t imm32 = get_code32(emu, 0);
+	uint32_t imm32 = get_imm32(emu, 0);
 	
 	uint32_t res = rm32 - imm32;
 	set_rm32(emu, modrm, res);
 		
-	set_sign(emu, res & 0x80000000);
-	set_zero(emu, (res & 0xffffffff) == 0);
-	set_parity(emu, PARITY(res & 0xff));
-
-    /* calculate the borrow chain.  See note at top */
-    register uint32_t bc = (res & (~rm32 | imm32)) | (~rm32 & imm32);
-    set_carry(emu, bc & 0x80000000);
-    set_overflow(emu, XOR2(bc >> 30));
-    set_aux(emu, bc & 0x8);
+	set_flags_sub(emu, rm32, imm32, res, 32);
 	
 	emu->eip += 4;
 }
@@ -722,17 +629,12 @@ static void sub_rm32_imm32(Emulator* emu, ModRM* modrm) {
 /* 0x81 /6 */
 static void xor_rm32_imm32(Emulator* emu, ModRM* modrm) {
 	uint32_t rm32 = get_rm32(emu, modrm);
-	uint32_t imm32 = get_code32(emu, 0);
+	uint32_t imm32 = get_imm32(emu, 0);
 
 	uint32_t res = rm32 ^ imm32;
 	set_rm32(emu, modrm, res);
 	
-	set_overflow(emu, 0);
-    set_sign(emu, res & 0x80000000);
-    set_zero(emu, res == 0);
-    set_parity(emu, PARITY(res & 0xff));
-    set_carry(emu, 0);
-    set_aux(emu, 0);
+	set_flags_logic(emu, res, 32);
 	
 	emu->eip += 4;
 }
@@ -740,20 +642,12 @@ static void xor_rm32_imm32(Emulator* emu, ModRM* modrm) {
 /* 0x81 /7 */
 static void cmp_rm32_imm32(Emulator* emu, ModRM* modrm) {
 	uint32_t rm32 = get_rm32(emu, modrm);
-	uint32_t imm32 = get_code32(emu, 0);
-	emu->eip += 1;
+	uint32_t imm32 = get_imm32(emu, 0);
+	emu->eip += 4;
 	uint32_t res = rm32 - imm32;
 	
 	
-	set_sign(emu, res & 0x80000000);
-	set_zero(emu, (res & 0xffffffff) == 0);
-	set_parity(emu, PARITY(res & 0xff));
-
-    /* calculate the borrow chain.  See note at top */
-    register uint32_t bc = (res & (~rm32 | imm32)) | (~rm32 & imm32);
-    set_carry(emu, bc & 0x80000000);
-    set_overflow(emu, XOR2(bc >> 30));
-    set_aux(emu, bc & 0x8);
+	set_flags_sub(emu, rm32, imm32, res, 32);
 }
 
 /* 0x81 */
@@ -762,6 +656,7 @@ static void code_81(Emulator* emu) {
 	ModRM modrm;
 	parse_modrm(emu, &modrm, false);
 
+	PROFILE_GROUP(modrm.opcode);
 	switch (modrm.opcode) {
 		case 0:
 			add_rm32_imm32(emu, &modrm); //ADD
@@ -796,22 +691,13 @@ static void code_81(Emulator* emu) {
 /* 0x83 /0 */
 static void add_rm32_imm8(Emulator* emu, ModRM* modrm) {
 	uint32_t rm32 = get_rm32(emu, modrm);
-	int32_t imm8 = (int32_t)get_sign_code8(emu, 0);
+	int32_t imm8 = (int32_t)get_sign_imm8(emu, 0);
 
-	register uint32_t lo = (rm32 & 0xFFFF) + (imm8 & 0xFFFF);
-	register uint32_t hi = (lo >> 16) + (rm32 >> 16) + (imm8 >> 16);
 	register uint32_t res = rm32 + imm8;
-	/* calculate the carry chain. */
-	register uint32_t cc = (imm8 & rm32) | ((~res) & (imm8 | rm32));
 	
 	set_rm32(emu, modrm, res);
 	
-	set_carry(emu, hi & 0x10000);
-    set_zero(emu, (res & 0xffffffff) == 0);
-    set_sign(emu, res & 0x80000000);
-    set_parity(emu, PARITY(res & 0xff));
-    set_overflow(emu, XOR2(cc >> 30));
-    set_aux(emu, cc & 0x8);
+	set_flags_add(emu, rm32, imm8, res, 32);
 	
 	emu->eip += 1;
 }
@@ -819,18 +705,13 @@ static void add_rm32_imm8(Emulator* emu, ModRM* modrm) {
 /* 0x83 /1 */
 static void or_rm32_imm8(Emulator* emu, ModRM* modrm) {
 	uint32_t rm32 = get_rm32(emu, modrm);
-	int32_t imm8 = (int32_t)get_sign_code8(emu, 0);
+	int32_t imm8 = (int32_t)get_sign_imm8(emu, 0);
 
 	uint32_t res = rm32 | imm8;
 	set_rm32(emu, modrm, res);
 	
 	/* set flags */
-	set_overflow(emu, 0);
-	set_carry(emu, 0);
-	set_aux(emu, 0);
-	set_sign(emu, res & 0x80000000);
-	set_zero(emu, res == 0);
-	set_parity(emu, PARITY(res & 0xff));
+	set_flags_logic(emu, res, 32);
 	
 	emu->eip += 1;	
 }
@@ -838,18 +719,13 @@ static void or_rm32_imm8(Emulator* emu, ModRM* modrm) {
 /* 0x83 /4 */
 static void and_rm32_imm8(Emulator* emu, ModRM* modrm) {
 	uint32_t rm32 = get_rm32(emu, modrm);
-	int32_t imm8 = (int32_t)get_sign_code8(emu, 0);
+	int32_t imm8 = (int32_t)get_sign_imm8(emu, 0);
 	
 	uint32_t res = rm32 & imm8;
 	set_rm32(emu, modrm, res);
 	
 	/* set flags */
-	set_overflow(emu, 0);
-	set_carry(emu, 0);
-	set_aux(emu, 0);
-	set_sign(emu, res & 0x80000000);
-	set_zero(emu, res == 0);
-	set_parity(emu, PARITY(res & 0xff));
+	set_flags_logic(emu, res, 32);
 	
 	emu->eip += 1;
 }
@@ -857,37 +733,24 @@ static void and_rm32_imm8(Emulator* emu, ModRM* modrm) {
 /* 0x83 /5 */
 static void sub_rm32_imm8(Emulator* emu, ModRM* modrm) {
 	uint32_t rm32 = get_rm32(emu, modrm);
-	int32_t imm8 = (int32_t)get_sign_code8(emu, 0);
+	int32_t imm8 = (int32_t)get_sign_imm8(emu, 0);
 	emu->eip += 1;
 	uint32_t res = rm32 - imm8;
 	set_rm32(emu, modrm, res);
 		
-	set_sign(emu, res & 0x80000000);
-	set_zero(emu, (res & 0xffffffff) == 0);
-	set_parity(emu, PARITY(res & 0xff));
-
-    /* calculate the borrow chain.  See note at top */
-    register uint32_t bc = (res & (~rm32 | imm8)) | (~rm32 & imm8);
-    set_carry(emu, bc & 0x80000000);
-    set_overflow(emu, XOR2(bc >> 30));
-    set_aux(emu, bc & 0x8);	
+	set_flags_sub(emu, rm32, imm8, res, 32);
 	
 }
 
 /* 0x83 /6 */
 static void xor_rm32_imm8(Emulator* emu, ModRM* modrm) {
 	uint32_t rm32 = get_rm32(emu, modrm);
-	int32_t imm8 = (int32_t)get_sign_code8(emu, 0);
+	int32_t imm8 = (int32_t)get_sign_imm8(emu, 0);
 	
 	uint32_t res = rm32 ^ imm8;
 	set_rm32(emu, modrm, res);
 	
-	set_overflow(emu, 0);
-    set_sign(emu, res & 0x80000000);
-    set_zero(emu, res == 0);
-    set_parity(emu, PARITY(res & 0xff));
-    set_carry(emu, 0);
-    set_aux(emu, 0);
+	set_flags_logic(emu, res, 32);
 	
 	emu->eip += 1;
 }
@@ -895,20 +758,12 @@ static void xor_rm32_imm8(Emulator* emu, ModRM* modrm) {
 /* 0x83 /7 */
 static void cmp_rm32_imm8(Emulator* emu, ModRM* modrm) {
 	uint32_t rm32 = get_rm32(emu, modrm);
-	int32_t imm8 = (int32_t)get_sign_code8(emu, 0);
+	int32_t imm8 = (int32_t)get_sign_imm8(emu, 0);
 	emu->eip += 1;
 	uint32_t res = rm32 - imm8;
 	
 	
-	set_sign(emu, res & 0x80000000);
-	set_zero(emu, (res & 0xffffffff) == 0);
-	set_parity(emu, PARITY(res & 0xff));
-
-    /* calculate the borrow chain.  See note at top */
-    register uint32_t bc = (res & (~rm32 | imm8)) | (~rm32 & imm8);
-    set_carry(emu, bc & 0x80000000);
-    set_overflow(emu, XOR2(bc >> 30));
-    set_aux(emu, bc & 0x8);	
+	set_flags_sub(emu, rm32, imm8, res, 32);
 }
 
 static void code_83(Emulator* emu) {
@@ -916,6 +771,7 @@ static void code_83(Emulator* emu) {
 	ModRM modrm;
 	parse_modrm(emu, &modrm, false);
 
+	PROFILE_GROUP(modrm.opcode);
 	switch (modrm.opcode) {
 		case 0:
 			add_rm32_imm8(emu, &modrm);
@@ -951,11 +807,7 @@ static void test_rm32_r32(Emulator* emu) {
 	
 	uint32_t res;
 	res = rm32 & r32;
-	set_overflow(emu, 0); //clear
-	set_sign(emu, res & 0x80000000);
-	set_zero(emu, res == 0);
-	set_parity(emu, PARITY(res & 0xff));
-	set_carry(emu, 0); //clear
+	set_flags_test(emu, res, 32);
 }
 
 /* 0x88 */
@@ -986,22 +838,14 @@ static void mov_r8_rm8(Emulator* emu) {
 }
 
 /* 0x8B */
-static void mov_r32_rm32(Emulator* emu) {
+static inline void mov_r_rm(Emulator* emu, int bits) {
 	emu->eip += 1;
 	ModRM modrm;
-	parse_modrm(emu, &modrm, !(emu->prefix_mode & PREFIX_OPSIZE_MODE_32_BIT));
-	
-	if( emu->prefix_mode & PREFIX_OPSIZE_MODE_32_BIT ) { //32-bit mode registers mode active
-		uint32_t rm32 = get_rm32(emu, &modrm);
-		set_r32(emu, &modrm, rm32);
-	} else {	//16-bit mode registers mode active
-		uint32_t rm16 = get_rm16(emu, &modrm);
-		set_r16(emu, &modrm, rm16);
-	}
-		
-	//if current segment is CS (CODE) default modes are 32 bit.
-	emu->prefix_mode |= PREFIX_OPSIZE_MODE_32_BIT | PREFIX_ADDRESS_MODE_32_BIT;
+	parse_modrm(emu, &modrm, !(emu->prefix_mode & PREFIX_ADDRESS_MODE_32_BIT));
+
+	set_sized_register(emu, modrm.reg_index, bits, get_sized_rm(emu, &modrm, bits));
 }
+SIZED_HANDLERS(mov_r_rm)
 
 /* 0x8D /r */
 static void lea_r16_r32_m(Emulator* emu) {
@@ -1011,7 +855,7 @@ static void lea_r16_r32_m(Emulator* emu) {
 	parse_modrm(emu, &modrm, false);
 
 	uint32_t address;
-	address = calc_memory_address32(emu, &modrm);
+	address = calc_memory_address(emu, &modrm);
 	set_r32(emu, &modrm, address);
 }
 
@@ -1020,288 +864,353 @@ static void nop(Emulator* emu) {
 	emu->eip += 1;
 }
 
-/* 0xAB */
-static void stos(Emulator* emu) {
-	emu->eip += 1;
-
-	ModRM modrm;
+/*
+ * String instructions, with variants by element size in bits: the even
+ * opcode of each pair is name8, the odd one name32 or name16. Under a REP prefix ECX elements are
+ * handled at once through the bulk accessors of guest_memory.h, stepping
+ * down when the direction flag is set; ESI, EDI and ECX end as if they had
+ * been run one element at a time.
+ */
 
-	int32_t incrementer;
-	uint32_t count = 1;
-	uint32_t value;
+static uint32_t get_string_memory(Emulator* emu, uint32_t address, int size) {
+	return size == 1 ? get_memory8(emu, address) : size == 2 ? get_memory16(emu, address) : get_memory32(emu, address);
+}
 
-	if( emu->prefix_mode & PREFIX_OPSIZE_MODE_32_BIT ) { //32-bit mode registers mode active
-		//stosd (DWORD)
-		incrementer = is_direction(emu) ? -4 : 4;
+static void set_string_memory(Emulator* emu, uint32_t address, int size, uint32_t value) {
+	if (size == 1) {
+		set_memory8(emu, address, value);
+	} else if (size == 2) {
+		set_memory16(emu, address, value);
+	} else {
+		set_memory32(emu, address, value);
+	}
+}
 
-		if( emu->prefix_mode & PREFIX_REP ) {
-			count = get_register32(emu, ECX);
-			set_register32(emu, ECX, 0);
-			emu->prefix_mode &= ~(PREFIX_REP | PREFIX_REPE);
-		}
+/* AL, AX or EAX */
+static uint32_t get_string_accumulator(Emulator* emu, int size) {
+	return size == 1 ? get_register8(emu, AL) : size == 2 ? get_register16(emu, AX) : get_register32(emu, EAX);
+}
 
-		value = get_register32(emu, EAX);
-		uint32_t address = get_register32(emu, EDI);
+/* PREFIX_REPNE or PREFIX_REPE the instruction repeats under, 0 for none */
+static int string_repeat(Emulator* emu) {
+	return emu->prefix_mode & PREFIX_REPNE ? PREFIX_REPNE : emu->prefix_mode & PREFIX_REPE;
+}
 
-		while(count--) {
-			set_memory32(emu, address, value);
-			address += incrementer;
-			set_register32(emu, EDI, address);
-		}
-	} else { //16-bit mode registers mode active
-		//stosw (WORD)
-		incrementer = is_direction(emu) ? -2 : 2;
-
-		if( emu->prefix_mode & PREFIX_REP ) {
-			count = get_register16(emu, CX);
-			set_register16(emu, CX, 0);
-			emu->prefix_mode &= ~(PREFIX_REP | PREFIX_REPE);
-		}
+/* 0xA4, 0xA5 */
+static inline void movs(Emulator* emu, int bits) {
+	int size = bits / 8;
+	int32_t step = is_direction(emu) ? -size : size;
+	uint32_t count = emu->prefix_mode & PREFIX_REP ? get_register32(emu, ECX) : 1;
+	uint32_t src = get_register32(emu, ESI);
+	uint32_t dst = get_register32(emu, EDI);
+	uint64_t length = (uint64_t)count * size;
+	/* How far the destination runs ahead of the source in the direction of the copy */
+	uint32_t ahead = step > 0 ? dst - src : src - dst;
+	uint32_t i;
 
-		value = get_register16(emu, AX);
-		uint32_t address = get_register32(emu, EDI); //i dont know.. 16 bit this not good ^.^
+	emu->eip += 1;
 
-		while(count--) {
-			set_memory16(emu, address, value);
-			address += incrementer;
-			set_register32(emu, EDI, address);
+	if (length < 0x100000000ULL && (ahead == 0 || ahead >= length)) {
+		/* Nothing is read after it was written: one copy from the low end of both ranges */
+		uint32_t low = step > 0 ? 0 : (count - 1) * size;
+		move_memory(emu, dst - low, src - low, length, step < 0);
+	} else {
+		/* The copy reads what it wrote, repeating a pattern: element by element */
+		for (i = 0; i < count; i++) {
+			set_string_memory(emu, dst + i * step, size, get_string_memory(emu, src + i * step, size));
 		}
 	}
 
-	//if current segment is CS (CODE) default modes are 32 bit.
-	emu->prefix_mode |= PREFIX_OPSIZE_MODE_32_BIT | PREFIX_ADDRESS_MODE_32_BIT;
+	set_register32(emu, ESI, src + count * step);
+	set_register32(emu, EDI, dst + count * step);
+	if (emu->prefix_mode & PREFIX_REP) {
+		set_register32(emu, ECX, 0);
+	}
 }
+BYTE_HANDLER(movs)
+SIZED_HANDLERS(movs)
 
-/* 0xB0 /r */
-static void mov_r8_imm8(Emulator* emu) {
-	uint8_t reg = get_code8(emu, 0) - 0xB0;
-	set_register8(emu, reg, get_code8(emu, 1));
-	emu->eip += 2;
-}
+/* 0xA6, 0xA7 */
+static inline void cmps(Emulator* emu, int bits) {
+	int size = bits / 8;
+	int32_t step = is_direction(emu) ? -size : size;
+	int rep = string_repeat(emu);
+	uint32_t count = rep ? get_register32(emu, ECX) : 1;
+	uint32_t src = get_register32(emu, ESI);
+	uint32_t dst = get_register32(emu, EDI);
+	uint32_t done = 0, v1 = 0, v2 = 0;
 
-/* 0xB8 /r */
-static void mov_r32_imm32(Emulator* emu) {
-	uint8_t reg = get_code8(emu, 0) - 0xB8;
-	uint32_t value = get_code32(emu, 1);
-	set_register32(emu, reg, value);
-	emu->eip += 5;
-}
+	emu->eip += 1;
 
-/* 0xC1 /0 */
-static void rol_rm32_imm8(Emulator* emu, ModRM* modrm) {
-	uint32_t rm32 = get_rm32(emu, modrm);
-	uint32_t imm8 = (int32_t)get_sign_code8(emu, 0);
+	if (count != 0 && rep == PREFIX_REPE && step > 0 && (uint64_t)count * size < 0x100000000ULL) {
+		/* Runs until the first element that differs */
+		done = match_memory(emu, src, dst, count * size) / size;
+		done = done < count ? done + 1 : count;
+	} else {
+		/* REPNE, or going down: element by element */
+		while (done < count) {
+			v1 = get_string_memory(emu, src + done * step, size);
+			v2 = get_string_memory(emu, dst + done * step, size);
+			done++;
+			if ((rep == PREFIX_REPE && v1 != v2) || (rep == PREFIX_REPNE && v1 == v2)) {
+				break;
+			}
+		}
+	}
 
-	imm8 %= 32;
-	rm32 = rm32 << imm8 | rm32 >> (32 - imm8);
+	if (done != 0) {
+		/* Flags of the last compare */
+		v1 = get_string_memory(emu, src + (done - 1) * step, size);
+		v2 = get_string_memory(emu, dst + (done - 1) * step, size);
+		set_flags_sub(emu, v1, v2, v1 - v2, size * 8);
+	}
 
-	//overflow flag is set if imm8 == 1
-	if(imm8 == 1)
-		set_overflow(emu, (rm32 + (rm32 >> 31)) & 1);
+	set_register32(emu, ESI, src + done * step);
+	set_register32(emu, EDI, dst + done * step);
+	if (rep) {
+		set_register32(emu, ECX, count - done);
+	}
+}
+BYTE_HANDLER(cmps)
+SIZED_HANDLERS(cmps)
 
-	/* set new CF; note that it is the LSB of the result */
-	set_carry(emu, rm32 & 0x1);
+/* 0xAA, 0xAB */
+static inline void stos(Emulator* emu, int bits) {
+	int size = bits / 8;
+	int32_t step = is_direction(emu) ? -size : size;
+	uint32_t count = emu->prefix_mode & PREFIX_REP ? get_register32(emu, ECX) : 1;
+	uint32_t dst = get_register32(emu, EDI);
+	uint32_t value = get_string_accumulator(emu, size);
+	uint64_t length = (uint64_t)count * size;
+	uint32_t i;
 
-	//TODO: FIX for all bit types later
-	set_rm32(emu, modrm, rm32);
 	emu->eip += 1;
-}
-
-/* 0xC1 /1 */
-static void ror_rm32_imm8(Emulator* emu, ModRM* modrm) {
-	uint32_t rm32 = get_rm32(emu, modrm);
-	uint32_t imm8 = (int32_t)get_sign_code8(emu, 0);
 
-	imm8 %= 32;
-	rm32 = rm32 << (32 - imm8) | rm32 >> (imm8);
+	if (length < 0x100000000ULL) {
+		/* Every element holds the same value, so going down fills the same range */
+		fill_memory(emu, step > 0 ? dst : dst - (count - 1) * size, value, size, length);
+	} else {
+		for (i = 0; i < count; i++) {
+			set_string_memory(emu, dst + i * step, size, value);
+		}
+	}
 
-	if(imm8 == 1)
-		set_overflow(emu, (((rm32 >> 30) ^ ((rm32 >> 30)>>1)) & 0x1));
+	set_register32(emu, EDI, dst + count * step);
+	if (emu->prefix_mode & PREFIX_REP) {
+		set_register32(emu, ECX, 0);
+	}
+}
+BYTE_HANDLER(stos)
+SIZED_HANDLERS(stos)
 
-	/* set new CF; note that it is the MSB of the result */
-	set_carry(emu, rm32 & (1 << 31));
+/* 0xAC, 0xAD */
+static inline void lods(Emulator* emu, int bits) {
+	int size = bits / 8;
+	int32_t step = is_direction(emu) ? -size : size;
+	uint32_t count = emu->prefix_mode & PREFIX_REP ? get_register32(emu, ECX) : 1;
+	uint32_t src = get_register32(emu, ESI);
 
-	//TODO: FIX for all bit types later
-	set_rm32(emu, modrm, rm32);
 	emu->eip += 1;
-}
-
-/* 0xC1 /2 */
-static void rcl_rm32_imm8(Emulator* emu, ModRM* modrm) {
-	uint32_t rm32 = get_rm32(emu, modrm);
-	uint32_t imm8 = (int32_t)get_sign_code8(emu, 0);
 
-	register uint32_t res, cnt, mask, cf;
+	/* Only the last load is left in the accumulator */
+	if (count != 0) {
+		uint32_t value = get_string_memory(emu, src + (count - 1) * step, size);
 
-	if ((imm8 = imm8 % 33) != 0) {
-		cf = (rm32 >> (32 - imm8)) & 0x1;
-		rm32 = (rm32 << imm8) & 0xffffffff;
-		mask = (1 << (imm8 - 1)) - 1;
-		rm32 |= (rm32 >> (33 - imm8)) & mask;
-		if (is_carry(emu)) {     /* carry flag is set */
-			rm32 |= 1 << (imm8 - 1);
+		if (size == 1) {
+			set_register8(emu, AL, value);
+		} else if (size == 2) {
+			set_register16(emu, AX, value);
+		} else {
+			set_register32(emu, EAX, value);
 		}
-		set_carry(emu, cf);
-		set_overflow(emu, (imm8 == 1 && (((cf + ((rm32 >> 30) & 0x2)) ^ ((cf + ((rm32 >> 30) & 0x2))>>1)) & 0x1)));
 	}
 
-	//TODO: FIX for all bit types later
-	set_rm32(emu, modrm, rm32);
-	emu->eip += 1;
+	set_register32(emu, ESI, src + count * step);
+	if (emu->prefix_mode & PREFIX_REP) {
+		set_register32(emu, ECX, 0);
+	}
 }
+BYTE_HANDLER(lods)
+SIZED_HANDLERS(lods)
 
-/* 0xC1 /3 */
-static void rcr_rm32_imm8(Emulator* emu, ModRM* modrm) {
-	uint32_t rm32 = get_rm32(emu, modrm);
-	uint32_t imm8 = (int32_t)get_sign_code8(emu, 0);
-
-	uint32_t mask, cf, ocf = 0;
-
-	/* rotate right through carry */
-	if ((imm8 = imm8 % 33) != 0) {
-		if (imm8 == 1) {
-			cf = rm32 & 0x1;
-			ocf = is_carry(emu) != 0;
-		} else
-			cf = (rm32 >> (imm8 - 1)) & 0x1;
-		mask = (1 << (32 - imm8)) - 1;
-		rm32 = (rm32 >> imm8) & mask;
-		if (imm8 != 1)
-			rm32 |= (rm32 << (33 - imm8));
-		if (is_carry(emu)) {     /* carry flag is set */
-			rm32 |= 1 << (32 - imm8);
-		}
-		set_carry(emu, cf);
-		if (imm8 == 1) {
-			set_overflow(emu, (((ocf + ((rm32 >> 30) & 0x2)) ^ ((ocf + ((rm32 >> 30) & 0x2))>>1)) & 0x1));
-		}
-	}
+/* 0xAE, 0xAF */
+static inline void scas(Emulator* emu, int bits) {
+	int size = bits / 8;
+	int32_t step = is_direction(emu) ? -size : size;
+	int rep = string_repeat(emu);
+	uint32_t count = rep ? get_register32(emu, ECX) : 1;
+	uint32_t dst = get_register32(emu, EDI);
+	uint32_t value = get_string_accumulator(emu, size);
+	uint32_t done = 0, element;
 
-	//TODO: FIX for all bit types later
-	set_rm32(emu, modrm, rm32);
 	emu->eip += 1;
-}
-
-/* 0xC1 /4 */
-static void shl_rm32_imm8(Emulator* emu, ModRM* modrm) {
-	uint32_t rm32 = get_rm32(emu, modrm); //eax register value
-	uint32_t imm8 = (int32_t)get_sign_code8(emu, 0); //0x10 [16] shift amount
-	uint32_t original_rm32 = rm32;
 
-	imm8 %= 32;
-	if(imm8 > 0) {
-		rm32 = rm32 << imm8;
-		set_carry(emu, (rm32 & (1 << (32 - imm8))));
-		set_zero(emu, (rm32 & 0xffffffff) == 0);
-		set_sign(emu, rm32 & 0x80000000);
-		set_parity(emu, PARITY(rm32 & 0xff));
+	if (count != 0 && rep && step > 0) {
+		/* REPNE runs until the first element equal to the accumulator, REPE until the first one that differs */
+		done = scan_memory(emu, dst, value, size, count, rep == PREFIX_REPNE);
+		done = done < count ? done + 1 : count;
 	} else {
-		rm32 = 0;
+		while (done < count) {
+			element = get_string_memory(emu, dst + done * step, size);
+			done++;
+			if ((rep == PREFIX_REPE && value != element) || (rep == PREFIX_REPNE && value == element)) {
+				break;
+			}
+		}
 	}
-	if(imm8 == 1)
-		set_overflow(emu, (((rm32 & 0x80000000) == 0x80000000) ^
-                                  (is_carry(emu) != 0)));
-	emu->eip += 1;
-	set_rm32(emu, modrm, rm32);
-}
-
-/* 0xC1 /5 */
-static void shr_rm32_imm8(Emulator* emu, ModRM* modrm) {
-	uint32_t rm32 = get_rm32(emu, modrm); //eax register value
-	uint32_t imm8 = (int32_t)get_sign_code8(emu, 0); //0x10 [16] shift amount
-	uint32_t original_rm32 = rm32;
-
-	imm8 %= 32;
-	if(imm8 > 0) {
-		rm32 = rm32 >> imm8;
-		set_carry(emu, (rm32 & (1 << (imm8 - 1))));
-		set_zero(emu, (rm32 & 0xffffffff) == 0);
-		set_sign(emu, rm32 & 0x80000000);
-		set_parity(emu, PARITY(rm32 & 0xff));
+
+	if (done != 0) {
+		/* Flags of the last compare */
+		element = get_string_memory(emu, dst + (done - 1) * step, size);
+		set_flags_sub(emu, value, element, value - element, size * 8);
 	}
-	
-	if(imm8 == 1)
-		set_overflow(emu, XOR2(rm32 >> 30));
-	else
-		set_overflow(emu, 0);
 
-	emu->eip += 1;
-	set_rm32(emu, modrm, rm32);
-}
-
-/* 0xC1 /7 */
-static void sar_rm32_imm8(Emulator* emu, ModRM* modrm) {
-	uint32_t rm32 = get_rm32(emu, modrm); //eax register value
-	uint32_t imm8 = (int32_t)get_sign_code8(emu, 0); //0x10 [16] shift amount
-	uint32_t original_rm32 = rm32;
-	imm8 %= 32;
-	uint32_t sign_flag = rm32 & 0x80000000;
-	if(imm8 > 0 && imm8 < 32) {
-		uint32_t mask = (1 << (32 - imm8)) - 1;
-		uint32_t carry_flag = rm32 & (1 << (imm8 - 1));
-	
-		rm32 = (rm32 >> imm8) & mask;
-		set_carry(emu, carry_flag);
-	
-		if(sign_flag)
-			rm32 |= ~mask;
-	
-		set_zero(emu, (rm32 & 0xffffffff) == 0);
-		set_sign(emu, (rm32 & 0x80000000));
-		set_parity(emu, PARITY(rm32 & 0xff));
-	
-		emu->eip += 1;
-		set_rm32(emu, modrm, rm32);
-	} else if(imm8 >= 32) {
-		/* seems impossible but idk maybe possible??? */
-		if(sign_flag) {
-			set_rm32(emu, modrm, 0xffffffff);
-			set_carry(emu, 1);
-			set_zero(emu, 0);
-			set_sign(emu, 1);
-			set_parity(emu, 1);
-		} else {
-			set_rm32(emu, modrm, 0);
-			set_carry(emu, 0);
-			set_zero(emu, 1);
-			set_sign(emu, 0);
-			set_parity(emu, 0);	
-		}
+	set_register32(emu, EDI, dst + done * step);
+	if (rep) {
+		set_register32(emu, ECX, count - done);
 	}
 }
+BYTE_HANDLER(scas)
+SIZED_HANDLERS(scas)
 
-/* 0xC1 */
-static void code_c1(Emulator* emu) {
-	emu->eip += 1;
-	ModRM modrm;
-	parse_modrm(emu, &modrm, false);
+/* 0xB0 /r */
+static void mov_r8_imm8(Emulator* emu) {
+	uint8_t reg = get_code8(emu, 0) - 0xB0;
+	set_register8(emu, reg, get_imm8(emu, 1));
+	emu->eip += 2;
+}
 
-	switch (modrm.opcode) {
-		case 0:
-			rol_rm32_imm8(emu, &modrm); //ROL
+/* 0xB8 /r */
+static void mov_r32_imm32(Emulator* emu) {
+	uint8_t reg = get_code8(emu, 0) - 0xB8;
+	uint32_t value = get_imm32(emu, 1);
+	set_register32(emu, reg, value);
+	emu->eip += 5;
+}
+
+/* Rotates the host does in one rol / ror: clang has builtins, and GCC spots the idiom */
+#if defined(__has_builtin)
+#if __has_builtin(__builtin_rotateleft32)
+#define HAS_ROTATE_BUILTINS (1)
+#endif
+#endif
+
+static inline uint32_t rotate_left32(uint32_t value, uint32_t count) {
+#ifdef HAS_ROTATE_BUILTINS
+	return __builtin_rotateleft32(value, count);
+#else
+	return value << (count & 31) | value >> (-count & 31);
+#endif
+}
+
+static inline uint32_t rotate_right32(uint32_t value, uint32_t count) {
+#ifdef HAS_ROTATE_BUILTINS
+	return __builtin_rotateright32(value, count);
+#else
+	return value >> (count & 31) | value << (-count & 31);
+#endif
+}
+
+/* Operations of 0xC1, 0xD1 and 0xD3 by ModRM reg field */
+enum { SHIFT_ROL, SHIFT_ROR, SHIFT_RCL, SHIFT_RCR, SHIFT_SHL, SHIFT_SHR, SHIFT_SAL, SHIFT_SAR };
+
+/*
+ * Shift or rotate r/m32 by count, masked to 5 bits as the hardware does.
+ * A count of 0 changes neither the operand nor the flags. Rotates set CF,
+ * shifts also SF, ZF and PF; OF is only written for a count of 1, the one
+ * count it is defined for. op is a constant in the group handlers, so the
+ * switch folds away there.
+ */
+static inline void shift_rm32(Emulator* emu, ModRM* modrm, int op, uint32_t count) {
+	uint32_t value, res, cf, of, mask;
+	uint64_t wide;
+
+	count &= 31;
+	if (count == 0) {
+		return;
+	}
+
+	value = get_rm32(emu, modrm);
+	switch (op) {
+		case SHIFT_ROL:
+			res = rotate_left32(value, count);
+			cf = res & 1;
+			of = cf ^ (res >> 31);
 			break;
-		case 1:
-			ror_rm32_imm8(emu, &modrm); //ROR
+		case SHIFT_ROR:
+			res = rotate_right32(value, count);
+			cf = res >> 31;
+			of = cf ^ ((res >> 30) & 1);
 			break;
-		case 2:
-			rcl_rm32_imm8(emu, &modrm); //RCL
+		case SHIFT_RCL:
+			/* 33 bits, CF above the operand; a count below 32 needs no mod 33 */
+			wide = (uint64_t)is_carry(emu) << 32 | value;
+			wide = (wide << count | wide >> (33 - count)) & 0x1FFFFFFFFull;
+			res = (uint32_t)wide;
+			cf = (uint32_t)(wide >> 32);
+			of = cf ^ (res >> 31);
 			break;
-		case 3:
-			rcr_rm32_imm8(emu, &modrm); //RCR
+		case SHIFT_RCR:
+			wide = (uint64_t)is_carry(emu) << 32 | value;
+			wide = (wide >> count | wide << (33 - count)) & 0x1FFFFFFFFull;
+			res = (uint32_t)wide;
+			cf = (uint32_t)(wide >> 32);
+			of = (res >> 31) ^ ((res >> 30) & 1);
 			break;
-		case 4:
-			shl_rm32_imm8(emu, &modrm); //SAL / SHL
+		case SHIFT_SHL:
+		case SHIFT_SAL:
+			res = value << count;
+			cf = (value >> (32 - count)) & 1;
+			of = cf ^ (res >> 31);
 			break;
-		case 5:
-			shr_rm32_imm8(emu, &modrm); //SHR
+		case SHIFT_SHR:
+			res = value >> count;
+			cf = (value >> (count - 1)) & 1;
+			of = value >> 31;
 			break;
-		case 7:
-			sar_rm32_imm8(emu, &modrm); //SAR
+		default: /* SHIFT_SAR */
+			res = (uint32_t)((int32_t)value >> count);
+			cf = (value >> (count - 1)) & 1;
+			of = 0;
 			break;
-		default:
-			printf("not implemented: c1 /%d\n", modrm.opcode);
-			system("pause");
 	}
+	set_rm32(emu, modrm, res);
+
+	mask = CARRY_FLAG | (count == 1 ? OVERFLOW_FLAG : 0) | (op >= SHIFT_SHL ? SIGN_FLAG | ZERO_FLAG | PARITY_FLAG : 0);
+	merge_flags(emu, mask, cf * CARRY_FLAG | of * OVERFLOW_FLAG | szp_flags(res, 32));
+}
+
+/* 0xC1 /n ib */
+static inline void shift_rm32_imm8(Emulator* emu, ModRM* modrm, int op) {
+	shift_rm32(emu, modrm, op, get_imm8(emu, 0));
+	emu->eip += 1;
+}
+
+/* 0xD1 /n */
+static inline void shift_rm32_1(Emulator* emu, ModRM* modrm, int op) {
+	shift_rm32(emu, modrm, op, 1);
+}
+
+/* 0xD3 /n */
+static inline void shift_rm32_cl(Emulator* emu, ModRM* modrm, int op) {
+	shift_rm32(emu, modrm, op, get_register8(emu, CL));
+}
+
+/* 0xC1 */
+static void code_c1(Emulator* emu) {
+	emu->eip += 1;
+	ModRM modrm;
+	parse_modrm(emu, &modrm, false);
+
+	PROFILE_GROUP(modrm.opcode);
+	shift_rm32_imm8(emu, &modrm, modrm.opcode);
+}
+
+/* 0xC2 */
+static void ret_imm16(Emulator* emu) {
+	uint16_t bytes = get_imm16(emu, 1);
+	emu->eip = pop32(emu);
+	set_register32(emu, ESP, get_register32(emu, ESP) + bytes);
 }
 
 /* 0xC3 */
@@ -1314,7 +1223,7 @@ static void mov_rm32_imm32(Emulator* emu) {
 	emu->eip += 1;
 	ModRM modrm;
 	parse_modrm(emu, &modrm, false);
-	uint32_t value = get_code32(emu, 0);
+	uint32_t value = get_imm32(emu, 0);
 	emu->eip += 4;
 	set_rm32(emu, &modrm, value);
 }
@@ -1329,7 +1238,7 @@ static void leave(Emulator* emu) {
 
 /* 0xCD */
 static void swi(Emulator* emu) {
-	uint8_t int_index = get_code8(emu, 1);
+	uint8_t int_index = get_imm8(emu, 1);
 	emu->eip += 2;
 
 	switch (int_index) {
@@ -1341,440 +1250,14 @@ static void swi(Emulator* emu) {
 	}
 }
 
-/* 0xD1 / 0 */
-static void rol_rm32_1(Emulator* emu, ModRM* modrm) {
-	uint8_t distance = 1;
-	uint32_t rm32 = get_rm32(emu, modrm); //eax register value
-
-	register unsigned int res, cnt;
-
-	/*
-	  rotate left
-	   value is the rotate distance.  It varies from 0 - 8.
-	   EDX is the byte object rotated.
-
-	   have 7 to 0
-	   The rotate is done mod 8.
-	 */
-	res = rm32;
-	if ((cnt = distance % 8) != 0) {
-       rm32 = (rm32 << cnt);
-       rm32 |= (rm32 >> (8-cnt)) & (1 << cnt) - 1;
-       
-		/* Carry flag set if there is a carry on the calculation results */
-		set_carry(emu, rm32 & 0x1);
-		set_overflow(emu, (rm32 + (rm32 >> 7)) & 1);
-	} else if (distance != 0) {
-		/* Carry flag set if there is a carry on the calculation results */
-		set_carry(emu, res & 0x80);
-	}
-
-	set_rm32(emu, modrm, res);
-}
-
-/* 0xD1 / 1 */
-static void ror_rm32_1(Emulator* emu, ModRM* modrm) {
-	uint8_t distance = 1;
-	uint32_t rm32 = get_rm32(emu, modrm); //eax register value
-
-	register unsigned int res, cnt;
-
-	/*
-	  rotate right
-	   value is the rotate distance.  It varies from 0 - 8.
-	   EDX is the byte object rotated.
-
-	   have 7 to 0
-	   The rotate is done mod 8.
-	 */
-	res = rm32;
-	if ((cnt = distance % 8) != 0) {
-		res = (rm32 << (8 - cnt));
-		res |= (rm32 >> (cnt)) & ((1 << (8 - cnt)) - 1);
-
-		/* Carry flag set if there is a carry on the calculation results */
-		set_carry(emu, res & 0x80);
-
-		/* OVERFLOW is set *IFF* s==1, then it is the xor of the two most significant bits.  Blecck. */
-		set_overflow(emu, distance == 1 && ((res >> 6) ^ (res >> 6) & 0x1));
-	} else if (distance != 0) {
-		/* Carry flag set if there is a carry on the calculation results */
-		set_carry(emu, res & 0x80);
-	}
-
-	set_rm32(emu, modrm, res);
-}
-
-/* 0xd1 /2 */
-static void rcl_rm32_1(Emulator* emu, ModRM* modrm) {
-	uint32_t rm32 = get_rm32(emu, modrm);
-	uint32_t imm8 = 1;
-
-	register uint32_t res, cnt, mask, cf;
-
-	if ((imm8 = imm8 % 33) != 0) {
-		cf = (rm32 >> (32 - imm8)) & 0x1;
-		rm32 = (rm32 << imm8) & 0xffffffff;
-		mask = (1 << (imm8 - 1)) - 1;
-		rm32 |= (rm32 >> (33 - imm8)) & mask;
-		if (is_carry(emu)) {     /* carry flag is set */
-			rm32 |= 1 << (imm8 - 1);
-		}
-		set_carry(emu, cf);
-		set_overflow(emu, (imm8 == 1 && (((cf + ((rm32 >> 30) & 0x2)) ^ ((cf + ((rm32 >> 30) & 0x2))>>1)) & 0x1)));
-	}
-
-	//TODO: FIX for all bit types later
-	set_rm32(emu, modrm, rm32);
-	emu->eip += 1;
-}
-
-/* 0xd1 /3 */
-static void rcr_rm32_1(Emulator* emu, ModRM* modrm) {
-	uint32_t rm32 = get_rm32(emu, modrm);
-	uint32_t imm8 = 1;
-
-	uint32_t mask, cf, ocf = 0;
-
-	/* rotate right through carry */
-	if ((imm8 = imm8 % 33) != 0) {
-		if (imm8 == 1) {
-			cf = rm32 & 0x1;
-			ocf = is_carry(emu) != 0;
-		} else
-			cf = (rm32 >> (imm8 - 1)) & 0x1;
-		mask = (1 << (32 - imm8)) - 1;
-		rm32 = (rm32 >> imm8) & mask;
-		if (imm8 != 1)
-			rm32 |= (rm32 << (33 - imm8));
-		if (is_carry(emu)) {     /* carry flag is set */
-			rm32 |= 1 << (32 - imm8);
-		}
-		set_carry(emu, cf);
-		if (imm8 == 1) {
-			set_overflow(emu, (((ocf + ((rm32 >> 30) & 0x2)) ^ ((ocf + ((rm32 >> 30) & 0x2))>>1)) & 0x1));
-		}
-	}
-
-	//TODO: FIX for all bit types later
-	set_rm32(emu, modrm, rm32);
-	emu->eip += 1;
-}
-
-/* 0xd1 /4 */
-static void shl_rm32_1(Emulator* emu, ModRM* modrm) {
-	uint32_t rm32 = get_rm32(emu, modrm); //eax register value
-	uint32_t imm8 = 1; //0x10 [16] shift amount
-	uint32_t original_rm32 = rm32;
-
-	imm8 %= 32;
-	if(imm8 > 0) {
-		rm32 = rm32 << imm8;
-		set_carry(emu, (rm32 & (1 << (32 - imm8))));
-		set_zero(emu, (rm32 & 0xffffffff) == 0);
-		set_sign(emu, rm32 & 0x80000000);
-		set_parity(emu, PARITY(rm32 & 0xff));
-	} else {
-		rm32 = 0;
-	}
-	if(imm8 == 1)
-		set_overflow(emu, (((rm32 & 0x80000000) == 0x80000000) ^
-                                  (is_carry(emu) != 0)));
-	emu->eip += 1;
-	set_rm32(emu, modrm, rm32);
-}
-
-/* 0xd1 /5 */
-static void shr_rm32_1(Emulator* emu, ModRM* modrm) {
-	uint32_t rm32 = get_rm32(emu, modrm); //eax register value
-	uint32_t imm8 = 1; //0x10 [16] shift amount
-	uint32_t original_rm32 = rm32;
-
-	imm8 %= 32;
-	if(imm8 > 0) {
-		rm32 = rm32 >> imm8;
-		set_carry(emu, (rm32 & (1 << (imm8 - 1))));
-		set_zero(emu, (rm32 & 0xffffffff) == 0);
-		set_sign(emu, rm32 & 0x80000000);
-		set_parity(emu, PARITY(rm32 & 0xff));
-	}
-	
-	if(imm8 == 1)
-		set_overflow(emu, XOR2(rm32 >> 30));
-	else
-		set_overflow(emu, 0);
-
-	emu->eip += 1;
-	set_rm32(emu, modrm, rm32);
-}
-
-/* 0xd1 /7 */
-static void sar_rm32_1(Emulator* emu, ModRM* modrm) {
-	uint32_t rm32 = get_rm32(emu, modrm); //eax register value
-	uint32_t imm8 = 1; //0x10 [16] shift amount
-	uint32_t original_rm32 = rm32;
-	imm8 %= 32;
-	uint32_t sign_flag = rm32 & 0x80000000;
-	uint32_t mask = (1 << (32 - imm8)) - 1;
-	uint32_t carry_flag = rm32 & (1 << (imm8 - 1));
-
-	rm32 = (rm32 >> imm8) & mask;
-	set_carry(emu, carry_flag);
-
-	if(sign_flag)
-		rm32 |= ~mask;
-
-	set_zero(emu, (rm32 & 0xffffffff) == 0);
-	set_sign(emu, (rm32 & 0x80000000));
-	set_parity(emu, PARITY(rm32 & 0xff));
-
-	emu->eip += 1;
-	set_rm32(emu, modrm, rm32);
-}
-
 /* 0xD1 */
 static void code_d1(Emulator* emu) {
 	emu->eip += 1;
 	ModRM modrm;
 	parse_modrm(emu, &modrm, false);
 
-	switch (modrm.opcode) {
-		case 0:
-			rol_rm32_1(emu, &modrm); //ROL
-			break;
-		case 1:
-			ror_rm32_1(emu, &modrm); //ROR
-			break;
-		case 2:
-			rcl_rm32_1(emu, &modrm); //ROR
-			break;
-		case 3:
-			rcr_rm32_1(emu, &modrm); //ROR
-			break;
-		case 4:
-			shl_rm32_1(emu, &modrm); //ROR
-			break;
-		case 5:
-			shr_rm32_1(emu, &modrm); //ROR
-			break;
-		case 7:
-			sar_rm32_1(emu, &modrm); //ROR
-			break;			
-		default:
-			printf("not implemented: d1 /%d\n", modrm.opcode);
-			system("pause");
-	}
-}
-
-/* 0xD3 / 0 */
-static void rol_rm32_cl(Emulator* emu, ModRM* modrm) {
-	uint8_t distance = get_register8(emu, CL);
-	uint32_t rm32 = get_rm32(emu, modrm); //eax register value
-
-	register unsigned int res, cnt;
-
-	/*
-	  rotate left
-	   value is the rotate distance.  It varies from 0 - 8.
-	   EDX is the byte object rotated.
-
-	   have 7 to 0
-	   The rotate is done mod 8.
-	 */
-	res = rm32;
-	if ((cnt = distance % 8) != 0) {
-       rm32 = (rm32 << cnt);
-       rm32 |= (rm32 >> (8-cnt)) & (1 << cnt) - 1;
-       
-		/* Carry flag set if there is a carry on the calculation results */
-		set_carry(emu, rm32 & 0x1);
-		set_overflow(emu, (rm32 + (rm32 >> 7)) & 1);
-	} else if (distance != 0) {
-		/* Carry flag set if there is a carry on the calculation results */
-		set_carry(emu, res & 0x80);
-	}
-
-	set_rm32(emu, modrm, res);
-}
-
-/* 0xD3 / 1 */
-static void ror_rm32_cl(Emulator* emu, ModRM* modrm) {
-	uint8_t distance = get_register8(emu, CL);
-	uint32_t rm32 = get_rm32(emu, modrm); //eax register value
-
-	register unsigned int res, cnt;
-
-	/*
-	  rotate right
-	   value is the rotate distance.  It varies from 0 - 8.
-	   EDX is the byte object rotated.
-
-	   have 7 to 0
-	   The rotate is done mod 8.
-	 */
-	res = rm32;
-	if ((cnt = distance % 8) != 0) {
-		res = (rm32 << (8 - cnt));
-		res |= (rm32 >> (cnt)) & ((1 << (8 - cnt)) - 1);
-
-		/* Carry flag set if there is a carry on the calculation results */
-		set_carry(emu, res & 0x80);
-
-		/* OVERFLOW is set *IFF* s==1, then it is the xor of the two most significant bits.  Blecck. */
-		set_overflow(emu, distance == 1 && ((res >> 6) ^ (res >> 6) & 0x1));
-	} else if (distance != 0) {
-		/* Carry flag set if there is a carry on the calculation results */
-		set_carry(emu, res & 0x80);
-	}
-
-	set_rm32(emu, modrm, res);
-}
-
-/* 0xd3 /2 */
-static void rcl_rm32_cl(Emulator* emu, ModRM* modrm) {
-	uint32_t rm32 = get_rm32(emu, modrm);
-	uint32_t imm8 = get_register8(emu, CL);
-
-	register uint32_t res, cnt, mask, cf;
-
-	if ((imm8 = imm8 % 33) != 0) {
-		cf = (rm32 >> (32 - imm8)) & 0x1;
-		rm32 = (rm32 << imm8) & 0xffffffff;
-		mask = (1 << (imm8 - 1)) - 1;
-		rm32 |= (rm32 >> (33 - imm8)) & mask;
-		if (is_carry(emu)) {     /* carry flag is set */
-			rm32 |= 1 << (imm8 - 1);
-		}
-		set_carry(emu, cf);
-		set_overflow(emu, (imm8 == 1 && (((cf + ((rm32 >> 30) & 0x2)) ^ ((cf + ((rm32 >> 30) & 0x2))>>1)) & 0x1)));
-	}
-
-	//TODO: FIX for all bit types later
-	set_rm32(emu, modrm, rm32);
-	emu->eip += 1;
-}
-
-/* 0xd3 /3 */
-static void rcr_rm32_cl(Emulator* emu, ModRM* modrm) {
-	uint32_t rm32 = get_rm32(emu, modrm);
-	uint32_t imm8 = get_register8(emu, CL);
-
-	uint32_t mask, cf, ocf = 0;
-
-	/* rotate right through carry */
-	if ((imm8 = imm8 % 33) != 0) {
-		if (imm8 == 1) {
-			cf = rm32 & 0x1;
-			ocf = is_carry(emu) != 0;
-		} else
-			cf = (rm32 >> (imm8 - 1)) & 0x1;
-		mask = (1 << (32 - imm8)) - 1;
-		rm32 = (rm32 >> imm8) & mask;
-		if (imm8 != 1)
-			rm32 |= (rm32 << (33 - imm8));
-		if (is_carry(emu)) {     /* carry flag is set */
-			rm32 |= 1 << (32 - imm8);
-		}
-		set_carry(emu, cf);
-		if (imm8 == 1) {
-			set_overflow(emu, (((ocf + ((rm32 >> 30) & 0x2)) ^ ((ocf + ((rm32 >> 30) & 0x2))>>1)) & 0x1));
-		}
-	}
-
-	//TODO: FIX for all bit types later
-	set_rm32(emu, modrm, rm32);
-	emu->eip += 1;
-}
-
-/* 0xd3 /4 */
-static void shl_rm32_cl(Emulator* emu, ModRM* modrm) {
-	uint32_t rm32 = get_rm32(emu, modrm); //eax register value
-	uint32_t imm8 = get_register8(emu, CL); //0x10 [16] shift amount
-	uint32_t original_rm32 = rm32;
-
-	imm8 %= 32;
-	if(imm8 > 0) {
-		rm32 = rm32 << imm8;
-		set_carry(emu, (rm32 & (1 << (32 - imm8))));
-		set_zero(emu, (rm32 & 0xffffffff) == 0);
-		set_sign(emu, rm32 & 0x80000000);
-		set_parity(emu, PARITY(rm32 & 0xff));
-	} else {
-		rm32 = 0;
-	}
-	if(imm8 == 1)
-		set_overflow(emu, (((rm32 & 0x80000000) == 0x80000000) ^
-                                  (is_carry(emu) != 0)));
-	emu->eip += 1;
-	set_rm32(emu, modrm, rm32);
-}
-
-/* 0xd3 /5 */
-static void shr_rm32_cl(Emulator* emu, ModRM* modrm) {
-	uint32_t rm32 = get_rm32(emu, modrm); //eax register value
-	uint32_t imm8 = get_register8(emu, CL); //0x10 [16] shift amount
-	uint32_t original_rm32 = rm32;
-
-	imm8 %= 32;
-	if(imm8 > 0) {
-		rm32 = rm32 >> imm8;
-		
-		set_carry(emu, (rm32 & (1 << (imm8 - 1))));
-		set_zero(emu, (rm32 & 0xffffffff) == 0);
-		set_sign(emu, rm32 & 0x80000000);
-		set_parity(emu, PARITY(rm32 & 0xff));
-	}
-	
-	if(imm8 == 1)
-		set_overflow(emu, XOR2(rm32 >> 30));
-	else
-		set_overflow(emu, 0);
-	
-	emu->eip += 1;
-	set_rm32(emu, modrm, rm32);
-}
-
-/* 0xd3 /7 */
-static void sar_rm32_cl(Emulator* emu, ModRM* modrm) {
-	uint32_t rm32 = get_rm32(emu, modrm); //eax register value
-	uint32_t imm8 = get_register8(emu, CL); //0x10 [16] shift amount
-	uint32_t original_rm32 = rm32;
-	imm8 %= 32;
-	uint32_t sign_flag = rm32 & 0x80000000;
-	
-	if(imm8 > 0 && imm8 < 32) {	
-		
-		uint32_t mask = (1 << (32 - imm8)) - 1;
-		uint32_t carry_flag = rm32 & (1 << (imm8 - 1));
-	
-		rm32 = (rm32 >> imm8) & mask;
-		set_carry(emu, carry_flag);
-	
-		if(sign_flag)
-			rm32 |= ~mask;
-	
-		set_zero(emu, (rm32 & 0xffffffff) == 0);
-		set_sign(emu, (rm32 & 0x80000000));
-		set_parity(emu, PARITY(rm32 & 0xff));
-		
-		set_rm32(emu, modrm, rm32);
-	} else if(imm8 >= 32) {
-		/* seems impossible but idk maybe possible??? */
-		if(sign_flag) {
-			set_rm32(emu, modrm, 0xffffffff);
-			set_carry(emu, 1);
-			set_zero(emu, 0);
-			set_sign(emu, 1);
-			set_parity(emu, 1);
-		} else {
-			set_rm32(emu, modrm, 0);
-			set_carry(emu, 0);
-			set_zero(emu, 1);
-			set_sign(emu, 0);
-			set_parity(emu, 0);	
-		}
-	}
-	emu->eip += 1;
+	PROFILE_GROUP(modrm.opcode);
+	shift_rm32_1(emu, &modrm, modrm.opcode);
 }
 
 /* 0xD3 */
@@ -1783,37 +1266,13 @@ static void code_d3(Emulator* emu) {
 	ModRM modrm;
 	parse_modrm(emu, &modrm, false);
 
-	switch (modrm.opcode) {
-		case 0:
-			rol_rm32_cl(emu, &modrm); //ROL
-			break;
-		case 1:
-			ror_rm32_cl(emu, &modrm); //ROR
-			break;
-		case 2:
-			rcl_rm32_cl(emu, &modrm); //ROR
-			break;
-		case 3:
-			rcr_rm32_cl(emu, &modrm); //ROR
-			break;
-		case 4:
-			shl_rm32_cl(emu, &modrm); //ROR
-			break;
-		case 5:
-			shr_rm32_cl(emu, &modrm); //ROR
-			break;
-		case 7:
-			sar_rm32_cl(emu, &modrm); //ROR
-			break;
-		default:
-			printf("not implemented: d3 /%d\n", modrm.opcode);
-			system("pause");
-	}
+	PROFILE_GROUP(modrm.opcode);
+	shift_rm32_cl(emu, &modrm, modrm.opcode);
 }
 
 /* 0xE4 */
 static void in_al_imm8(Emulator* emu) {
-	uint16_t address = (uint16_t)get_code8(emu, 1);
+	uint16_t address = (uint16_t)get_imm8(emu, 1);
 	uint8_t value = io_in8(address);
 	set_register8(emu, AL, value);
 	emu->eip += 2;
@@ -1821,20 +1280,20 @@ static void in_al_imm8(Emulator* emu) {
 
 /* 0xE8 */
 static void call_rel32(Emulator* emu) {
-	int32_t diff = get_sign_code32(emu, 1);
+	int32_t diff = get_sign_imm32(emu, 1);
 	push32(emu, emu->eip + 5);
 	emu->eip += (diff + 5);
 }
 
 /* 0xE9 */
 static void near_jump_rel32(Emulator* emu) {
-	int32_t diff = get_sign_code32(emu, 1);
+	int32_t diff = get_sign_imm32(emu, 1);
 	emu->eip += (diff + 5);
 }
 
 /* 0xEB */
 static void short_jump_rel8(Emulator* emu) {
-	int8_t diff = get_sign_code8(emu, 1);
+	int8_t diff = get_sign_imm8(emu, 1);
 	/* eip added to eip is jmp statement*/
 	emu->eip += (diff + 2);
 }
@@ -1868,369 +1327,158 @@ static void repe_mode(Emulator* emu) {
 }
 
 /* 0xF7 /0 */
-static void test_rm32_imm32(Emulator* emu, ModRM* modrm) {
-	if( emu->prefix_mode & PREFIX_OPSIZE_MODE_32_BIT ) { //32-bit mode registers mode active
-		uint32_t rm32 = get_rm32(emu, modrm); //register
-		uint32_t imm32 = get_code32(emu, 0); //hardcoded value
+static inline void test_rm_imm(Emulator* emu, ModRM* modrm, int bits) {
+	uint32_t rm = get_sized_rm(emu, modrm, bits); //register
+	uint32_t imm = get_sized_imm(emu, 0, bits); //hardcoded value
 
-		register uint32_t res = rm32 & imm32;
-		set_overflow(emu, 0);
-		set_sign(emu, res & 0x80000000);
-		set_zero(emu, res == 0);
-		set_parity(emu, PARITY(res & 0xff));
-		set_carry(emu, 0);
-	} else {	//16-bit mode registers mode active
-		uint32_t rm16 = get_rm16(emu, modrm); //register
-		uint32_t imm16 = get_code16(emu, 0); //hardcoded value
-
-		register uint32_t res = rm16 & imm16;
-		set_overflow(emu, 0);
-		set_sign(emu, res & 0x8000);
-		set_zero(emu, res == 0);
-		set_parity(emu, PARITY(res & 0xff));
-		set_carry(emu, 0);
-	}
+	register uint32_t res = rm & imm;
+	set_flags_test(emu, res, bits);
 
-	//if current segment is CS (CODE) default modes are 32 bit.
-	emu->prefix_mode |= PREFIX_OPSIZE_MODE_32_BIT | PREFIX_ADDRESS_MODE_32_BIT;
+	emu->eip += bits / 8;
 }
 
 /* 0xF7 /2 */
-static void not_rm32(Emulator* emu, ModRM* modrm) {
-	if( emu->prefix_mode & PREFIX_OPSIZE_MODE_32_BIT ) { //32-bit mode registers mode active
-		uint32_t rm32 = get_rm32(emu, modrm);
-		set_rm32(emu, modrm, ~rm32);
-	} else {	//16-bit mode registers mode active
-		uint16_t rm16 = get_rm16(emu, modrm);
-		set_rm16(emu, modrm, ~rm16);
-	}
-
-	//if current segment is CS (CODE) default modes are 32 bit.
-	emu->prefix_mode |= PREFIX_OPSIZE_MODE_32_BIT | PREFIX_ADDRESS_MODE_32_BIT;
+static inline void not_rm(Emulator* emu, ModRM* modrm, int bits) {
+	uint32_t rm = get_sized_rm(emu, modrm, bits);
+	set_sized_rm(emu, modrm, bits, ~rm);
 }
 
 /* 0xF7 /3 */
-static void neg_rm32(Emulator* emu, ModRM* modrm) {
-	if( emu->prefix_mode & PREFIX_OPSIZE_MODE_32_BIT ) { //32-bit mode registers mode active
-		uint32_t rm32 = get_rm32(emu, modrm);
-	
-		register uint32_t res = (uint32_t) - rm32;
-		register uint32_t bc = res | rm32;
-		
-		/* calculate the borrow chain --- modified such that d=0.
-	       substitutiing d=0 into     bc= res&(~d|s)|(~d&s);
-	       (the one used for sub) and simplifying, since ~d=0xff...,
-	       ~d|s == 0xffff..., and res&0xfff... == res.  Similarly
-	       ~d&s == s.  So the simplified result is: */
-		
-		set_carry(emu, rm32 != 0);
-		set_zero(emu, (res & 0xffffffff) == 0);
-		set_sign(emu, res & 0x80000000);
-		set_parity(emu, PARITY(res & 0xff));
-		set_overflow(emu, XOR2(bc >> 30));
-		set_aux(emu, bc & 0x8);
-	    
-		set_rm32(emu, modrm, res);
-	} else {	//16-bit mode registers mode active
-		uint16_t rm16 = get_rm16(emu, modrm);
-	
-		register uint16_t res = (uint16_t) - rm16;
-		register uint16_t bc = res | rm16;
-		
-		/* calculate the borrow chain --- modified such that d=0.
-	       substitutiing d=0 into     bc= res&(~d|s)|(~d&s);
-	       (the one used for sub) and simplifying, since ~d=0xff...,
-	       ~d|s == 0xffff..., and res&0xfff... == res.  Similarly
-	       ~d&s == s.  So the simplified result is: */
-	       
-	    set_carry(emu, rm16 != 0);
-		set_zero(emu, (res & 0xffff) == 0);
-		set_sign(emu, res & 0x8000);
-		set_parity(emu, PARITY(res & 0xff));
-		set_overflow(emu, XOR2(bc >> 14));
-		set_aux(emu, bc & 0x8);
-	    
-		set_rm16(emu, modrm, res);
+static inline void neg_rm(Emulator* emu, ModRM* modrm, int bits) {
+	uint32_t rm = get_sized_rm(emu, modrm, bits);
+
+	register uint32_t res = (uint32_t) - rm;
+	if (bits == 16) {
+		res &= 0xffff;
 	}
 
-	//if current segment is CS (CODE) default modes are 32 bit.
-	emu->prefix_mode |= PREFIX_OPSIZE_MODE_32_BIT | PREFIX_ADDRESS_MODE_32_BIT;
+	set_flags_sub(emu, 0, rm, res, bits);
+
+	set_sized_rm(emu, modrm, bits, res);
 }
 
 /* 0xF7 /4 */
-static void mul_rm32(Emulator* emu, ModRM* modrm) {
-	if( emu->prefix_mode & PREFIX_OPSIZE_MODE_32_BIT ) { //32-bit mode registers mode active
-		uint32_t eax = get_register32(emu, EAX);
-		uint32_t rm32 = get_rm32(emu, modrm);
-		
-		uint64_t res = (uint64_t)eax * rm32;
-		
-		set_register32(emu, EAX, (uint32_t)res);
-		set_register32(emu, EDX, (uint32_t)(res >> 32));
-		
-		if (get_register32(emu, EDX) == 0) {
-	    	set_carry(emu, 0);
-	    	set_overflow(emu, 0);
-	    }
-	    else {
-	    	set_carry(emu, 1);
-	    	set_overflow(emu, 1);
-	    }
-    } else {	//16-bit mode registers mode active	
-		uint16_t ax = get_register16(emu, AX);
-		uint16_t rm16 = get_rm16(emu, modrm);
-		
-		uint32_t res = ax * rm16;
-		
-		set_register16(emu, AX, (uint16_t)res);
-		set_register16(emu, DX, (uint16_t)(res >> 16));
-		
-		if (get_register16(emu, DX) == 0) {
-	    	set_carry(emu, 0);
-	    	set_overflow(emu, 0);
-	    }
-	    else {
-	    	set_carry(emu, 1);
-	    	set_overflow(emu, 1);
-	    }
-	}
+static inline void mul_rm(Emulator* emu, ModRM* modrm, int bits) {
+	uint32_t eax = get_sized_register(emu, EAX, bits);
+	uint32_t rm = get_sized_rm(emu, modrm, bits);
+
+	uint64_t res = (uint64_t)eax * rm;
 
-	//if current segment is CS (CODE) default modes are 32 bit.
-	emu->prefix_mode |= PREFIX_OPSIZE_MODE_32_BIT | PREFIX_ADDRESS_MODE_32_BIT;
+	set_sized_register(emu, EAX, bits, (uint32_t)res);
+	set_sized_register(emu, EDX, bits, (uint32_t)(res >> bits));
+
+	if (get_sized_register(emu, EDX, bits) == 0) {
+		set_carry(emu, 0);
+		set_overflow(emu, 0);
+	}
+	else {
+		set_carry(emu, 1);
+		set_overflow(emu, 1);
+	}
 }
 
 /* 0xF7 /5 */
-static void imul_rm32(Emulator* emu, ModRM* modrm) {
-	if( emu->prefix_mode & PREFIX_OPSIZE_MODE_32_BIT ) { //32-bit mode registers mode active
-		uint32_t eax = get_register32(emu, EAX);
-		uint32_t rm32 = get_rm32(emu, modrm);
-		
-		uint64_t res = (uint64_t) (uint32_t)eax * (uint32_t)rm32;
-		eax = (uint32_t)res;
-		uint32_t edx = (uint32_t) (res >> 32);
-	
-		set_register32(emu, EAX, eax);
-		set_register32(emu, EDX, edx);		
-	
-		if (((get_register32(emu, EAX) & 0x80000000) == 0 && get_register32(emu, EDX) == 0x00) ||
-	        ((get_register32(emu, EAX) & 0x80000000) != 0 && get_register32(emu, EDX) == 0xFF)) {
-	        set_carry(emu, 0);
-	    	set_overflow(emu, 0);
-	    } else {
-	        set_carry(emu, 1);
-			set_overflow(emu, 1);
-	    }
-    } else {	//16-bit mode registers mode active
-		uint16_t ax = get_register16(emu, AX);
-		uint16_t rm16 = get_rm16(emu, modrm);
-		
-		uint32_t res = (uint16_t)ax * (uint16_t)rm16;
-
-		set_register16(emu, AX, (uint16_t)res);
-		set_register16(emu, DX, (uint16_t)(res >> 16));		
-	
-		if (((get_register16(emu, AX) & 0x8000) == 0 && get_register16(emu, DX) == 0x00) ||
-	        ((get_register16(emu, AX) & 0x8000) != 0 && get_register16(emu, DX) == 0xFF)) {
-	        set_carry(emu, 0);
-	    	set_overflow(emu, 0);
-	    } else {
-	        set_carry(emu, 1);
-			set_overflow(emu, 1);
-	    }
-	}
+static inline void imul_rm(Emulator* emu, ModRM* modrm, int bits) {
+	uint32_t sign = 1u << (bits - 1);
+	uint32_t eax = get_sized_register(emu, EAX, bits);
+	uint32_t rm = get_sized_rm(emu, modrm, bits);
 
-	//if current segment is CS (CODE) default modes are 32 bit.
-	emu->prefix_mode |= PREFIX_OPSIZE_MODE_32_BIT | PREFIX_ADDRESS_MODE_32_BIT;
-}
+	uint64_t res = (uint64_t) (uint32_t)eax * (uint32_t)rm;
 
-/* 0xF7 /6 */
-static void div_rm16_32(Emulator* emu, ModRM* modrm) {
-	if( emu->prefix_mode & PREFIX_OPSIZE_MODE_32_BIT ) { //32-bit mode registers mode active
-		uint32_t rm32 = get_rm32(emu, modrm); //register
-		uint32_t eax = get_register32(emu, EAX);
-		uint32_t edx = get_register32(emu, EDX);
-		
-		uint64_t dvd = (((uint64_t) edx) << 32) | eax;
-		uint64_t div = dvd / (uint32_t)rm32;
-		uint64_t mod = dvd % (uint32_t)rm32;
-		
-		set_carry(emu, 0);
-		set_aux(emu, 0);
-		set_sign(emu, 0);
-		set_zero(emu, 1);
-		set_parity(emu, PARITY(mod & 0xff));
-	
-		set_register32(emu, EAX, div);
-		set_register32(emu, EDX, mod);
-	} else {	//16-bit mode registers mode active
-		uint16_t rm16 = get_rm16(emu, modrm); //register
-		uint16_t ax = get_register16(emu, AX);
-		uint16_t dx = get_register16(emu, DX);
-		
-		uint32_t dvd = (((uint32_t) dx) << 16) | ax;
-		uint32_t div = dvd / (uint16_t)rm16;
-		uint32_t mod = dvd % (uint16_t)rm16;
-		
-		
+	set_sized_register(emu, EAX, bits, (uint32_t)res);
+	set_sized_register(emu, EDX, bits, (uint32_t)(res >> bits));
+
+	if (((get_sized_register(emu, EAX, bits) & sign) == 0 && get_sized_register(emu, EDX, bits) == 0x00) ||
+		((get_sized_register(emu, EAX, bits) & sign) != 0 && get_sized_register(emu, EDX, bits) == 0xFF)) {
 		set_carry(emu, 0);
-		set_sign(emu, 0);
-		set_zero(emu, (div == 0));
-		set_parity(emu, PARITY(mod & 0xff));
-		
-		set_register16(emu, AX, div);
-		set_register16(emu, DX, mod);
+		set_overflow(emu, 0);
+	} else {
+		set_carry(emu, 1);
+		set_overflow(emu, 1);
 	}
-
-	//if current segment is CS (CODE) default modes are 32 bit.
-	emu->prefix_mode |= PREFIX_OPSIZE_MODE_32_BIT | PREFIX_ADDRESS_MODE_32_BIT;
 }
 
-/* 0xF7 /7 */
-static void idiv_rm32(Emulator* emu, ModRM* modrm) {
-	if( emu->prefix_mode & PREFIX_OPSIZE_MODE_32_BIT ) { //32-bit mode registers mode active
-		uint32_t rm32 = get_rm32(emu, modrm); //register
-		uint32_t eax = get_register32(emu, EAX);
-		uint32_t edx = get_register32(emu, EDX);
-		
-		uint64_t dvd = (((uint64_t) edx) << 32) | eax;
-		uint64_t div = dvd / (uint32_t)rm32;
-		uint64_t mod = dvd % (uint32_t)rm32;
-		
-		set_carry(emu, 0);
-		set_aux(emu, 0);
-		set_sign(emu, 0);
-		set_zero(emu, 1);
-		set_parity(emu, PARITY(mod & 0xff));
-	
-		set_register32(emu, EAX, div);
-		set_register32(emu, EDX, mod);
-	} else {	//16-bit mode registers mode active
-		uint16_t rm16 = get_rm16(emu, modrm); //register
-		uint16_t ax = get_register16(emu, AX);
-		uint16_t dx = get_register16(emu, DX);
-		
-		uint32_t dvd = (((uint32_t) dx) << 16) | ax;
-		uint32_t div = dvd / (uint16_t)rm16;
-		uint32_t mod = dvd % (uint16_t)rm16;
-		
-		
-		set_carry(emu, 0);
-		set_sign(emu, 0);
-		set_zero(emu, (div == 0));
-		set_parity(emu, PARITY(mod & 0xff));
-		
-		set_register16(emu, AX, div);
-		set_register16(emu, DX, mod);
-	}
+/* 0xF7 /6 */
+static inline void div_rm(Emulator* emu, ModRM* modrm, int bits) {
+	uint32_t rm = get_sized_rm(emu, modrm, bits); //register
+	uint32_t eax = get_sized_register(emu, EAX, bits);
+	uint32_t edx = get_sized_register(emu, EDX, bits);
+
+	uint64_t dvd = (((uint64_t) edx) << bits) | eax;
+	uint64_t div = dvd / (uint32_t)rm;
+	uint64_t mod = dvd % (uint32_t)rm;
+
+	set_carry(emu, 0);
+	set_aux(emu, 0);
+	set_sign(emu, 0);
+	set_zero(emu, 1);
+	set_parity(emu, PARITY(mod & 0xff));
+
+	set_sized_register(emu, EAX, bits, div);
+	set_sized_register(emu, EDX, bits, mod);
+}
 
-	//if current segment is CS (CODE) default modes are 32 bit.
-	emu->prefix_mode |= PREFIX_OPSIZE_MODE_32_BIT | PREFIX_ADDRESS_MODE_32_BIT;
+/* 0xF7 /7: unsigned, as div */
+static inline void idiv_rm(Emulator* emu, ModRM* modrm, int bits) {
+	div_rm(emu, modrm, bits);
 }
 
 /* 0xF7 */
-static void code_f7(Emulator* emu) {
+static inline void group_f7_rm(Emulator* emu, int bits) {
 	emu->eip += 1;
 	ModRM modrm;
 	parse_modrm(emu, &modrm, false);
 
+	PROFILE_GROUP(modrm.opcode);
 	switch (modrm.opcode) {
 		case 0:
-			test_rm32_imm32(emu, &modrm); //TEST rm32, imm32
+			test_rm_imm(emu, &modrm, bits); //TEST rm32, imm32
 			break;
 		case 2:
-			not_rm32(emu, &modrm); //NOT rm32
+			not_rm(emu, &modrm, bits); //NOT rm32
 			break;
 		case 3:
-			neg_rm32(emu, &modrm); //NEG rm32
+			neg_rm(emu, &modrm, bits); //NEG rm32
 			break;
 		case 4:
-			mul_rm32(emu, &modrm); //MUL rm32
+			mul_rm(emu, &modrm, bits); //MUL rm32
 			break;
 		case 5:
-			imul_rm32(emu, &modrm); //IMUL rm32
+			imul_rm(emu, &modrm, bits); //IMUL rm32
 			break;
 		case 6:
-			div_rm16_32(emu, &modrm); //DIV rm32 / rm16
+			div_rm(emu, &modrm, bits); //DIV rm32 / rm16
 			break;
 		case 7:
-			idiv_rm32(emu, &modrm); //IDIV
+			idiv_rm(emu, &modrm, bits); //IDIV
 			break;
 		default:
 			printf("not implemented: F7 /%d\n", modrm.opcode);
 			system("pause");
 	}
 }
+SIZED_HANDLERS(group_f7_rm)
 
 /* 0xFF /0 */
-static void inc_rm32(Emulator* emu, ModRM* modrm) {
-	if( emu->prefix_mode & PREFIX_OPSIZE_MODE_32_BIT ) { //32-bit mode registers mode active
-		uint32_t rm32 = get_rm32(emu, modrm);
-		
-		register uint32_t res = rm32 + 1;
-		/* calculate the carry chain */
-		register uint32_t cc = (1 & rm32) | ((~res) & (1 | rm32));
-	    
-		set_rm32(emu, modrm, res);
-		
-		set_zero(emu, (res & 0xffffffff) == 0);
-		set_sign(emu, res & 0x80000000);
-		set_parity(emu, PARITY(res & 0xff));
-		set_overflow(emu, XOR2(cc >> 30));
-		set_aux(emu, cc & 0x8);
-	} else {	//16-bit mode registers mode active
-		uint16_t rm16 = get_rm16(emu, modrm);
-		
-		register uint32_t res = rm16 + 1;
-		/* calculate the carry chain */
-		register uint32_t cc = (1 & rm16) | ((~res) & (1 | rm16));
-	    
-		set_rm16(emu, modrm, (uint16_t)res);
-		
-		set_zero(emu, (res & 0xffff) == 0);
-		set_sign(emu, res & 0x8000);
-		set_parity(emu, PARITY(res & 0xff));
-		set_overflow(emu, XOR2(cc >> 14));
-		set_aux(emu, cc & 0x8);
-	}
+static inline void inc_rm(Emulator* emu, ModRM* modrm, int bits) {
+	uint32_t rm = get_sized_rm(emu, modrm, bits);
+
+	register uint32_t res = rm + 1;
 
-	//if current segment is CS (CODE) default modes are 32 bit.
-	emu->prefix_mode |= PREFIX_OPSIZE_MODE_32_BIT | PREFIX_ADDRESS_MODE_32_BIT;
+	set_sized_rm(emu, modrm, bits, res);
+
+	set_flags_inc(emu, rm, res, bits);
 }
 
 /* 0xFF /1*/
-static void dec_rm32(Emulator* emu, ModRM* modrm) {
-	if( emu->prefix_mode & PREFIX_OPSIZE_MODE_32_BIT ) { //32-bit mode registers mode active
-		uint32_t rm32 = get_rm32(emu, modrm);
-		
-		register uint32_t res = rm32 - 1;
-		/* calculate the borrow chain. */
-		register uint32_t bc = (res & (~rm32 | 1)) | (~rm32 & 1);;
-		
-		set_rm32(emu, modrm, res);
-		
-		set_zero(emu, (res & 0xffffffff) == 0);
-		set_sign(emu, res & 0x80000000);
-		set_parity(emu, PARITY(res & 0xff));
-		set_overflow(emu, XOR2(bc >> 30));
-		set_aux(emu, bc & 0x8);
-	} else {	//16-bit mode registers mode active
-		uint16_t rm16 = get_rm16(emu, modrm);
-		
-		register uint32_t res = rm16 - 1;
-		/* calculate the borrow chain. */
-		register uint32_t bc = (res & (~rm16 | 1)) | (~rm16 & 1);
-	    
-		set_rm16(emu, modrm, (uint16_t)res);
-		
-		set_zero(emu, (res & 0xffff) == 0);
-		set_sign(emu, res & 0x8000);
-		set_parity(emu, PARITY(res & 0xff));
-		set_overflow(emu, XOR2(bc >> 14));
-		set_aux(emu, bc & 0x8);
-	}
+static inline void dec_rm(Emulator* emu, ModRM* modrm, int bits) {
+	uint32_t rm = get_sized_rm(emu, modrm, bits);
+
+	register uint32_t res = rm - 1;
 
-	//if current segment is CS (CODE) default modes are 32 bit.
-	emu->prefix_mode |= PREFIX_OPSIZE_MODE_32_BIT | PREFIX_ADDRESS_MODE_32_BIT;
+	set_sized_rm(emu, modrm, bits, res);
+
+	set_flags_dec(emu, rm, res, bits);
 }
 
 /* 0xFF /2*/
@@ -2246,17 +1494,18 @@ static void push_rm32(Emulator* emu, ModRM* modrm) {
 	push32(emu, rm32);
 }
 
-static void code_ff(Emulator* emu) {
+static inline void group_ff_rm(Emulator* emu, int bits) {
 	emu->eip += 1;
 	ModRM modrm;
 	parse_modrm(emu, &modrm, false);
 
+	PROFILE_GROUP(modrm.opcode);
 	switch (modrm.opcode) {
 		case 0:
-			inc_rm32(emu, &modrm); //INC
+			inc_rm(emu, &modrm, bits); //INC
 			break;
 		case 1:
-			dec_rm32(emu, &modrm); //DEC
+			dec_rm(emu, &modrm, bits); //DEC
 			break;
 		case 2:
 			//CALL
@@ -2282,100 +1531,571 @@ static void code_ff(Emulator* emu) {
 			system("pause");
 	}
 }
+SIZED_HANDLERS(group_ff_rm)
+
+/*
+ * Fused pairs (decode_cache.c). Each runs the first instruction from its
+ * decoded operands and the second without a dispatch of its own; the flags
+ * are left pending as the first instruction left them, and the Jcc tests
+ * its condition from them directly.
+ */
+
+/* End a fused Jcc pair */
+static void fused_jcc(Emulator* emu, DecodedInstruction* insn) {
+	emu->eip = test_condition(emu, insn->condition) ? insn->target : insn->eip + insn->fused_length;
+}
+
+static void fused_cmp_jcc(Emulator* emu) {
+	DecodedInstruction* insn = emu->insn;
+	uint32_t v1, v2;
+
+	switch (insn->opcode) {
+		case 0x3B:
+			v1 = get_r32(emu, &insn->modrm);
+			v2 = get_rm32(emu, &insn->modrm);
+			break;
+		case 0x3D:
+			v1 = get_register32(emu, EAX);
+			v2 = insn->imm;
+			break;
+		case 0x81:
+			v1 = get_rm32(emu, &insn->modrm);
+			v2 = insn->imm;
+			break;
+		default: /* 0x83 /7 */
+			v1 = get_rm32(emu, &insn->modrm);
+			v2 = (int8_t)insn->imm;
+			break;
+	}
+
+	set_flags_sub(emu, v1, v2, v1 - v2, 32);
+	fused_jcc(emu, insn);
+}
+
+static void fused_test_jcc(Emulator* emu) {
+	DecodedInstruction* insn = emu->insn;
+
+	set_flags_test(emu, get_rm32(emu, &insn->modrm) & get_r32(emu, &insn->modrm), 32);
+	fused_jcc(emu, insn);
+}
+
+static void fused_push_ebp_mov(Emulator* emu) {
+	push32(emu, get_register32(emu, EBP));
+	set_register32(emu, EBP, get_register32(emu, ESP));
+	emu->eip += 3;
+}
 
 /* Function pointer table */
-void init_instructions(void) {
-	int i;
-	memset(instructions, 0, sizeof(instructions));
-	instructions[0x01] = add_rm32_r32;
-	instructions[0x03] = add_r32_rm32;
-	instructions[0x04] = add_al_imm8;
-	instructions[0x05] = add_eax_imm32;
-	instructions[0x09] = or_rm32_r32;
-	instructions[0x0b] = or_r32_rm32;
-	instructions[0x0d] = or_eax_imm32;
-	instructions[0x0F] = code_0f;
-	instructions[0x21] = and_rm32_r32;
-	instructions[0x23] = and_r32_rm32;
-	instructions[0x25] = and_eax_imm32;
-	instructions[0x29] = sub_rm32_r32;
-	instructions[0x2B] = sub_r32_rm32;
-	instructions[0x2D] = sub_eax_imm32;
-	instructions[0x31] = xor_rm32_r32;	
-	instructions[0x33] = xor_r32_rm32;
-	instructions[0x35] = xor_eax_imm32;
-	instructions[0x3B] = cmp_r32_rm32;
-	instructions[0x3C] = cmp_al_imm8;
-	instructions[0x3D] = cmp_eax_imm32;
-
-	for (i = 0; i < 8; i++) {
-		instructions[0x40 + i] = inc_r32;
+/* Handler of each implemented opcode, for the function table and the threaded loop */
+#define INSTRUCTION_TABLE(X) \
+	X(0x01, add_rm32_r32) \
+	X(0x03, add_r32_rm32) \
+	X(0x04, add_al_imm8) \
+	X(0x05, add_eax_imm32) \
+	X(0x09, or_rm32_r32) \
+	X(0x0B, or_r32_rm32) \
+	X(0x0D, or_eax_imm32) \
+	X(0x0F, code_0f) \
+	X(0x21, and_rm32_r32) \
+	X(0x23, and_r32_rm32) \
+	X(0x25, and_eax_imm32) \
+	X(0x29, sub_rm32_r32) \
+	X(0x2B, sub_r32_rm32) \
+	X(0x2D, sub_eax_imm32) \
+	X(0x31, xor_rm32_r32) \
+	X(0x33, xor_r32_rm32) \
+	X(0x35, xor_eax_imm32) \
+	X(0x3B, cmp_r32_rm32) \
+	X(0x3C, cmp_al_imm8) \
+	X(0x3D, cmp_eax_imm32) \
+	X(0x40, inc_r32) X(0x41, inc_r32) X(0x42, inc_r32) X(0x43, inc_r32) \
+	X(0x44, inc_r32) X(0x45, inc_r32) X(0x46, inc_r32) X(0x47, inc_r32) \
+	X(0x50, push_r32) X(0x51, push_r32) X(0x52, push_r32) X(0x53, push_r32) \
+	X(0x54, push_r32) X(0x55, push_r32) X(0x56, push_r32) X(0x57, push_r32) \
+	X(0x58, pop_r32) X(0x59, pop_r32) X(0x5A, pop_r32) X(0x5B, pop_r32) \
+	X(0x5C, pop_r32) X(0x5D, pop_r32) X(0x5E, pop_r32) X(0x5F, pop_r32) \
+	X(0x66, opsize_mode) \
+	X(0x67, address_mode) \
+	X(0x68, push_imm32) \
+	X(0x69, imul_r_rm_imm32) \
+	X(0x6A, push_imm8) \
+	X(0x70, jo) \
+	X(0x71, jno) \
+	X(0x72, jc) \
+	X(0x73, jnc) \
+	X(0x74, jz) \
+	X(0x75, jnz) \
+	X(0x78, js) \
+	X(0x79, jns) \
+	X(0x7C, jl) \
+	X(0x7E, jle) \
+	X(0x7F, jg) \
+	X(0x81, code_81) \
+	X(0x83, code_83) \
+	X(0x85, test_rm32_r32) \
+	X(0x88, mov_rm8_r8) \
+	X(0x89, mov_rm32_r32) \
+	X(0x8A, mov_r8_rm8) \
+	X(0x8B, mov_r_rm32) \
+	X(0x8D, lea_r16_r32_m) \
+	X(0x90, nop) \
+	X(0xA4, movs8) X(0xA5, movs32) X(0xA6, cmps8) X(0xA7, cmps32) \
+	X(0xAA, stos8) X(0xAB, stos32) X(0xAC, lods8) X(0xAD, lods32) X(0xAE, scas8) X(0xAF, scas32) \
+	X(0xB0, mov_r8_imm8) X(0xB1, mov_r8_imm8) X(0xB2, mov_r8_imm8) X(0xB3, mov_r8_imm8) \
+	X(0xB4, mov_r8_imm8) X(0xB5, mov_r8_imm8) X(0xB6, mov_r8_imm8) X(0xB7, mov_r8_imm8) \
+	X(0xB8, mov_r32_imm32) X(0xB9, mov_r32_imm32) X(0xBA, mov_r32_imm32) X(0xBB, mov_r32_imm32) \
+	X(0xBC, mov_r32_imm32) X(0xBD, mov_r32_imm32) X(0xBE, mov_r32_imm32) X(0xBF, mov_r32_imm32) \
+	X(0xC1, code_c1) \
+	X(0xC2, ret_imm16) \
+	X(0xC3, ret) \
+	X(0xC7, mov_rm32_imm32) \
+	X(0xC9, leave) \
+	X(0xCD, swi) \
+	X(0xD1, code_d1) \
+	X(0xD3, code_d3) \
+	X(0xE4, in_al_imm8) \
+	X(0xE8, call_rel32) \
+	X(0xE9, near_jump_rel32) \
+	X(0xEB, short_jump_rel8) \
+	X(0xEC, in_al_dx) \
+	X(0xEE, out_dx_al) \
+	X(0xF2, repne_mode) \
+	X(0xF3, repe_mode) \
+	X(0xF7, group_f7_rm32) \
+	X(0xFF, group_ff_rm32)
+
+/* Handler of each fused pair */
+#define FUSED_TABLE(X) \
+	X(FUSED_CMP_JCC, fused_cmp_jcc) \
+	X(FUSED_TEST_JCC, fused_test_jcc) \
+	X(FUSED_PUSH_EBP_MOV, fused_push_ebp_mov)
+
+/* Operand size 16 variants, for after 0x66 */
+#define INSTRUCTION16_TABLE(X) \
+	X(0x40, inc_r16) X(0x41, inc_r16) X(0x42, inc_r16) X(0x43, inc_r16) \
+	X(0x44, inc_r16) X(0x45, inc_r16) X(0x46, inc_r16) X(0x47, inc_r16) \
+	X(0x69, imul_r_rm_imm16) \
+	X(0x8B, mov_r_rm16) \
+	X(0xA5, movs16) X(0xA7, cmps16) X(0xAB, stos16) X(0xAD, lods16) X(0xAF, scas16) \
+	X(0xF7, group_f7_rm16) \
+	X(0xFF, group_ff_rm16)
+
+/*
+ * Implemented sub-opcodes of the group opcodes by ModRM reg field, and the
+ * call running each on modrm. decode_cache.c points an instruction of the
+ * default mode straight at group_<opcode>_<reg>, which takes the ModRM the
+ * decoder parsed, instead of code_xx parsing it and switching on reg.
+ */
+#define GROUP_TABLE(X) \
+	X(0x81, 0, add_rm32_imm32(emu, modrm)) X(0x81, 1, or_rm32_imm32(emu, modrm)) \
+	X(0x81, 4, and_rm32_imm32(emu, modrm)) X(0x81, 5, sub_rm32_imm32(emu, modrm)) \
+	X(0x81, 6, xor_rm32_imm32(emu, modrm)) X(0x81, 7, cmp_rm32_imm32(emu, modrm)) \
+	X(0x83, 0, add_rm32_imm8(emu, modrm)) X(0x83, 1, or_rm32_imm8(emu, modrm)) \
+	X(0x83, 4, and_rm32_imm8(emu, modrm)) X(0x83, 5, sub_rm32_imm8(emu, modrm)) \
+	X(0x83, 6, xor_rm32_imm8(emu, modrm)) X(0x83, 7, cmp_rm32_imm8(emu, modrm)) \
+	X(0xC1, 0, shift_rm32_imm8(emu, modrm, SHIFT_ROL)) X(0xC1, 1, shift_rm32_imm8(emu, modrm, SHIFT_ROR)) \
+	X(0xC1, 2, shift_rm32_imm8(emu, modrm, SHIFT_RCL)) X(0xC1, 3, shift_rm32_imm8(emu, modrm, SHIFT_RCR)) \
+	X(0xC1, 4, shift_rm32_imm8(emu, modrm, SHIFT_SHL)) X(0xC1, 5, shift_rm32_imm8(emu, modrm, SHIFT_SHR)) \
+	X(0xC1, 6, shift_rm32_imm8(emu, modrm, SHIFT_SAL)) X(0xC1, 7, shift_rm32_imm8(emu, modrm, SHIFT_SAR)) \
+	X(0xD1, 0, shift_rm32_1(emu, modrm, SHIFT_ROL)) X(0xD1, 1, shift_rm32_1(emu, modrm, SHIFT_ROR)) \
+	X(0xD1, 2, shift_rm32_1(emu, modrm, SHIFT_RCL)) X(0xD1, 3, shift_rm32_1(emu, modrm, SHIFT_RCR)) \
+	X(0xD1, 4, shift_rm32_1(emu, modrm, SHIFT_SHL)) X(0xD1, 5, shift_rm32_1(emu, modrm, SHIFT_SHR)) \
+	X(0xD1, 6, shift_rm32_1(emu, modrm, SHIFT_SAL)) X(0xD1, 7, shift_rm32_1(emu, modrm, SHIFT_SAR)) \
+	X(0xD3, 0, shift_rm32_cl(emu, modrm, SHIFT_ROL)) X(0xD3, 1, shift_rm32_cl(emu, modrm, SHIFT_ROR)) \
+	X(0xD3, 2, shift_rm32_cl(emu, modrm, SHIFT_RCL)) X(0xD3, 3, shift_rm32_cl(emu, modrm, SHIFT_RCR)) \
+	X(0xD3, 4, shift_rm32_cl(emu, modrm, SHIFT_SHL)) X(0xD3, 5, shift_rm32_cl(emu, modrm, SHIFT_SHR)) \
+	X(0xD3, 6, shift_rm32_cl(emu, modrm, SHIFT_SAL)) X(0xD3, 7, shift_rm32_cl(emu, modrm, SHIFT_SAR)) \
+	X(0xF7, 0, test_rm_imm(emu, modrm, 32)) X(0xF7, 2, not_rm(emu, modrm, 32)) \
+	X(0xF7, 3, neg_rm(emu, modrm, 32)) X(0xF7, 4, mul_rm(emu, modrm, 32)) \
+	X(0xF7, 5, imul_rm(emu, modrm, 32)) X(0xF7, 6, div_rm(emu, modrm, 32)) \
+	X(0xF7, 7, idiv_rm(emu, modrm, 32)) \
+	X(0xFF, 0, inc_rm(emu, modrm, 32)) X(0xFF, 1, dec_rm(emu, modrm, 32)) \
+	X(0xFF, 2, call_rm32(emu, modrm)) X(0xFF, 6, push_rm32(emu, modrm))
+
+/* EIP past the ModRM as code_xx leaves it */
+#define GROUP_FUNCTION(opcode, reg, call) \
+	static void group_##opcode##_##reg(Emulator* emu) { \
+		ModRM* modrm = &emu->insn->modrm; \
+		emu->eip += emu->insn->modrm_offset + emu->insn->modrm_length; \
+		PROFILE_GROUP(reg); \
+		call; \
 	}
+GROUP_TABLE(GROUP_FUNCTION)
+#undef GROUP_FUNCTION
+
+/* Operations of the r/m, r and r, r/m opcodes */
+enum { ALU_ADD, ALU_OR, ALU_AND, ALU_SUB, ALU_XOR, ALU_CMP, ALU_TEST, ALU_MOV };
 
-	for (i = 0; i < 8; i++) {
-		instructions[0x50 + i] = push_r32;
+/* cmp and test only set the flags, mov does not read its destination */
+#define ALU_WRITES(op) ((op) != ALU_CMP && (op) != ALU_TEST)
+#define ALU_READS(op) ((op) != ALU_MOV)
+
+/* dst op src with the flags the opcode handlers set; op is a constant in each form, so the switch folds away */
+static inline uint32_t alu(Emulator* emu, int op, uint32_t dst, uint32_t src, int bits) {
+	uint32_t res;
+
+	switch (op) {
+		case ALU_ADD:
+			res = dst + src;
+			set_flags_add(emu, dst, src, res, bits);
+			return res;
+		case ALU_OR:
+			res = dst | src;
+			set_flags_logic(emu, res, bits);
+			return res;
+		case ALU_AND:
+			res = dst & src;
+			set_flags_logic(emu, res, bits);
+			return res;
+		case ALU_SUB:
+		case ALU_CMP:
+			res = dst - src;
+			set_flags_sub(emu, dst, src, res, bits);
+			return res;
+		case ALU_XOR:
+			res = dst ^ src;
+			set_flags_logic(emu, res, bits);
+			return res;
+		case ALU_TEST:
+			res = dst & src;
+			set_flags_test(emu, res, bits);
+			return res;
+		default: /* ALU_MOV */
+			return src;
 	}
+}
 
-	for (i = 0; i < 8; i++) {
-		instructions[0x58 + i] = pop_r32;
+/*
+ * r/m op= r (rm_r_form) and r op= r/m (r_rm_form) on the ModRM the decoder
+ * parsed. The register form goes to the registers without get_rm32's
+ * mod == 3 test; the memory form computes the address once for the read
+ * and the write back.
+ */
+static inline void rm_r_form(Emulator* emu, int op, int bits, bool memory) {
+	DecodedInstruction* insn = emu->insn;
+	ModRM* modrm = &insn->modrm;
+	uint32_t src = get_sized_register(emu, modrm->reg_index, bits);
+
+	emu->eip += insn->modrm_offset + insn->modrm_length;
+	if (memory) {
+		uint32_t address = calc_memory_address(emu, modrm);
+#if WORD_MEMORY_ACCESS
+		/* Read and write back through one page lookup, as set_memory32 would write it */
+		if (bits == 32 && ALU_READS(op) && ALU_WRITES(op) && GUEST_IN_PAGE(address, 4)) {
+			uint8_t* p = get_writable_page(emu, address) + GUEST_PAGE_OFFSET(address);
+			store_le32(p, alu(emu, op, load_le32(p), src, bits));
+			return;
+		}
+#endif
+		uint32_t res = alu(emu, op, ALU_READS(op) ? get_sized_memory(emu, address, bits) : 0, src, bits);
+		if (ALU_WRITES(op)) {
+			set_sized_memory(emu, address, bits, res);
+		}
+	} else {
+		uint32_t res = alu(emu, op, ALU_READS(op) ? get_sized_register(emu, modrm->rm, bits) : 0, src, bits);
+		if (ALU_WRITES(op)) {
+			set_sized_register(emu, modrm->rm, bits, res);
+		}
 	}
+}
+
+static inline void r_rm_form(Emulator* emu, int op, int bits, bool memory) {
+	DecodedInstruction* insn = emu->insn;
+	ModRM* modrm = &insn->modrm;
+	uint32_t src;
+
+	emu->eip += insn->modrm_offset + insn->modrm_length;
+	if (memory) {
+		src = get_sized_memory(emu, calc_memory_address(emu, modrm), bits);
+	} else {
+		src = get_sized_register(emu, modrm->rm, bits);
+	}
+
+	uint32_t res = alu(emu, op, ALU_READS(op) ? get_sized_register(emu, modrm->reg_index, bits) : 0, src, bits);
+	if (ALU_WRITES(op)) {
+		set_sized_register(emu, modrm->reg_index, bits, res);
+	}
+}
+
+/* r/m opcodes split into <name>_register and <name>_memory, by the form and the operation of each */
+#define FORM_TABLE(X) \
+	X(0x01, add_rm32_r32, rm_r_form, ALU_ADD, 32) \
+	X(0x03, add_r32_rm32, r_rm_form, ALU_ADD, 32) \
+	X(0x09, or_rm32_r32, rm_r_form, ALU_OR, 32) \
+	X(0x0B, or_r32_rm32, r_rm_form, ALU_OR, 32) \
+	X(0x21, and_rm32_r32, rm_r_form, ALU_AND, 32) \
+	X(0x23, and_r32_rm32, r_rm_form, ALU_AND, 32) \
+	X(0x29, sub_rm32_r32, rm_r_form, ALU_SUB, 32) \
+	X(0x2B, sub_r32_rm32, r_rm_form, ALU_SUB, 32) \
+	X(0x31, xor_rm32_r32, rm_r_form, ALU_XOR, 32) \
+	X(0x33, xor_r32_rm32, r_rm_form, ALU_XOR, 32) \
+	X(0x3B, cmp_r32_rm32, r_rm_form, ALU_CMP, 32) \
+	X(0x85, test_rm32_r32, rm_r_form, ALU_TEST, 32) \
+	X(0x88, mov_rm8_r8, rm_r_form, ALU_MOV, 8) \
+	X(0x89, mov_rm32_r32, rm_r_form, ALU_MOV, 32) \
+	X(0x8A, mov_r8_rm8, r_rm_form, ALU_MOV, 8) \
+	X(0x8B, mov_r_rm32, r_rm_form, ALU_MOV, 32)
+
+#define FORM_FUNCTIONS(opcode, name, form, op, bits) \
+	static void name##_register(Emulator* emu) { form(emu, op, bits, false); } \
+	static void name##_memory(Emulator* emu) { form(emu, op, bits, true); }
+FORM_TABLE(FORM_FUNCTIONS)
+#undef FORM_FUNCTIONS
+
+#ifdef PROFILE
+#define INSTRUCTION_NAME(opcode, func) [opcode] = #func,
+const char* instruction_names[256] = { INSTRUCTION_TABLE(INSTRUCTION_NAME) };
+#undef INSTRUCTION_NAME
+#endif
+
+void init_instructions(void) {
+	memset(instructions, 0, sizeof(instructions));
+
+#define SET_INSTRUCTION(opcode, func) instructions[opcode] = func;
+	INSTRUCTION_TABLE(SET_INSTRUCTION)
+#undef SET_INSTRUCTION
+
+	memset(instructions16, 0, sizeof(instructions16));
+
+#define SET_INSTRUCTION16(opcode, func) instructions16[opcode] = func;
+	INSTRUCTION16_TABLE(SET_INSTRUCTION16)
+#undef SET_INSTRUCTION16
+
+	memset(group_instructions, 0, sizeof(group_instructions));
+
+#define SET_GROUP(opcode, reg, call) group_instructions[(opcode) << 3 | (reg)] = group_##opcode##_##reg;
+	GROUP_TABLE(SET_GROUP)
+#undef SET_GROUP
+
+	memset(form_instructions, 0, sizeof(form_instructions));
+
+#define SET_FORMS(opcode, name, form, op, bits) \
+	form_instructions[(opcode) << 1] = name##_register; \
+	form_instructions[(opcode) << 1 | 1] = name##_memory;
+	FORM_TABLE(SET_FORMS)
+#undef SET_FORMS
+}
+
+/* An instruction after a prefix without a variant of its own: the default handler, then the prefixes are used up */
+static void prefixed_instruction(Emulator* emu) {
+	instructions[get_code8(emu, 0)](emu);
+	end_prefixes(emu);
+}
+
+instruction_func_t* select_instruction(uint8_t opcode, uint32_t mode) {
+	/* A prefix after a prefix adds to the mode instead of using it up */
+	int prefix = opcode == 0x66 || opcode == 0x67 || opcode == 0xF2 || opcode == 0xF3;
 
-	instructions[0x66] = opsize_mode;
-	instructions[0x67] = address_mode;
-	instructions[0x68] = push_imm32;
-	instructions[0x69] = imul_r32_rm32_imm32;
-	instructions[0x6A] = push_imm8;
-
-	instructions[0x70] = jo;
-	instructions[0x71] = jno;
-	instructions[0x72] = jc;
-	instructions[0x73] = jnc;
-	instructions[0x74] = jz;
-	instructions[0x75] = jnz;
-	instructions[0x78] = js;
-	instructions[0x79] = jns;
-	instructions[0x7C] = jl;
-	instructions[0x7E] = jle;
-	instructions[0x7F] = jg;
-
-	instructions[0x81] = code_81;
-	instructions[0x83] = code_83;
-	instructions[0x85] = test_rm32_r32;
-	instructions[0x88] = mov_rm8_r8;
-	instructions[0x89] = mov_rm32_r32;
-	instructions[0x8A] = mov_r8_rm8;
-	instructions[0x8B] = mov_r32_rm32;
-	instructions[0x8D] = lea_r16_r32_m;
-
-	instructions[0x90] = nop;
-
-	instructions[0xAB] = stos;
-
-	for (i = 0; i < 8; i++) {
-		instructions[0xB0 + i] = mov_r8_imm8;
+	if (mode == DEFAULT_MODE || prefix || instructions[opcode] == NULL) {
+		return instructions[opcode];
+	}
+	if (!(mode & PREFIX_OPSIZE_MODE_32_BIT) && instructions16[opcode] != NULL) {
+		return instructions16[opcode];
+	}
+	return prefixed_instruction;
+}
+
+#if THREADED_DISPATCH
+
+/* The label tables default every handler to not_implemented, then override the implemented ones */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Woverride-init"
+
+int run_instructions(Emulator* emu, uint32_t stop_eip) {
+	/* One indirect jump per opcode, so the host predicts each from its own history.
+	   Built by the compiler, so threads never race to fill it */
+#define SET_LABEL(opcode, func) [opcode] = &&op_##opcode,
+#define SET_GROUP_LABEL(opcode, reg, call) [GROUP_HANDLER(opcode, reg)] = &&op_group_##opcode##_##reg,
+#define SET_FORM_LABELS(opcode, name, form, op, bits) \
+	[FORM_HANDLER(opcode, 0)] = &&op_##name##_register, [FORM_HANDLER(opcode, 1)] = &&op_##name##_memory,
+	static void* const labels[HANDLER_COUNT] = {
+		[0 ... HANDLER_COUNT - 1] = &&not_implemented,
+		INSTRUCTION_TABLE(SET_LABEL)
+		SET_LABEL(PREFIXED, insn->func)
+		GROUP_TABLE(SET_GROUP_LABEL)
+		FORM_TABLE(SET_FORM_LABELS)
+		FUSED_TABLE(SET_LABEL)
+	};
+#undef SET_FORM_LABELS
+#undef SET_GROUP_LABEL
+#undef SET_LABEL
+	DecodedInstruction* insn;
+
+#define DISPATCH() \
+	do { \
+		if (emu->eip == stop_eip) { \
+			emu->insn = NULL; \
+			return 0; \
+		} \
+		if (emu->eip == 0x00) { \
+			goto end_of_program; \
+		} \
+		insn = fetch_decoded(emu); \
+		emu->insn = insn; \
+		goto *labels[insn->handler]; \
+	} while (0)
+
+	DISPATCH();
+
+#define HANDLER(opcode, func) op_##opcode: PROFILE_BEGIN(emu); func(emu); PROFILE_END(); DISPATCH();
+	INSTRUCTION_TABLE(HANDLER)
+	HANDLER(PREFIXED, insn->func)
+#undef HANDLER
+#define GROUP_HANDLER_LABEL(opcode, reg, call) op_group_##opcode##_##reg: \
+	PROFILE_BEGIN(emu); group_##opcode##_##reg(emu); PROFILE_END(); DISPATCH();
+#define FORM_HANDLER_LABELS(opcode, name, form, op, bits) \
+	op_##name##_register: PROFILE_BEGIN(emu); name##_register(emu); PROFILE_END(); DISPATCH(); \
+	op_##name##_memory: PROFILE_BEGIN(emu); name##_memory(emu); PROFILE_END(); DISPATCH();
+	GROUP_TABLE(GROUP_HANDLER_LABEL)
+	FORM_TABLE(FORM_HANDLER_LABELS)
+	/* A pair is run apart when the stop address is its second instruction */
+#define FUSED_HANDLER(handler, func) op_##handler: \
+	if (insn->eip + insn->length == stop_eip) { \
+		goto *labels[insn->opcode]; \
+	} \
+	PROFILE_BEGIN(emu); func(emu); PROFILE_END(); DISPATCH();
+	FUSED_TABLE(FUSED_HANDLER)
+#undef FUSED_HANDLER
+#undef DISPATCH
+
+not_implemented:
+	printf("\n\nNot Implemented: %x\n", insn->opcode);
+	emu->insn = NULL;
+	return -1;
+
+end_of_program:
+	/* EIP - The end of the program Once but becomes 0 */
+	printf("\n\nEnd of program.\n\n");
+	emu->insn = NULL;
+	return -1;
+}
+
+int run_until_return(Emulator* emu, uint32_t return_eip) {
+	/* Same handlers as run_instructions; EIP is only compared after the returns */
+#define SET_LABEL(opcode, func) [opcode] = &&op_##opcode,
+#define SET_GROUP_LABEL(opcode, reg, call) [GROUP_HANDLER(opcode, reg)] = &&op_group_##opcode##_##reg,
+#define SET_FORM_LABELS(opcode, name, form, op, bits) \
+	[FORM_HANDLER(opcode, 0)] = &&op_##name##_register, [FORM_HANDLER(opcode, 1)] = &&op_##name##_memory,
+	static void* const labels[HANDLER_COUNT] = {
+		[0 ... HANDLER_COUNT - 1] = &&not_implemented,
+		INSTRUCTION_TABLE(SET_LABEL)
+		SET_LABEL(PREFIXED, insn->func)
+		GROUP_TABLE(SET_GROUP_LABEL)
+		FORM_TABLE(SET_FORM_LABELS)
+		FUSED_TABLE(SET_LABEL)
+	};
+#undef SET_FORM_LABELS
+#undef SET_GROUP_LABEL
+#undef SET_LABEL
+	DecodedInstruction* insn;
+
+#define DISPATCH() \
+	do { \
+		insn = fetch_decoded(emu); \
+		emu->insn = insn; \
+		goto *labels[insn->handler]; \
+	} while (0)
+
+	DISPATCH();
+
+	/* IS_RETURN is constant for each handler, so the other handlers carry no compare */
+#define IS_RETURN(opcode) ((opcode) == 0xC2 || (opcode) == 0xC3)
+#define HANDLER(opcode, func) op_##opcode: PROFILE_BEGIN(emu); func(emu); PROFILE_END(); \
+	if (IS_RETURN(opcode) && emu->eip == return_eip) { \
+		emu->insn = NULL; \
+		return 0; \
+	} \
+	DISPATCH();
+	INSTRUCTION_TABLE(HANDLER)
+	FUSED_TABLE(HANDLER)
+#undef HANDLER
+	/* None of the group and form handlers returns */
+	GROUP_TABLE(GROUP_HANDLER_LABEL)
+	FORM_TABLE(FORM_HANDLER_LABELS)
+#undef FORM_HANDLER_LABELS
+#undef GROUP_HANDLER_LABEL
+	/* rep ret returns too */
+op_PREFIXED:
+	PROFILE_BEGIN(emu); insn->func(emu); PROFILE_END();
+	if (IS_RETURN(insn->opcode) && emu->eip == return_eip) {
+		emu->insn = NULL;
+		return 0;
 	}
+	DISPATCH();
+#undef IS_RETURN
+#undef DISPATCH
+
+not_implemented:
+	/* Also reached by a jump to address 0, whose empty page decodes as opcode 0 */
+	printf("\n\nNot Implemented: %x\n", insn->opcode);
+	emu->insn = NULL;
+	return -1;
+}
+
+#pragma GCC diagnostic pop
+
+#else
+
+#define SET_FUSED(handler, func) [handler - FUSED_CMP_JCC] = func,
+static instruction_func_t* const fused_instructions[HANDLER_COUNT - FUSED_CMP_JCC] = { FUSED_TABLE(SET_FUSED) };
+#undef SET_FUSED
+
+int run_instructions(Emulator* emu, uint32_t stop_eip) {
+	while (emu->eip != stop_eip) {
+		DecodedInstruction* insn = fetch_decoded(emu);
+
+		if (insn->func == NULL) {
+			printf("\n\nNot Implemented: %x\n", insn->opcode);
+			emu->insn = NULL;
+			return -1;
+		}
 
-	for (i = 0; i < 8; i++) {
-		instructions[0xB8 + i] = mov_r32_imm32;
+		emu->insn = insn;
+		PROFILE_BEGIN(emu);
+		/* A pair is run apart when the stop address is its second instruction */
+		if (insn->handler >= FUSED_CMP_JCC && insn->eip + insn->length != stop_eip) {
+			fused_instructions[insn->handler - FUSED_CMP_JCC](emu);
+		} else {
+			insn->func(emu);
+		}
+		PROFILE_END();
+
+		/* EIP - The end of the program Once but becomes 0 */
+		if (emu->eip == 0x00) {
+			printf("\n\nEnd of program.\n\n");
+			emu->insn = NULL;
+			return -1;
+		}
 	}
 
-	instructions[0xC1] = code_c1;
-	instructions[0xC3] = ret;
-	instructions[0xC7] = mov_rm32_imm32;
-	instructions[0xC9] = leave;
-	instructions[0xCD] = swi;
-	instructions[0xD1] = code_d1;
-	instructions[0xD3] = code_d3;
-
-	instructions[0xE4] = in_al_imm8;
-	instructions[0xE8] = call_rel32;
-	instructions[0xE9] = near_jump_rel32;
-	instructions[0xEB] = short_jump_rel8;
-	instructions[0xEC] = in_al_dx;
-	instructions[0xEE] = out_dx_al;
-
-	instructions[0xF2] = repne_mode;
-	instructions[0xF3] = repe_mode;
-	instructions[0xF7] = code_f7;
-	instructions[0xFF] = code_ff;
+	emu->insn = NULL;
+	return 0;
 }
+
+int run_until_return(Emulator* emu, uint32_t return_eip) {
+	for (;;) {
+		DecodedInstruction* insn = fetch_decoded(emu);
+
+		if (insn->func == NULL) {
+			printf("\n\nNot Implemented: %x\n", insn->opcode);
+			emu->insn = NULL;
+			return -1;
+		}
+
+		emu->insn = insn;
+		PROFILE_BEGIN(emu);
+		if (insn->handler >= FUSED_CMP_JCC) {
+			fused_instructions[insn->handler - FUSED_CMP_JCC](emu);
+		} else {
+			insn->func(emu);
+		}
+		PROFILE_END();
+
+		if ((insn->opcode == 0xC2 || insn->opcode == 0xC3) && emu->eip == return_eip) {
+			emu->insn = NULL;
+			return 0;
+		}
+	}
+}
+
+#endif
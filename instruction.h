@@ -1,10 +1,68 @@
 #ifndef INSTRUCTION_H_
 #define INSTRUCTION_H_
 
+#include <stdint.h>
+
 #include "emulator.h"
 
+/* Dispatch with computed goto (GCC labels as values); -DTHREADED_DISPATCH=0 keeps the function table loop */
+#ifndef THREADED_DISPATCH
+#if defined(__GNUC__)
+#define THREADED_DISPATCH (1)
+#else
+#define THREADED_DISPATCH (0)
+#endif
+#endif
+
 void init_instructions(void);
 typedef void instruction_func_t(Emulator*);
+/* Handler of each opcode in the default mode */
 extern instruction_func_t* instructions[256];
 
+/*
+ * Handler of opcode decoded under the prefix bits in mode: the default one,
+ * or after a prefix the variant for its operand size, which also drops the
+ * prefixes once it ran. NULL when not implemented.
+ */
+instruction_func_t* select_instruction(uint8_t opcode, uint32_t mode);
+
+/* Handler of each implemented sub-opcode of a group opcode, at opcode << 3 | ModRM reg field */
+extern instruction_func_t* group_instructions[256 * 8];
+
+/* Register form (mod 3) and memory form of the r/m, r and r, r/m opcodes that have them, at opcode << 1 | memory */
+extern instruction_func_t* form_instructions[256 * 2];
+
+/* Handlers after the 256 opcodes */
+enum {
+  /* An instruction after a prefix: runs the variant select_instruction picked */
+  PREFIXED = 256,
+  /* A sub-opcode of a group opcode, GROUP_HANDLER(opcode, reg) */
+  GROUP_HANDLERS,
+  /* The register or the memory form of an r/m opcode, FORM_HANDLER(opcode, memory) */
+  FORM_HANDLERS = GROUP_HANDLERS + 256 * 8,
+  /* Pairs of instructions fused at decode time (see decode_cache.h), run as one */
+  /* cmp r32, r/m32 / eax, imm32 / r/m32, imm: then Jcc rel8 */
+  FUSED_CMP_JCC = FORM_HANDLERS + 256 * 2,
+  /* test r/m32, r32; Jcc rel8 */
+  FUSED_TEST_JCC,
+  /* push ebp; mov ebp, esp */
+  FUSED_PUSH_EBP_MOV,
+  HANDLER_COUNT
+};
+
+#define GROUP_HANDLER(opcode, reg) (GROUP_HANDLERS + ((opcode) << 3 | (reg)))
+#define FORM_HANDLER(opcode, memory) (FORM_HANDLERS + ((opcode) << 1 | (memory)))
+
+#ifdef PROFILE
+/* Handler name of each opcode, for the profiler */
+extern const char* instruction_names[256];
+#endif
+
+/* Execute instruction by instruction (fused pairs at once) until EIP reaches stop_eip. Returns 0 on stop, -1 on an unimplemented opcode or EIP 0 */
+int run_instructions(Emulator* emu, uint32_t stop_eip);
+
+/* Execute until a ret lands on return_eip; EIP is not compared after any other instruction.
+   Returns 0 on return, -1 on an unimplemented opcode */
+int run_until_return(Emulator* emu, uint32_t return_eip);
+
 #endif
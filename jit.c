@@ -0,0 +1,830 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "jit.h"
+#include "emulator_function.h"
+
+#if defined(__x86_64__) && !defined(_WIN32)
+
+#include <sys/mman.h>
+
+/*
+ * Blocks are translated one guest instruction at a time. Register forms and
+ * plain memory forms of the common 32-bit instructions are emitted inline with
+ * the guest registers kept in host registers; memory goes through
+ * get_memory32 / set_memory32 and everything else calls its handler.
+ */
+
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+
+/* Host register holding each guest register inside a block (RBX holds emu) */
+static const int host_reg[REGISTERS_COUNT] = { R8, R9, R10, RBP, R12, R13, R14, R15 };
+
+/* Guest registers whose host register does not survive a call */
+#define CALLER_SAVED_GUEST ((1 << EAX) | (1 << ECX) | (1 << EDX))
+#define ALL_GUEST ((1 << REGISTERS_COUNT) - 1)
+
+/* Guest flags each kind of instruction writes */
+#define ARITH_FLAGS (CARRY_FLAG | PARITY_FLAG | AUX_FLAG | ZERO_FLAG | SIGN_FLAG | OVERFLOW_FLAG)
+#define LOGIC_FLAGS ARITH_FLAGS
+#define TEST_FLAGS (CARRY_FLAG | PARITY_FLAG | ZERO_FLAG | SIGN_FLAG | OVERFLOW_FLAG)
+#define SHIFT_FLAGS (CARRY_FLAG | PARITY_FLAG | ZERO_FLAG | SIGN_FLAG)
+#define INC_FLAGS (PARITY_FLAG | AUX_FLAG | ZERO_FLAG | SIGN_FLAG | OVERFLOW_FLAG)
+
+/* Worst case host bytes for one guest instruction, checked before each block */
+#define JIT_MAX_INSN_BYTES (256)
+
+#define EMU_REG(index) (offsetof(Emulator, registers) + (index) * sizeof(uint32_t))
+#define EMU_EFLAGS offsetof(Emulator, eflags)
+#define EMU_EIP offsetof(Emulator, eip)
+#define EMU_INSN offsetof(Emulator, insn)
+
+/* Guest EFLAGS bits for the low byte of host RFLAGS (CF, PF, AF, ZF, SF); constant so threads can share it */
+#define HOST_FLAGS(i) ((((i) & 0x01) ? CARRY_FLAG : 0) | (((i) & 0x04) ? PARITY_FLAG : 0) \
+	| (((i) & 0x10) ? AUX_FLAG : 0) | (((i) & 0x40) ? ZERO_FLAG : 0) | (((i) & 0x80) ? SIGN_FLAG : 0))
+#define HOST_FLAGS4(i) HOST_FLAGS(i), HOST_FLAGS((i) + 1), HOST_FLAGS((i) + 2), HOST_FLAGS((i) + 3)
+#define HOST_FLAGS16(i) HOST_FLAGS4(i), HOST_FLAGS4((i) + 4), HOST_FLAGS4((i) + 8), HOST_FLAGS4((i) + 12)
+#define HOST_FLAGS64(i) HOST_FLAGS16(i), HOST_FLAGS16((i) + 16), HOST_FLAGS16((i) + 32), HOST_FLAGS16((i) + 48)
+static const uint8_t host_flags_table[256] = {
+	HOST_FLAGS64(0), HOST_FLAGS64(64), HOST_FLAGS64(128), HOST_FLAGS64(192)
+};
+
+typedef struct {
+	uint8_t* p;
+	/* Guest registers held in their host register */
+	int loaded;
+	/* ... and changed since they were loaded */
+	int dirty;
+} Jit;
+
+/* Guest memory operand in host registers: [base + index * (1 << scale) + disp] */
+typedef struct {
+	int base;
+	int index;
+	int scale;
+	int32_t disp;
+} Address;
+
+static void emit8(Jit* j, uint8_t value) {
+	*j->p++ = value;
+}
+
+static void emit32(Jit* j, uint32_t value) {
+	memcpy(j->p, &value, 4);
+	j->p += 4;
+}
+
+static void emit64(Jit* j, uint64_t value) {
+	memcpy(j->p, &value, 8);
+	j->p += 8;
+}
+
+static void emit_rex(Jit* j, int w, int reg, int index, int base) {
+	uint8_t rex = 0x40 | (w << 3) | ((reg >> 3) << 2) | ((index >> 3) << 1) | (base >> 3);
+	if (rex != 0x40) {
+		emit8(j, rex);
+	}
+}
+
+/* op r/m32 (register), reg: reg may also be an opcode extension */
+static void emit_rr(Jit* j, uint8_t opcode, int reg, int rm) {
+	emit_rex(j, 0, reg, 0, rm);
+	emit8(j, opcode);
+	emit8(j, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+/* Two byte (0x0F) form of emit_rr */
+static void emit_rr_0f(Jit* j, uint8_t opcode, int reg, int rm) {
+	emit_rex(j, 0, reg, 0, rm);
+	emit8(j, 0x0F);
+	emit8(j, opcode);
+	emit8(j, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+/* op [base + index * scale + disp32], reg; base or index may be -1 */
+static void emit_rm(Jit* j, int w, uint8_t opcode, int reg, int base, int index, int scale, int32_t disp) {
+	emit_rex(j, w, reg, index < 0 ? 0 : index, base < 0 ? 0 : base);
+	emit8(j, opcode);
+	if (base < 0) {
+		emit8(j, ((reg & 7) << 3) | 4);
+		emit8(j, (scale << 6) | ((index < 0 ? 4 : index & 7) << 3) | 5);
+	} else {
+		emit8(j, 0x80 | ((reg & 7) << 3) | 4);
+		emit8(j, (scale << 6) | ((index < 0 ? 4 : index & 7) << 3) | (base & 7));
+	}
+	emit32(j, disp);
+}
+
+/* mov reg32, [rbx + offset] */
+static void emit_load_emu(Jit* j, int reg, size_t offset) {
+	emit_rm(j, 0, 0x8B, reg, RBX, -1, 0, offset);
+}
+
+/* mov [rbx + offset], reg32 */
+static void emit_store_emu(Jit* j, size_t offset, int reg) {
+	emit_rm(j, 0, 0x89, reg, RBX, -1, 0, offset);
+}
+
+/* mov dword [rbx + offset], imm32 */
+static void emit_store_emu_imm(Jit* j, size_t offset, uint32_t value) {
+	emit_rm(j, 0, 0xC7, 0, RBX, -1, 0, offset);
+	emit32(j, value);
+}
+
+/* mov reg32, imm32 */
+static void emit_mov_imm(Jit* j, int reg, uint32_t value) {
+	emit_rex(j, 0, 0, 0, reg);
+	emit8(j, 0xB8 + (reg & 7));
+	emit32(j, value);
+}
+
+/* mov reg64, imm64 */
+static void emit_mov_imm64(Jit* j, int reg, uint64_t value) {
+	emit_rex(j, 1, 0, 0, reg);
+	emit8(j, 0xB8 + (reg & 7));
+	emit64(j, value);
+}
+
+/* 0x81 /n reg32, imm32 */
+static void emit_alu_imm(Jit* j, int n, int reg, uint32_t value) {
+	emit_rr(j, 0x81, n, reg);
+	emit32(j, value);
+}
+
+/* Host register of a guest register, loading it on first use */
+static int use_reg(Jit* j, int guest) {
+	if (!(j->loaded & (1 << guest))) {
+		emit_load_emu(j, host_reg[guest], EMU_REG(guest));
+		j->loaded |= 1 << guest;
+	}
+	return host_reg[guest];
+}
+
+/* Host register of a guest register about to be overwritten */
+static int def_reg(Jit* j, int guest) {
+	j->loaded |= 1 << guest;
+	j->dirty |= 1 << guest;
+	return host_reg[guest];
+}
+
+/* Host register of a guest register about to be read and overwritten */
+static int mod_reg(Jit* j, int guest) {
+	use_reg(j, guest);
+	return def_reg(j, guest);
+}
+
+/* Write the changed guest registers in mask back and forget them */
+static void spill(Jit* j, int mask) {
+	int i;
+
+	for (i = 0; i < REGISTERS_COUNT; i++) {
+		if (j->dirty & mask & (1 << i)) {
+			emit_store_emu(j, EMU_REG(i), host_reg[i]);
+		}
+	}
+	j->dirty &= ~mask;
+	j->loaded &= ~mask;
+}
+
+/* Call a C function with emu as first argument; ESI / EDX must already hold the others */
+static void emit_call(Jit* j, void* func, int clobbers) {
+	spill(j, clobbers);
+	/* mov rdi, rbx */
+	emit8(j, 0x48);
+	emit8(j, 0x89);
+	emit8(j, 0xDF);
+	emit_mov_imm64(j, RAX, (uint64_t)(uintptr_t)func);
+	/* call rax */
+	emit8(j, 0xFF);
+	emit8(j, 0xD0);
+}
+
+/* Merge the host flags of the previous instruction into guest EFLAGS, clearing the zero bits instead (clobbers RAX, RDX, R11) */
+static void emit_capture_flags(Jit* j, uint32_t mask, uint32_t zero) {
+	/* pushfq; pop rax */
+	emit8(j, 0x9C);
+	emit8(j, 0x58);
+	/* movzx edx, al */
+	emit8(j, 0x0F);
+	emit8(j, 0xB6);
+	emit8(j, 0xD0);
+	emit_mov_imm64(j, R11, (uint64_t)(uintptr_t)host_flags_table);
+	/* movzx edx, byte [r11 + rdx] */
+	emit8(j, 0x41);
+	emit8(j, 0x0F);
+	emit8(j, 0xB6);
+	emit8(j, 0x14);
+	emit8(j, 0x13);
+	/* shr eax, 3: host OF (bit 11) to OVERFLOW_FLAG (bit 8) */
+	emit8(j, 0xC1);
+	emit8(j, 0xE8);
+	emit8(j, 0x03);
+	emit_alu_imm(j, 4, RAX, OVERFLOW_FLAG);
+	emit_rr(j, 0x09, RDX, RAX);
+	emit_alu_imm(j, 4, RAX, mask & ~zero);
+	emit_load_emu(j, RDX, EMU_EFLAGS);
+	emit_alu_imm(j, 4, RDX, ~mask);
+	emit_rr(j, 0x09, RAX, RDX);
+	emit_store_emu(j, EMU_EFLAGS, RDX);
+}
+
+/* Guest memory operand of modrm */
+static void guest_address(const ModRM* modrm, Address* address) {
+	address->base = -1;
+	address->index = -1;
+	address->scale = 0;
+	address->disp = 0;
+
+	if (modrm->mod == 1) {
+		address->disp = modrm->disp8;
+	} else if (modrm->mod == 2) {
+		address->disp = modrm->disp32;
+	}
+
+	if (modrm->rm == 4) {
+		uint8_t base = modrm->sib & 0x07;
+		uint8_t index = (modrm->sib >> 3) & 0x07;
+
+		/* Base 5 is no base under mod 0, with a disp32 instead, and EBP otherwise */
+		if (base == 5 && modrm->mod == 0) {
+			address->disp = modrm->disp32;
+		} else {
+			address->base = base;
+		}
+		if (index != 4) {
+			address->index = index;
+			address->scale = (modrm->sib >> 6) & 0x03;
+		}
+	} else if (modrm->mod == 0 && modrm->rm == 5) {
+		address->disp = modrm->disp32;
+	} else {
+		address->base = modrm->rm;
+	}
+}
+
+/* lea esi, [guest address] */
+static void emit_address(Jit* j, const ModRM* modrm) {
+	Address a;
+	int base, index;
+
+	guest_address(modrm, &a);
+	base = a.base < 0 ? -1 : use_reg(j, a.base);
+	index = a.index < 0 ? -1 : use_reg(j, a.index);
+	emit_rm(j, 0, 0x8D, RSI, base, index, a.scale, a.disp);
+}
+
+/* eax = [guest address of modrm] */
+static void emit_read_rm(Jit* j, const ModRM* modrm) {
+	emit_address(j, modrm);
+	emit_call(j, get_memory32, CALLER_SAVED_GUEST);
+}
+
+/* [guest address of modrm] = ecx */
+static void emit_write_rm(Jit* j, const ModRM* modrm) {
+	emit_address(j, modrm);
+	emit_rr(j, 0x89, RCX, RDX);
+	emit_call(j, set_memory32, CALLER_SAVED_GUEST);
+}
+
+/* push ecx on the guest stack */
+static void emit_push(Jit* j) {
+	int esp = mod_reg(j, ESP);
+	emit_alu_imm(j, 5, esp, 4);
+	emit_rr(j, 0x89, esp, RSI);
+	emit_rr(j, 0x89, RCX, RDX);
+	emit_call(j, set_memory32, CALLER_SAVED_GUEST);
+}
+
+/* eax = pop from the guest stack */
+static void emit_pop(Jit* j) {
+	emit_rr(j, 0x89, use_reg(j, ESP), RSI);
+	emit_call(j, get_memory32, CALLER_SAVED_GUEST);
+	emit_alu_imm(j, 0, mod_reg(j, ESP), 4);
+}
+
+/* Flags read by the Jcc handlers */
+static uint32_t jcc_reads(uint8_t opcode) {
+	switch (opcode) {
+		case 0x70: case 0x71: return OVERFLOW_FLAG;
+		case 0x72: case 0x73: return CARRY_FLAG;
+		case 0x74: case 0x75: return ZERO_FLAG;
+		case 0x78: case 0x79: return SIGN_FLAG;
+		case 0x7C: return SIGN_FLAG | OVERFLOW_FLAG;
+		case 0x7E: case 0x7F: return ZERO_FLAG | SIGN_FLAG | OVERFLOW_FLAG;
+		default: return 0;
+	}
+}
+
+/* Whether insn is translated inline, and the guest flags it writes and reads */
+static int classify(const DecodedInstruction* insn, uint32_t* writes, uint32_t* reads) {
+	const ModRM* modrm = &insn->modrm;
+	uint8_t n = modrm->opcode;
+
+	*writes = 0;
+	*reads = 0;
+
+	switch (insn->opcode) {
+		case 0x01: case 0x03: case 0x05:
+		case 0x29: case 0x2B: case 0x2D:
+		case 0x3B: case 0x3D:
+			*writes = ARITH_FLAGS;
+			return 1;
+		case 0x09: case 0x0B: case 0x0D:
+		case 0x21: case 0x23: case 0x25:
+		case 0x31: case 0x33: case 0x35:
+			*writes = LOGIC_FLAGS;
+			return 1;
+		case 0x85:
+			*writes = TEST_FLAGS;
+			return 1;
+		case 0x81: case 0x83:
+			if (n == 2 || n == 3) {
+				return 0;
+			}
+			*writes = (n == 1 || n == 4 || n == 6) ? LOGIC_FLAGS : ARITH_FLAGS;
+			return 1;
+		case 0xC1:
+			/* rcl / rcr read CF; a count of 0 leaves the flags, which capturing them would not */
+			if (n == 2 || n == 3 || (insn->imm & 31) == 0) {
+				return 0;
+			}
+			*writes = n == 0 || n == 1 ? CARRY_FLAG : SHIFT_FLAGS;
+			/* OF only for a count of 1 */
+			if ((insn->imm & 31) == 1) {
+				*writes |= OVERFLOW_FLAG;
+			}
+			return 1;
+		case 0xF7:
+			if (n == 0) {
+				*writes = TEST_FLAGS;
+			} else if (n == 3) {
+				*writes = ARITH_FLAGS;
+			} else if (n != 2) {
+				return 0;
+			}
+			return 1;
+		case 0xFF:
+			if (n == 0 || n == 1) {
+				*writes = INC_FLAGS;
+			} else if (n != 2 && n != 6) {
+				return 0;
+			}
+			return 1;
+		case 0x40: case 0x41: case 0x42: case 0x43:
+		case 0x44: case 0x45: case 0x46: case 0x47:
+			*writes = INC_FLAGS;
+			return 1;
+		case 0x8D:
+			return modrm->mod != 3;
+		case 0x89: case 0x8B: case 0xC7:
+			return 1;
+		case 0x50: case 0x51: case 0x52: case 0x53:
+		case 0x54: case 0x55: case 0x56: case 0x57:
+		case 0x58: case 0x59: case 0x5A: case 0x5B:
+		case 0x5C: case 0x5D: case 0x5E: case 0x5F:
+		case 0xB8: case 0xB9: case 0xBA: case 0xBB:
+		case 0xBC: case 0xBD: case 0xBE: case 0xBF:
+		case 0x68: case 0x90: case 0xC3: case 0xC9:
+		case 0xE8: case 0xE9: case 0xEB:
+			return 1;
+		default:
+			*reads = jcc_reads(insn->opcode);
+			return *reads != 0;
+	}
+}
+
+/* Flags the handlers of ALU instruction n clear where the hardware leaves them undefined */
+static uint32_t alu_zero_flags(int n) {
+	return (n == 1 || n == 4 || n == 6) ? AUX_FLAG : 0;
+}
+
+/* ALU instruction n (0x81 /n numbering) on ecx / a register with a register or an immediate */
+static void emit_alu(Jit* j, int n, int dst, int src, int is_imm, uint32_t imm) {
+	if (is_imm) {
+		emit_alu_imm(j, n, dst, imm);
+	} else {
+		emit_rr(j, (n << 3) | 0x01, src, dst);
+	}
+}
+
+/* Guest ALU op rm32 (register or memory) with a register or immediate source */
+static void emit_alu_rm(Jit* j, const ModRM* modrm, int n, int src_guest, int is_imm, uint32_t imm, uint32_t capture) {
+	int src;
+
+	if (modrm->mod == 3) {
+		int dst = n == 7 ? use_reg(j, modrm->rm) : mod_reg(j, modrm->rm);
+		src = is_imm ? 0 : use_reg(j, src_guest);
+		emit_alu(j, n, dst, src, is_imm, imm);
+		if (capture) {
+			emit_capture_flags(j, capture, alu_zero_flags(n));
+		}
+		return;
+	}
+
+	emit_read_rm(j, modrm);
+	emit_rr(j, 0x89, RAX, RCX);
+	src = is_imm ? 0 : use_reg(j, src_guest);
+	emit_alu(j, n, RCX, src, is_imm, imm);
+	if (capture) {
+		emit_capture_flags(j, capture, alu_zero_flags(n));
+	}
+	if (n != 7) {
+		emit_write_rm(j, modrm);
+	}
+}
+
+/* Guest ALU op r32, rm32 */
+static void emit_op_r_rm(Jit* j, const ModRM* modrm, int n, uint32_t capture) {
+	int src, dst;
+
+	if (modrm->mod == 3) {
+		src = use_reg(j, modrm->rm);
+	} else {
+		emit_read_rm(j, modrm);
+		src = RAX;
+	}
+
+	dst = n == 7 ? use_reg(j, modrm->reg_index) : mod_reg(j, modrm->reg_index);
+	emit_rr(j, (n << 3) | 0x03, dst, src);
+	if (capture) {
+		emit_capture_flags(j, capture, alu_zero_flags(n));
+	}
+}
+
+/* Guest op /ext on rm32 (opcode 0xF7, 0xFF or 0xC1), written back unless only flags are wanted */
+static void emit_unary_rm(Jit* j, const ModRM* modrm, uint8_t opcode, int ext, int has_imm8, uint8_t imm8, int writes_back, uint32_t capture) {
+	int reg;
+
+	if (modrm->mod == 3) {
+		reg = writes_back ? mod_reg(j, modrm->rm) : use_reg(j, modrm->rm);
+	} else {
+		emit_read_rm(j, modrm);
+		emit_rr(j, 0x89, RAX, RCX);
+		reg = RCX;
+	}
+
+	emit_rr(j, opcode, ext, reg);
+	if (has_imm8) {
+		emit8(j, imm8);
+	}
+	if (capture) {
+		emit_capture_flags(j, capture, 0);
+	}
+	if (modrm->mod != 3 && writes_back) {
+		emit_write_rm(j, modrm);
+	}
+}
+
+/* ecx = value of rm32 */
+static void emit_get_rm(Jit* j, const ModRM* modrm) {
+	if (modrm->mod == 3) {
+		emit_rr(j, 0x89, use_reg(j, modrm->rm), RCX);
+	} else {
+		emit_read_rm(j, modrm);
+		emit_rr(j, 0x89, RAX, RCX);
+	}
+}
+
+/* Set guest EIP to ecx when the condition of Jcc opcode holds, else to eax */
+static void emit_jcc(Jit* j, uint8_t opcode) {
+	/* Condition bit into bit 0 of edx */
+	emit_load_emu(j, RDX, EMU_EFLAGS);
+	switch (opcode & 0xFE) {
+		case 0x70:
+			emit8(j, 0xC1); emit8(j, 0xEA); emit8(j, 8);   /* shr edx, 8 */
+			break;
+		case 0x72:
+			break;
+		case 0x74:
+			emit8(j, 0xC1); emit8(j, 0xEA); emit8(j, 3);   /* shr edx, 3 */
+			break;
+		case 0x78:
+			emit8(j, 0xC1); emit8(j, 0xEA); emit8(j, 4);   /* shr edx, 4 */
+			break;
+		case 0x7C:
+		case 0x7E:
+			/* SF != OF, or with ZF for jle / jg */
+			emit_rr(j, 0x89, RDX, RSI);
+			emit8(j, 0xC1); emit8(j, 0xEE); emit8(j, 4);   /* shr esi, 4 */
+			emit_rr(j, 0x89, RDX, RDI);
+			emit8(j, 0xC1); emit8(j, 0xEF); emit8(j, 8);   /* shr edi, 8 */
+			emit_rr(j, 0x31, RDI, RSI);
+			if ((opcode & 0xFE) == 0x7E) {
+				emit8(j, 0xC1); emit8(j, 0xEA); emit8(j, 3);   /* shr edx, 3 */
+				emit_rr(j, 0x09, RDX, RSI);
+			}
+			emit_rr(j, 0x89, RSI, RDX);
+			break;
+	}
+	/* test edx, 1 */
+	emit8(j, 0xF7); emit8(j, 0xC2); emit32(j, 1);
+
+	/* The odd opcode of each pair jumps when the condition does not hold */
+	if (!(opcode & 1)) {
+		emit_rr_0f(j, 0x45, RAX, RCX);   /* cmovnz eax, ecx */
+	} else {
+		emit_rr_0f(j, 0x44, RAX, RCX);   /* cmovz eax, ecx */
+	}
+	emit_store_emu(j, EMU_EIP, RAX);
+}
+
+/* Translate one instruction inline; returns 1 when the guest EIP has been set */
+static int emit_insn(Jit* j, const DecodedInstruction* insn, uint32_t capture) {
+	const ModRM* modrm = &insn->modrm;
+	uint32_t next = insn->eip + insn->length;
+	uint8_t op = insn->opcode;
+	uint8_t n = modrm->opcode;
+
+	switch (op) {
+		case 0x01: case 0x09: case 0x21: case 0x29: case 0x31:
+			emit_alu_rm(j, modrm, op >> 3, modrm->reg_index, 0, 0, capture);
+			return 0;
+		case 0x03: case 0x0B: case 0x23: case 0x2B: case 0x33: case 0x3B:
+			emit_op_r_rm(j, modrm, op >> 3, capture);
+			return 0;
+		case 0x05: case 0x0D: case 0x25: case 0x2D: case 0x35: case 0x3D: {
+			int eax = (op >> 3) == 7 ? use_reg(j, EAX) : mod_reg(j, EAX);
+			emit_alu_imm(j, op >> 3, eax, insn->imm);
+			if (capture) {
+				emit_capture_flags(j, capture, alu_zero_flags(op >> 3));
+			}
+			return 0;
+		}
+		case 0x85:
+			emit_get_rm(j, modrm);
+			emit_rr(j, 0x85, use_reg(j, modrm->reg_index), RCX);
+			if (capture) {
+				emit_capture_flags(j, capture, 0);
+			}
+			return 0;
+		case 0x40: case 0x41: case 0x42: case 0x43:
+		case 0x44: case 0x45: case 0x46: case 0x47:
+			emit_rr(j, 0xFF, 0, mod_reg(j, op - 0x40));
+			if (capture) {
+				emit_capture_flags(j, capture, 0);
+			}
+			return 0;
+		case 0x50: case 0x51: case 0x52: case 0x53:
+		case 0x54: case 0x55: case 0x56: case 0x57:
+			emit_rr(j, 0x89, use_reg(j, op - 0x50), RCX);
+			emit_push(j);
+			return 0;
+		case 0x58: case 0x59: case 0x5A: case 0x5B:
+		case 0x5C: case 0x5D: case 0x5E: case 0x5F:
+			emit_pop(j);
+			emit_rr(j, 0x89, RAX, def_reg(j, op - 0x58));
+			return 0;
+		case 0x68:
+			emit_mov_imm(j, RCX, insn->imm);
+			emit_push(j);
+			return 0;
+		case 0x81:
+			emit_alu_rm(j, modrm, n, 0, 1, insn->imm, capture);
+			return 0;
+		case 0x83:
+			emit_alu_rm(j, modrm, n, 0, 1, (uint32_t)(int32_t)(int8_t)insn->imm, capture);
+			return 0;
+		case 0x89:
+			if (modrm->mod == 3) {
+				emit_rr(j, 0x89, use_reg(j, modrm->reg_index), def_reg(j, modrm->rm));
+			} else {
+				emit_address(j, modrm);
+				emit_rr(j, 0x89, use_reg(j, modrm->reg_index), RDX);
+				emit_call(j, set_memory32, CALLER_SAVED_GUEST);
+			}
+			return 0;
+		case 0x8B:
+			if (modrm->mod == 3) {
+				emit_rr(j, 0x89, use_reg(j, modrm->rm), def_reg(j, modrm->reg_index));
+			} else {
+				emit_read_rm(j, modrm);
+				emit_rr(j, 0x89, RAX, def_reg(j, modrm->reg_index));
+			}
+			return 0;
+		case 0x8D: {
+			Address a;
+			int base, index;
+			guest_address(modrm, &a);
+			base = a.base < 0 ? -1 : use_reg(j, a.base);
+			index = a.index < 0 ? -1 : use_reg(j, a.index);
+			emit_rm(j, 0, 0x8D, def_reg(j, modrm->reg_index), base, index, a.scale, a.disp);
+			return 0;
+		}
+		case 0x90:
+			return 0;
+		case 0xB8: case 0xB9: case 0xBA: case 0xBB:
+		case 0xBC: case 0xBD: case 0xBE: case 0xBF:
+			emit_mov_imm(j, def_reg(j, op - 0xB8), insn->imm);
+			return 0;
+		case 0xC1:
+			/* sal is shl */
+			emit_unary_rm(j, modrm, 0xC1, n == 6 ? 4 : n, 1, insn->imm & 31, 1, capture);
+			return 0;
+		case 0xC3:
+			emit_pop(j);
+			emit_store_emu(j, EMU_EIP, RAX);
+			return 1;
+		case 0xC7:
+			if (modrm->mod == 3) {
+				emit_mov_imm(j, def_reg(j, modrm->rm), insn->imm);
+			} else {
+				emit_mov_imm(j, RCX, insn->imm);
+				emit_write_rm(j, modrm);
+			}
+			return 0;
+		case 0xC9:
+			emit_rr(j, 0x89, use_reg(j, EBP), def_reg(j, ESP));
+			emit_pop(j);
+			emit_rr(j, 0x89, RAX, def_reg(j, EBP));
+			return 0;
+		case 0xE8:
+			emit_mov_imm(j, RCX, next);
+			emit_push(j);
+			emit_store_emu_imm(j, EMU_EIP, next + insn->imm);
+			return 1;
+		case 0xE9:
+			emit_store_emu_imm(j, EMU_EIP, next + insn->imm);
+			return 1;
+		case 0xEB:
+			emit_store_emu_imm(j, EMU_EIP, next + (int8_t)insn->imm);
+			return 1;
+		case 0xF7:
+			if (n == 0) {
+				emit_get_rm(j, modrm);
+				/* test ecx, imm32 */
+				emit8(j, 0xF7);
+				emit8(j, 0xC1);
+				emit32(j, insn->imm);
+				if (capture) {
+					emit_capture_flags(j, capture, 0);
+				}
+			} else {
+				emit_unary_rm(j, modrm, 0xF7, n, 0, 0, 1, capture);
+			}
+			return 0;
+		case 0xFF:
+			if (n == 0 || n == 1) {
+				emit_unary_rm(j, modrm, 0xFF, n, 0, 0, 1, capture);
+				return 0;
+			}
+			emit_get_rm(j, modrm);
+			if (n == 2) {
+				/* call_rm32 pushes the address after the ModRM */
+				emit_store_emu(j, EMU_EIP, RCX);
+				emit_mov_imm(j, RCX, next);
+				emit_push(j);
+				return 1;
+			}
+			emit_push(j);
+			return 0;
+		default:
+			/* Jcc */
+			emit_mov_imm(j, RCX, next + (int8_t)insn->imm);
+			emit_mov_imm(j, RAX, next);
+			emit_jcc(j, op);
+			return 1;
+	}
+}
+
+/* Call the handler of insn, with every guest register in emu */
+static void emit_fallback(Jit* j, const DecodedInstruction* insn) {
+	spill(j, ALL_GUEST);
+	emit_store_emu_imm(j, EMU_EIP, insn->eip);
+	emit_mov_imm64(j, RAX, (uint64_t)(uintptr_t)insn);
+	emit_rm(j, 1, 0x89, RAX, RBX, -1, 0, EMU_INSN);
+	emit_call(j, insn->func, ALL_GUEST);
+	/* Translated code reads and merges EFLAGS directly */
+	emit_call(j, flush_lazy_flags, 0);
+}
+
+int jit_supported(void) {
+	return 1;
+}
+
+jit_func_t* jit_translate(BlockCache* cache, Block* block) {
+	uint32_t writes[BLOCK_MAX_INSNS];
+	uint32_t reads[BLOCK_MAX_INSNS];
+	uint32_t capture[BLOCK_MAX_INSNS];
+	int native[BLOCK_MAX_INSNS];
+	uint32_t live = ARITH_FLAGS;
+	uint8_t* start;
+	int eip_set = 0;
+	Jit j;
+	int i;
+
+	if (block->mode != DEFAULT_MODE) {
+		return NULL;
+	}
+
+	if (cache->jit_code == NULL) {
+		void* code = mmap(NULL, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (code == MAP_FAILED) {
+			cache->jit_enabled = 0;
+			return NULL;
+		}
+		cache->jit_code = code;
+		cache->jit_used = 0;
+	}
+
+	if (jit_buffer_full(cache, block)) {
+		return NULL;
+	}
+
+	/* Flags only need to reach EFLAGS when something may read them before they are overwritten */
+	for (i = block->count - 1; i >= 0; i--) {
+		native[i] = classify(&block->insns[i], &writes[i], &reads[i]);
+		if (!native[i]) {
+			/* Handlers may read any flag */
+			capture[i] = 0;
+			live = ARITH_FLAGS;
+		} else {
+			capture[i] = writes[i] & live;
+			live = (live & ~writes[i]) | reads[i];
+		}
+	}
+
+	start = cache->jit_code + cache->jit_used;
+	j.p = start;
+	j.loaded = 0;
+	j.dirty = 0;
+
+	/* push rbx, rbp, r12 - r15; sub rsp, 8 */
+	emit8(&j, 0x53);
+	emit8(&j, 0x55);
+	emit8(&j, 0x41); emit8(&j, 0x54);
+	emit8(&j, 0x41); emit8(&j, 0x55);
+	emit8(&j, 0x41); emit8(&j, 0x56);
+	emit8(&j, 0x41); emit8(&j, 0x57);
+	emit8(&j, 0x48); emit8(&j, 0x83); emit8(&j, 0xEC); emit8(&j, 0x08);
+	/* mov rbx, rdi */
+	emit8(&j, 0x48); emit8(&j, 0x89); emit8(&j, 0xFB);
+	emit_call(&j, flush_lazy_flags, 0);
+
+	for (i = 0; i < block->count; i++) {
+		if (native[i]) {
+			eip_set = emit_insn(&j, &block->insns[i], capture[i]);
+		} else {
+			emit_fallback(&j, &block->insns[i]);
+			eip_set = 1;
+		}
+	}
+
+	spill(&j, ALL_GUEST);
+	if (!eip_set) {
+		emit_store_emu_imm(&j, EMU_EIP, block->end_eip);
+	}
+
+	/* add rsp, 8; pop r15 - r12, rbp, rbx; ret */
+	emit8(&j, 0x48); emit8(&j, 0x83); emit8(&j, 0xC4); emit8(&j, 0x08);
+	emit8(&j, 0x41); emit8(&j, 0x5F);
+	emit8(&j, 0x41); emit8(&j, 0x5E);
+	emit8(&j, 0x41); emit8(&j, 0x5D);
+	emit8(&j, 0x41); emit8(&j, 0x5C);
+	emit8(&j, 0x5D);
+	emit8(&j, 0x5B);
+	emit8(&j, 0xC3);
+
+	cache->jit_used += j.p - start;
+	return (jit_func_t*)start;
+}
+
+int jit_buffer_full(BlockCache* cache, Block* block) {
+	return cache->jit_used + (block->count + 2) * JIT_MAX_INSN_BYTES > JIT_BUFFER_SIZE;
+}
+
+void jit_reset(BlockCache* cache) {
+	cache->jit_used = 0;
+}
+
+void jit_release(BlockCache* cache) {
+	if (cache->jit_code != NULL) {
+		munmap(cache->jit_code, JIT_BUFFER_SIZE);
+		cache->jit_code = NULL;
+	}
+}
+
+#else
+
+int jit_supported(void) {
+	return 0;
+}
+
+jit_func_t* jit_translate(BlockCache* cache, Block* block) {
+	return NULL;
+}
+
+int jit_buffer_full(BlockCache* cache, Block* block) {
+	return 0;
+}
+
+void jit_reset(BlockCache* cache) {
+}
+
+void jit_release(BlockCache* cache) {
+}
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef JIT_H_
+#define JIT_H_
+
+#include <stdint.h>
+
+#include "emulator.h"
+#include "block_cache.h"
+
+/* Times a block is interpreted before it is translated */
+#ifndef JIT_THRESHOLD
+#define JIT_THRESHOLD (16)
+#endif
+
+/* Host code buffer of one block cache */
+#ifndef JIT_BUFFER_SIZE
+#define JIT_BUFFER_SIZE (4 * 1024 * 1024)
+#endif
+
+/* Translated code of a block; runs it and leaves EIP at the next block */
+typedef void jit_func_t(Emulator* emu);
+
+/* Whether this host can run translated code */
+int jit_supported(void);
+
+/* Translate a default mode block into host code. Returns NULL when the buffer is full or the host is not x86-64 */
+jit_func_t* jit_translate(BlockCache* cache, Block* block);
+
+/* Whether the host code buffer has no room left for block */
+int jit_buffer_full(BlockCache* cache, Block* block);
+
+/* Forget every translation (the blocks they belong to are being dropped) */
+void jit_reset(BlockCache* cache);
+
+/* Release the host code buffer */
+void jit_release(BlockCache* cache);
+
+#endif
@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "libx86emu.h"
+#include "emulator_function.h"
+#include "instruction.h"
+#include "decode_cache.h"
+#include "guest_memory.h"
+
+/* instructions[] is shared by every emulator and filled once */
+static pthread_once_t instructions_once = PTHREAD_ONCE_INIT;
+
+Emulator* emu_create(void) {
+	pthread_once(&instructions_once, init_instructions);
+	return create_emu();
+}
+
+void emu_destroy(Emulator* emu) {
+	destroy_emu(emu);
+}
+
+long emu_load(Emulator* emu, const char* filename, uint32_t address) {
+	return load_file(emu, filename, address);
+}
+
+int emu_set_reg(Emulator* emu, int reg, uint32_t value) {
+	if (reg >= 0 && reg < REGISTERS_COUNT) {
+		emu->registers[reg] = value;
+	} else if (reg == EMU_REG_EIP) {
+		emu->eip = value;
+	} else if (reg == EMU_REG_EFLAGS) {
+		emu->eflags = value;
+		emu->lazy_op = LAZY_NONE;
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+uint32_t emu_get_reg(Emulator* emu, int reg) {
+	if (reg >= 0 && reg < REGISTERS_COUNT) {
+		return emu->registers[reg];
+	} else if (reg == EMU_REG_EIP) {
+		return emu->eip;
+	} else if (reg == EMU_REG_EFLAGS) {
+		flush_lazy_flags(emu);
+		return emu->eflags;
+	}
+	return 0;
+}
+
+void emu_write(Emulator* emu, uint32_t address, const void* data, size_t size) {
+	write_memory(emu, address, data, size);
+}
+
+void emu_read(Emulator* emu, uint32_t address, void* data, size_t size) {
+	read_memory(emu, address, data, size);
+}
+
+int emu_run_until(Emulator* emu, uint32_t stop_eip, uint64_t max_insns) {
+	uint64_t executed;
+
+	if (max_insns == 0) {
+		return run_instructions(emu, stop_eip) == 0 ? EMU_STOPPED : EMU_FAULT;
+	}
+
+	for (executed = 0; emu->eip != stop_eip; executed++) {
+		DecodedInstruction* insn;
+
+		if (executed == max_insns) {
+			return EMU_LIMIT;
+		}
+
+		insn = fetch_decoded(emu);
+		if (insn->func == NULL) {
+			emu->insn = NULL;
+			return EMU_FAULT;
+		}
+		emu->insn = insn;
+		insn->func(emu);
+		emu->insn = NULL;
+
+		if (emu->eip == 0x00) {
+			return EMU_FAULT;
+		}
+	}
+
+	return EMU_STOPPED;
+}
+
+int emu_call(Emulator* emu, uint32_t entry, const uint32_t* args, int nargs, int conv) {
+	uint32_t esp = emu->registers[ESP];
+	int first = 0, i;
+
+	if (nargs < 0 || (conv == EMU_THISCALL && nargs < 1)) {
+		return EMU_FAULT;
+	}
+
+	if (conv == EMU_THISCALL) {
+		emu->registers[ECX] = args[0];
+		first = 1;
+	}
+
+	/* Right to left, then the return address the ret lands on */
+	for (i = nargs - 1; i >= first; i--) {
+		push32(emu, args[i]);
+	}
+	push32(emu, EMU_CALL_SENTINEL);
+	emu->eip = entry;
+
+	if (run_until_return(emu, EMU_CALL_SENTINEL) != 0) {
+		return EMU_FAULT;
+	}
+
+	/* The callee removed its arguments unless cdecl; put ESP back either way */
+	emu->registers[ESP] = esp;
+	return EMU_STOPPED;
+}
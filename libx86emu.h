@@ -0,0 +1,62 @@
+#ifndef LIBX86EMU_H_
+#define LIBX86EMU_H_
+
+/*
+ * Embedding API of the emulator (libx86emu.a / libx86emu.so).
+ * Every emulator is independent: threads may each create and run their own
+ * at the same time. One emulator must not be used by two threads at once.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "emulator.h"
+
+/* Registers of emu_set_reg / emu_get_reg besides EAX ... EDI of enum Register */
+#define EMU_REG_EIP (REGISTERS_COUNT)
+#define EMU_REG_EFLAGS (REGISTERS_COUNT + 1)
+
+/* Results of emu_run_until */
+/* EIP reached the stop address */
+#define EMU_STOPPED (0)
+/* max_insns instructions ran without reaching it */
+#define EMU_LIMIT (1)
+/* An unimplemented instruction, or a jump to address 0 */
+#define EMU_FAULT (-1)
+
+/* Calling conventions of emu_call */
+/* Arguments on the stack, removed by the caller */
+#define EMU_CDECL (0)
+/* Arguments on the stack, removed by the callee */
+#define EMU_STDCALL (1)
+/* args[0] in ECX, the rest as stdcall */
+#define EMU_THISCALL (2)
+
+/* Return address emu_call pushes; nothing is ever executed there */
+#define EMU_CALL_SENTINEL (0xFFFFF000)
+
+/* To create an emulator with empty memory, 32-bit code and all registers 0 */
+Emulator* emu_create(void);
+/* Discard the emulator */
+void emu_destroy(Emulator* emu);
+
+/* Load a file to memory at address, mapped rather than copied where it can be (see load_file). Returns its size, or -1 if it can not be opened */
+long emu_load(Emulator* emu, const char* filename, uint32_t address);
+
+/* Set / get a register (EAX ... EDI, EMU_REG_EIP or EMU_REG_EFLAGS). emu_set_reg returns -1 for an unknown register */
+int emu_set_reg(Emulator* emu, int reg, uint32_t value);
+uint32_t emu_get_reg(Emulator* emu, int reg);
+
+/* Copy size bytes to / from guest memory at address */
+void emu_write(Emulator* emu, uint32_t address, const void* data, size_t size);
+void emu_read(Emulator* emu, uint32_t address, void* data, size_t size);
+
+/* Run until EIP is stop_eip, at most max_insns instructions (0 for no limit). Returns EMU_STOPPED, EMU_LIMIT or EMU_FAULT */
+int emu_run_until(Emulator* emu, uint32_t stop_eip, uint64_t max_insns);
+
+/* Call the guest function at entry with nargs arguments on the current stack (ESP must be set up).
+   Returns EMU_STOPPED once it has returned, with its result in EAX and ESP as before the call,
+   or EMU_FAULT. The emulator can make any number of calls */
+int emu_call(Emulator* emu, uint32_t entry, const uint32_t* args, int nargs, int conv);
+
+#endif
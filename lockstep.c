@@ -0,0 +1,856 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "lockstep.h"
+#include "emulator_function.h"
+#include "instruction.h"
+#include "decode_cache.h"
+#include "guest_memory.h"
+
+/* Modes the vector handlers are written for; under prefixes the scalar handlers run */
+#define LOCKSTEP_MODE (PREFIX_OPSIZE_MODE_32_BIT | PREFIX_ADDRESS_MODE_32_BIT)
+
+/* The vector handlers are built for AVX-512, AVX2 and plain x86-64, and the loader picks one */
+#if defined(__GNUC__) && defined(__x86_64__) && defined(__linux__)
+#define LOCKSTEP_TARGETS __attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define LOCKSTEP_TARGETS
+#endif
+
+/* Helpers are inlined into each of those builds, so no vector crosses a call (build with -Wno-psabi) */
+#define LANE_INLINE static inline __attribute__((always_inline))
+
+/* Two 32-bit values multiplied in 64 bits */
+typedef uint64_t WideVector __attribute__((vector_size(8 * LOCKSTEP_LANES)));
+
+/* Signed lanes, for sar */
+typedef int32_t SignedLaneVector __attribute__((vector_size(4 * LOCKSTEP_LANES)));
+
+#define LANE_ACTIVE(ls, lane) (((ls)->active >> (lane)) & 1)
+
+/* window_page while no stack page is held */
+#define NO_WINDOW (0xFFFFFFFF)
+
+LANE_INLINE LaneVector splat(uint32_t value) {
+	LaneVector zero = { 0 };
+	return zero + value;
+}
+
+/* All bits set in the running lanes, 0 in the others */
+LANE_INLINE LaneVector active_lanes(Lockstep* ls) {
+	LaneVector index = { 0 };
+	int lane;
+
+	for (lane = 0; lane < LOCKSTEP_LANES; lane++) {
+		index[lane] = lane;
+	}
+	return (LaneVector)(((splat(ls->active) >> index) & 1) != 0);
+}
+
+/* Whether any lane of value is not 0 */
+LANE_INLINE int any_lane(LaneVector value) {
+	uint32_t any = 0;
+	int lane;
+
+	for (lane = 0; lane < LOCKSTEP_LANES; lane++) {
+		any |= value[lane];
+	}
+	return any != 0;
+}
+
+/* Whether every running lane holds the same value */
+LANE_INLINE int same_lanes(Lockstep* ls, LaneVector value) {
+	return !any_lane((LaneVector)(value != splat(value[__builtin_ctz(ls->active)])) & active_lanes(ls));
+}
+
+/* 1 in each lane where value is not 0 */
+LANE_INLINE LaneVector nonzero(LaneVector value) {
+	return (LaneVector)(value != 0) & 1;
+}
+
+/* 1 in each lane whose low byte has an even number of bits set (PARITY) */
+LANE_INLINE LaneVector even_parity(LaneVector value) {
+	LaneVector x = value & 0xFF;
+	x ^= x >> 4;
+	x ^= x >> 2;
+	x ^= x >> 1;
+	return ~x & 1;
+}
+
+/* Fold the pending operation into eflags of every lane, as flush_lazy_flags */
+LANE_INLINE void flush_lanes(Lockstep* ls) {
+	uint32_t mask = lazy_flags_mask(ls->lazy_op);
+	uint32_t sign_bit = 1u << (ls->lazy_bits - 1);
+	LaneVector v1 = ls->lazy_dst, v2 = ls->lazy_src, res = ls->lazy_res;
+	LaneVector chain = { 0 };
+	LaneVector flags;
+
+	if (mask == 0) {
+		ls->lazy_op = LAZY_NONE;
+		return;
+	}
+
+	switch (ls->lazy_op) {
+		case LAZY_ADD:
+		case LAZY_INC:
+			chain = (v1 & v2) | (~res & (v1 | v2));
+			break;
+		case LAZY_SUB:
+		case LAZY_DEC:
+			chain = (res & (~v1 | v2)) | (~v1 & v2);
+			break;
+	}
+
+	flags = nonzero(chain & sign_bit) * CARRY_FLAG
+		| even_parity(res) * PARITY_FLAG
+		| ((chain >> 3) & 1) * AUX_FLAG
+		| (1 - nonzero(res & (sign_bit | (sign_bit - 1)))) * ZERO_FLAG
+		| nonzero(res & sign_bit) * SIGN_FLAG
+		| (((chain >> (ls->lazy_bits - 2)) ^ (chain >> (ls->lazy_bits - 1))) & 1) * OVERFLOW_FLAG;
+
+	ls->eflags = (ls->eflags & ~mask) | (flags & mask);
+	ls->lazy_op = LAZY_NONE;
+}
+
+/* Record a 32-bit flag setting operation, as set_lazy_flags */
+LANE_INLINE void set_lanes_lazy(Lockstep* ls, uint32_t op, LaneVector v1, LaneVector v2, LaneVector res) {
+	if (lazy_flags_mask(ls->lazy_op) & ~lazy_flags_mask(op)) {
+		flush_lanes(ls);
+	}
+
+	ls->lazy_op = op;
+	ls->lazy_bits = 32;
+	ls->lazy_dst = v1;
+	ls->lazy_src = v2;
+	ls->lazy_res = res;
+
+#if !LAZY_FLAGS
+	flush_lanes(ls);
+#endif
+}
+
+/* Set flag where value is not 0 and clear it elsewhere, as set_carry, set_overflow, ... */
+LANE_INLINE void set_lanes_flag(Lockstep* ls, uint32_t flag, LaneVector value) {
+	if (ls->lazy_op != LAZY_NONE) {
+		flush_lanes(ls);
+	}
+	ls->eflags = (ls->eflags & ~flag) | nonzero(value) * flag;
+}
+
+/* Merge flags into eflags lane by lane where mask is set, as merge_flags */
+LANE_INLINE void merge_lanes_flags(Lockstep* ls, LaneVector mask, LaneVector flags) {
+	if (ls->lazy_op != LAZY_NONE) {
+		flush_lanes(ls);
+	}
+	ls->eflags = (ls->eflags & ~mask) | (flags & mask);
+}
+
+/* calc_memory_address for every lane */
+LANE_INLINE LaneVector lane_address(Lockstep* ls, const ModRM* modrm) {
+	LaneVector address = { 0 };
+
+	if (modrm->rm == 4) {
+		uint8_t scale = (modrm->sib >> 6) & 0x03;
+		uint8_t base = modrm->sib & 0x07;
+		uint8_t index = (modrm->sib >> 3) & 0x07;
+
+		/* Base 5 is no base under mod 0, with a disp32 instead, and EBP otherwise */
+		if (base == 5 && modrm->mod == 0) {
+			address = splat(modrm->disp32);
+		} else {
+			address = ls->registers[base];
+		}
+		if (index != 4) {
+			address += ls->registers[index] << scale;
+		}
+	} else if (modrm->mod == 0 && modrm->rm == 5) {
+		return splat(modrm->disp32);
+	} else {
+		address = ls->registers[modrm->rm];
+	}
+
+	if (modrm->mod == 1) {
+		address += (uint32_t)(int32_t)modrm->disp8;
+	} else if (modrm->mod == 2) {
+		address += modrm->disp32;
+	}
+	return address;
+}
+
+/* Whether the memory operand of modrm is addressed from ESP or EBP */
+LANE_INLINE int stack_operand(const ModRM* modrm) {
+	uint8_t base = modrm->rm == 4 ? modrm->sib & 0x07 : modrm->rm;
+
+	return (base == ESP || base == EBP) && !(modrm->mod == 0 && base == 5);
+}
+
+/*
+ * Hold the page of the 4 bytes at address in the stack window, when they lie
+ * in one page, the same for every running lane, that is not the code being
+ * run: its decoded instructions are dropped through the emulator on a write.
+ * Returns 0 when each lane has to go through its emulator instead.
+ */
+LANE_INLINE int in_window(Lockstep* ls, LaneVector address) {
+	uint32_t page = address[__builtin_ctz(ls->active)] >> GUEST_PAGE_SHIFT;
+	LaneVector outside = (LaneVector)((address >> GUEST_PAGE_SHIFT) != splat(page))
+		| (LaneVector)(GUEST_PAGE_OFFSET(address) > splat(GUEST_PAGE_SIZE - 4));
+	int lane;
+
+	if (any_lane(outside & active_lanes(ls))) {
+		return 0;
+	}
+	if (page != ls->window_page) {
+		if (page == ls->eip >> GUEST_PAGE_SHIFT || page == (ls->eip + 15) >> GUEST_PAGE_SHIFT) {
+			return 0;
+		}
+		for (lane = 0; lane < LOCKSTEP_LANES; lane++) {
+			ls->window[lane] = get_writable_page(ls->lanes[lane], page << GUEST_PAGE_SHIFT);
+		}
+		ls->window_page = page;
+	}
+	return 1;
+}
+
+/* get_memory32 for every lane; stack tells that address is ESP or EBP based, which may take the stack window */
+LANE_INLINE LaneVector load_lanes(Lockstep* ls, LaneVector address, int stack) {
+	LaneVector value = { 0 };
+	LaneVector offset;
+	int lane;
+
+	if (stack && in_window(ls, address)) {
+		/* Lanes not running load from the start of their page, so there is no branch */
+		offset = GUEST_PAGE_OFFSET(address) & active_lanes(ls);
+		for (lane = 0; lane < LOCKSTEP_LANES; lane++) {
+			value[lane] = load_le32(ls->window[lane] + offset[lane]);
+		}
+		return value;
+	}
+
+	for (lane = 0; lane < LOCKSTEP_LANES; lane++) {
+		if (LANE_ACTIVE(ls, lane)) {
+			value[lane] = get_memory32(ls->lanes[lane], address[lane]);
+		}
+	}
+	return value;
+}
+
+/* set_memory32 for every running lane, as load_lanes */
+LANE_INLINE void store_lanes(Lockstep* ls, LaneVector address, LaneVector value, int stack) {
+	int lane;
+
+	if (stack && in_window(ls, address)) {
+		for (lane = 0; lane < LOCKSTEP_LANES; lane++) {
+			if (LANE_ACTIVE(ls, lane)) {
+				store_le32(ls->window[lane] + GUEST_PAGE_OFFSET(address[lane]), value[lane]);
+			}
+		}
+		return;
+	}
+
+	for (lane = 0; lane < LOCKSTEP_LANES; lane++) {
+		if (LANE_ACTIVE(ls, lane)) {
+			set_memory32(ls->lanes[lane], address[lane], value[lane]);
+		}
+	}
+}
+
+/* get_rm32 for every lane: a register, or a load from each lane's memory */
+LANE_INLINE LaneVector read_rm32(Lockstep* ls, const ModRM* modrm) {
+	if (modrm->mod == 3) {
+		return ls->registers[modrm->rm];
+	}
+	return load_lanes(ls, lane_address(ls, modrm), stack_operand(modrm));
+}
+
+/* set_rm32 for every lane */
+LANE_INLINE void write_rm32(Lockstep* ls, const ModRM* modrm, LaneVector value) {
+	if (modrm->mod == 3) {
+		ls->registers[modrm->rm] = value;
+		return;
+	}
+	store_lanes(ls, lane_address(ls, modrm), value, stack_operand(modrm));
+}
+
+/* add / or / and / sub / xor / cmp by the 3-bit operation number of the opcode or ModRM; callers leave out adc / sbb */
+LANE_INLINE LaneVector alu_lanes(Lockstep* ls, int n, LaneVector dst, LaneVector src) {
+	LaneVector res;
+
+	switch (n) {
+		case 0:
+			res = dst + src;
+			set_lanes_lazy(ls, LAZY_ADD, dst, src, res);
+			return res;
+		case 5:
+		case 7:
+			res = dst - src;
+			set_lanes_lazy(ls, LAZY_SUB, dst, src, res);
+			return res;
+		case 1:
+			res = dst | src;
+			break;
+		case 4:
+			res = dst & src;
+			break;
+		default:
+			res = dst ^ src;
+			break;
+	}
+	set_lanes_lazy(ls, LAZY_LOGIC, splat(0), splat(0), res);
+	return res;
+}
+
+/* imul: low half of the product, CF and OF set when the unsigned high half is not 0 */
+LANE_INLINE LaneVector imul_lanes(Lockstep* ls, LaneVector a, LaneVector b) {
+	WideVector product = __builtin_convertvector(a, WideVector) * __builtin_convertvector(b, WideVector);
+	LaneVector high = __builtin_convertvector(product >> 32, LaneVector);
+
+	set_lanes_flag(ls, CARRY_FLAG, high);
+	set_lanes_flag(ls, OVERFLOW_FLAG, high);
+	return __builtin_convertvector(product, LaneVector);
+}
+
+/*
+ * Shift or rotate r/m32 by op (ModRM reg field, not rcl / rcr) with each
+ * lane's own count, masked to 5 bits, as shift_rm32. Lanes with a count of
+ * 0 keep their flags, and their operand is written back unchanged.
+ */
+LANE_INLINE void shift_lanes(Lockstep* ls, const ModRM* modrm, int op, LaneVector count) {
+	LaneVector dst = read_rm32(ls, modrm);
+	LaneVector back = (32 - count) & 31;
+	LaneVector before = (count - 1) & 31;
+	LaneVector res, cf, of, mask;
+
+	switch (op) {
+		case 0:
+			res = dst << count | dst >> back;
+			cf = res & 1;
+			of = cf ^ (res >> 31);
+			break;
+		case 1:
+			res = dst >> count | dst << back;
+			cf = res >> 31;
+			of = cf ^ ((res >> 30) & 1);
+			break;
+		case 5:
+			res = dst >> count;
+			cf = (dst >> before) & 1;
+			of = dst >> 31;
+			break;
+		case 7:
+			res = (LaneVector)((SignedLaneVector)dst >> (SignedLaneVector)count);
+			cf = (dst >> before) & 1;
+			of = splat(0);
+			break;
+		default: /* shl, sal */
+			res = dst << count;
+			cf = (dst >> back) & 1;
+			of = cf ^ (res >> 31);
+			break;
+	}
+	write_rm32(ls, modrm, res);
+
+	mask = ((LaneVector)(count != 0) & (CARRY_FLAG | (op >= 4 ? SIGN_FLAG | ZERO_FLAG | PARITY_FLAG : 0)))
+		| ((LaneVector)(count == 1) & OVERFLOW_FLAG);
+	merge_lanes_flags(ls, mask, cf * CARRY_FLAG | of * OVERFLOW_FLAG
+		| even_parity(res) * PARITY_FLAG
+		| (1 - nonzero(res)) * ZERO_FLAG
+		| (res >> 31) * SIGN_FLAG);
+}
+
+/*
+ * 1 in each lane where condition cc (low nibble of a Jcc opcode) holds, as
+ * the Jcc handlers. The pending operation is folded first, which only
+ * changes how the flags are kept.
+ */
+LANE_INLINE LaneVector condition_lanes(Lockstep* ls, int cc) {
+	LaneVector flags, less, res;
+
+	flush_lanes(ls);
+	flags = ls->eflags;
+	less = nonzero(flags & SIGN_FLAG) ^ nonzero(flags & OVERFLOW_FLAG);
+
+	switch (cc >> 1) {
+		case 0: res = nonzero(flags & OVERFLOW_FLAG); break;
+		case 1: res = nonzero(flags & CARRY_FLAG); break;
+		case 2: res = nonzero(flags & ZERO_FLAG); break;
+		case 3: res = nonzero(flags & (CARRY_FLAG | ZERO_FLAG)); break;
+		case 4: res = nonzero(flags & SIGN_FLAG); break;
+		case 5: res = nonzero(flags & PARITY_FLAG); break;
+		case 6: res = less; break;
+		default: res = less | nonzero(flags & ZERO_FLAG); break;
+	}
+	return cc & 1 ? res ^ 1 : res;
+}
+
+/* Jumps, calls and returns: run when the target is the same in every running lane. Returns 0, changing nothing, otherwise */
+LANE_INLINE int step_transfer(Lockstep* ls, const DecodedInstruction* insn) {
+	const ModRM* modrm = &insn->modrm;
+	LaneVector* registers = ls->registers;
+	LaneVector dst;
+
+	switch (insn->opcode) {
+		/* ret, when every lane returns to the same address */
+		case 0xC3:
+			dst = load_lanes(ls, registers[ESP], 1);
+			if (!same_lanes(ls, dst)) {
+				return 0;
+			}
+			registers[ESP] += 4;
+			ls->eip = dst[__builtin_ctz(ls->active)];
+			return 1;
+		case 0xE8:
+			registers[ESP] -= 4;
+			store_lanes(ls, registers[ESP], splat(ls->eip + 5), 1);
+			ls->eip += 5 + insn->imm;
+			return 1;
+		case 0xE9:
+			ls->eip += 5 + insn->imm;
+			return 1;
+		case 0xEB:
+			ls->eip += 2 + (int32_t)(int8_t)insn->imm;
+			return 1;
+		/* call_rm32, when every lane calls the same address */
+		case 0xFF:
+			if (modrm->opcode != 2) {
+				return 0;
+			}
+			dst = read_rm32(ls, modrm);
+			if (!same_lanes(ls, dst)) {
+				return 0;
+			}
+			registers[ESP] -= 4;
+			store_lanes(ls, registers[ESP], splat(ls->eip + insn->length), 1);
+			ls->eip = dst[__builtin_ctz(ls->active)];
+			return 1;
+	}
+	return 0;
+}
+
+/* Run insn on every running lane with vector operations. Returns 0, changing nothing, when it has no vector version */
+static LOCKSTEP_TARGETS int step_vector(Lockstep* ls, const DecodedInstruction* insn) {
+	const ModRM* modrm = &insn->modrm;
+	LaneVector* registers = ls->registers;
+	LaneVector dst, src, res;
+
+	if (ls->prefix_mode != LOCKSTEP_MODE) {
+		return 0;
+	}
+
+	switch (insn->opcode) {
+		/* op rm32, r32 */
+		case 0x01: case 0x09: case 0x21: case 0x29: case 0x31:
+			dst = read_rm32(ls, modrm);
+			write_rm32(ls, modrm, alu_lanes(ls, insn->opcode >> 3, dst, registers[modrm->reg_index]));
+			break;
+		/* op r32, rm32 */
+		case 0x03: case 0x0B: case 0x23: case 0x2B: case 0x33: case 0x3B:
+			src = read_rm32(ls, modrm);
+			res = alu_lanes(ls, insn->opcode >> 3, registers[modrm->reg_index], src);
+			if (insn->opcode != 0x3B) {
+				registers[modrm->reg_index] = res;
+			}
+			break;
+		/* op eax, imm32 */
+		case 0x05: case 0x0D: case 0x25: case 0x2D: case 0x35: case 0x3D:
+			res = alu_lanes(ls, insn->opcode >> 3, registers[EAX], splat(insn->imm));
+			if (insn->opcode != 0x3D) {
+				registers[EAX] = res;
+			}
+			break;
+		/* op rm32, imm32 / imm8 */
+		case 0x81: case 0x83:
+			if (modrm->opcode == 2 || modrm->opcode == 3) {
+				return 0;
+			}
+			dst = read_rm32(ls, modrm);
+			src = splat(insn->opcode == 0x83 ? (uint32_t)(int32_t)(int8_t)insn->imm : insn->imm);
+			res = alu_lanes(ls, modrm->opcode, dst, src);
+			if (modrm->opcode != 7) {
+				write_rm32(ls, modrm, res);
+			}
+			break;
+		case 0x85:
+			res = read_rm32(ls, modrm) & registers[modrm->reg_index];
+			set_lanes_lazy(ls, LAZY_TEST, splat(0), splat(0), res);
+			break;
+		case 0x0F:
+			/* 0F AF is the only two byte opcode decoded with a ModRM */
+			if (insn->modrm_offset == 0) {
+				return 0;
+			}
+			src = read_rm32(ls, modrm);
+			registers[modrm->reg_index] = imul_lanes(ls, registers[modrm->reg_index], src);
+			break;
+		case 0x69:
+			/* imul_r32_rm32_imm32 only implements the register form */
+			if (modrm->mod != 3) {
+				return 0;
+			}
+			registers[modrm->reg_index] = imul_lanes(ls, registers[modrm->rm], splat(insn->imm));
+			break;
+		case 0x40: case 0x41: case 0x42: case 0x43:
+		case 0x44: case 0x45: case 0x46: case 0x47:
+			dst = registers[insn->opcode - 0x40];
+			res = dst + 1;
+			registers[insn->opcode - 0x40] = res;
+			set_lanes_lazy(ls, LAZY_INC, dst, splat(1), res);
+			break;
+		case 0x50: case 0x51: case 0x52: case 0x53:
+		case 0x54: case 0x55: case 0x56: case 0x57:
+			src = registers[insn->opcode - 0x50];
+			registers[ESP] -= 4;
+			store_lanes(ls, registers[ESP], src, 1);
+			break;
+		case 0x58: case 0x59: case 0x5A: case 0x5B:
+		case 0x5C: case 0x5D: case 0x5E: case 0x5F:
+			res = load_lanes(ls, registers[ESP], 1);
+			registers[ESP] += 4;
+			registers[insn->opcode - 0x58] = res;
+			break;
+		/* Jcc: the lanes must all go the same way, else each takes its own in the scalar handler */
+		case 0x70: case 0x71: case 0x72: case 0x73:
+		case 0x74: case 0x75: case 0x76: case 0x77:
+		case 0x78: case 0x79: case 0x7A: case 0x7B:
+		case 0x7C: case 0x7D: case 0x7E: case 0x7F:
+			res = condition_lanes(ls, insn->opcode & 0x0F);
+			if (!same_lanes(ls, res)) {
+				return 0;
+			}
+			if (res[__builtin_ctz(ls->active)]) {
+				if (ls->waiting != 0) {
+					return 0;
+				}
+				ls->eip += (int32_t)(int8_t)insn->imm;
+			}
+			break;
+		case 0x89:
+			write_rm32(ls, modrm, registers[modrm->reg_index]);
+			break;
+		case 0x8B:
+			registers[modrm->reg_index] = read_rm32(ls, modrm);
+			break;
+		case 0x8D:
+			/* calc_memory_address gives up on a register operand */
+			if (modrm->mod == 3) {
+				return 0;
+			}
+			registers[modrm->reg_index] = lane_address(ls, modrm);
+			break;
+		case 0xB8: case 0xB9: case 0xBA: case 0xBB:
+		case 0xBC: case 0xBD: case 0xBE: case 0xBF:
+			registers[insn->opcode - 0xB8] = splat(insn->imm);
+			break;
+		case 0xC7:
+			write_rm32(ls, modrm, splat(insn->imm));
+			break;
+		/* While lanes wait, step_scalar schedules again at each jump */
+		case 0xC3: case 0xE8: case 0xE9: case 0xEB: case 0xFF:
+			if (ls->waiting != 0) {
+				return 0;
+			}
+			return step_transfer(ls, insn);
+		/* Shifts and rotates, but rcl / rcr */
+		case 0xC1: case 0xD1: case 0xD3:
+			if (modrm->opcode == 2 || modrm->opcode == 3) {
+				return 0;
+			}
+			shift_lanes(ls, modrm, modrm->opcode,
+				insn->opcode == 0xC1 ? splat(insn->imm & 31) : insn->opcode == 0xD1 ? splat(1) : registers[ECX] & 31);
+			break;
+		case 0xF7:
+			/* not_rm32 */
+			if (modrm->opcode != 2) {
+				return 0;
+			}
+			write_rm32(ls, modrm, ~read_rm32(ls, modrm));
+			break;
+		default:
+			return 0;
+	}
+
+	ls->eip += insn->length;
+	return 1;
+}
+
+/* Copy the state of lane out to its emulator */
+static void lane_out(Lockstep* ls, int lane) {
+	Emulator* emu = ls->lanes[lane];
+	int i;
+
+	for (i = 0; i < REGISTERS_COUNT; i++) {
+		emu->registers[i] = ls->registers[i][lane];
+	}
+	emu->eflags = ls->eflags[lane];
+	emu->lazy_op = ls->lazy_op;
+	emu->lazy_bits = ls->lazy_bits;
+	emu->lazy_dst = ls->lazy_dst[lane];
+	emu->lazy_src = ls->lazy_src[lane];
+	emu->lazy_res = ls->lazy_res[lane];
+	emu->prefix_mode = ls->prefix_mode;
+	emu->eip = ls->eip;
+}
+
+/* Copy the per lane state of lane in from its emulator */
+static void lane_in(Lockstep* ls, int lane) {
+	Emulator* emu = ls->lanes[lane];
+	int i;
+
+	for (i = 0; i < REGISTERS_COUNT; i++) {
+		ls->registers[i][lane] = emu->registers[i];
+	}
+	ls->eflags[lane] = emu->eflags;
+	ls->lazy_dst[lane] = emu->lazy_dst;
+	ls->lazy_src[lane] = emu->lazy_src;
+	ls->lazy_res[lane] = emu->lazy_res;
+}
+
+/* Next address ahead of the running lanes where a waiting lane can join them */
+static void find_merge_eip(Lockstep* ls) {
+	int lane;
+
+	ls->merge_eip = 0;
+	for (lane = 0; lane < LOCKSTEP_LANES; lane++) {
+		if ((ls->waiting >> lane) & 1) {
+			uint32_t eip = ls->lanes[lane]->eip;
+
+			if (eip > ls->eip && (ls->merge_eip == 0 || eip < ls->merge_eip)) {
+				ls->merge_eip = eip;
+			}
+		}
+	}
+}
+
+/* Add the waiting lanes stopped at the running lanes' EIP and mode to them */
+static void merge_lanes(Lockstep* ls) {
+	int lane;
+
+	for (lane = 0; lane < LOCKSTEP_LANES; lane++) {
+		Emulator* emu = ls->lanes[lane];
+
+		if (((ls->waiting >> lane) & 1) && emu->eip == ls->eip && emu->prefix_mode == ls->prefix_mode) {
+			/* Their pending operations differ, so fold them all */
+			flush_lanes(ls);
+			flush_lazy_flags(emu);
+			lane_in(ls, lane);
+			ls->waiting &= ~(1u << lane);
+			ls->active |= 1u << lane;
+		}
+	}
+	find_merge_eip(ls);
+}
+
+/*
+ * Pick the lanes to run next from the waiting ones, whose state is in their
+ * emulators: the deepest in the stack (lowest ESP), then the lowest EIP. The
+ * others fall behind until it catches up with them, so lanes that took
+ * different sides of a branch meet again where the paths join.
+ */
+static void schedule_lanes(Lockstep* ls, uint32_t stop_eip) {
+	Emulator* leader = NULL;
+	int lane, mixed_flags = 0;
+
+	ls->active = 0;
+	for (lane = 0; lane < LOCKSTEP_LANES; lane++) {
+		Emulator* emu = ls->lanes[lane];
+
+		if (!((ls->waiting >> lane) & 1)) {
+			continue;
+		}
+		if (emu->eip == stop_eip) {
+			ls->waiting &= ~(1u << lane);
+		} else if (leader == NULL || emu->registers[ESP] < leader->registers[ESP]
+				|| (emu->registers[ESP] == leader->registers[ESP] && emu->eip < leader->eip)) {
+			leader = emu;
+		}
+	}
+	if (leader == NULL) {
+		return;
+	}
+
+	for (lane = 0; lane < LOCKSTEP_LANES; lane++) {
+		Emulator* emu = ls->lanes[lane];
+
+		if (((ls->waiting >> lane) & 1) && emu->eip == leader->eip && emu->prefix_mode == leader->prefix_mode) {
+			ls->waiting &= ~(1u << lane);
+			ls->active |= 1u << lane;
+			if (emu->lazy_op != leader->lazy_op || emu->lazy_bits != leader->lazy_bits) {
+				mixed_flags = 1;
+			}
+		}
+	}
+
+	/* Handlers setting flags depending on the data leave lanes with different pending operations */
+	for (lane = 0; lane < LOCKSTEP_LANES; lane++) {
+		if (LANE_ACTIVE(ls, lane)) {
+			if (mixed_flags) {
+				flush_lazy_flags(ls->lanes[lane]);
+			}
+			lane_in(ls, lane);
+		}
+	}
+
+	ls->lazy_op = leader->lazy_op;
+	ls->lazy_bits = leader->lazy_bits;
+	ls->prefix_mode = leader->prefix_mode;
+	ls->eip = leader->eip;
+	find_merge_eip(ls);
+}
+
+/* Run the scalar handler of insn on each running lane; when they end up apart or others wait, schedule again */
+static void step_scalar(Lockstep* ls, DecodedInstruction* insn, uint32_t stop_eip) {
+	Emulator* first = ls->lanes[__builtin_ctz(ls->active)];
+	int lane, apart = 0, mixed_flags = 0;
+
+	for (lane = 0; lane < LOCKSTEP_LANES; lane++) {
+		if (LANE_ACTIVE(ls, lane)) {
+			Emulator* emu = ls->lanes[lane];
+
+			lane_out(ls, lane);
+			emu->insn = insn;
+			insn->func(emu);
+			emu->insn = NULL;
+
+			if (emu->eip != first->eip || emu->prefix_mode != first->prefix_mode) {
+				apart = 1;
+			} else if (emu->lazy_op != first->lazy_op || emu->lazy_bits != first->lazy_bits) {
+				mixed_flags = 1;
+			}
+		}
+	}
+
+	/* Lanes going different ways, or a jump while others wait: let the schedule choose */
+	if (apart || (ls->waiting != 0 && first->eip != ls->eip + insn->length)) {
+		ls->waiting |= ls->active;
+		schedule_lanes(ls, stop_eip);
+		return;
+	}
+
+	for (lane = 0; lane < LOCKSTEP_LANES; lane++) {
+		if (LANE_ACTIVE(ls, lane)) {
+			if (mixed_flags) {
+				flush_lazy_flags(ls->lanes[lane]);
+			}
+			lane_in(ls, lane);
+		}
+	}
+
+	ls->lazy_op = first->lazy_op;
+	ls->lazy_bits = first->lazy_bits;
+	ls->prefix_mode = first->prefix_mode;
+	ls->eip = first->eip;
+}
+
+/* Stop running the running lanes: their state goes back to their emulators with status result */
+static void retire_lanes(Lockstep* ls, int result, int* status) {
+	int lane;
+
+	for (lane = 0; lane < LOCKSTEP_LANES; lane++) {
+		if (LANE_ACTIVE(ls, lane)) {
+			lane_out(ls, lane);
+			status[lane] = result;
+		}
+	}
+	ls->active = 0;
+}
+
+Lockstep* create_lockstep(Snapshot* snapshot) {
+	/* Room to align the vectors on 64 bytes */
+	void* allocation = malloc(sizeof(Lockstep) + 63);
+	Lockstep* ls;
+	int lane;
+
+	if (allocation == NULL) {
+		return NULL;
+	}
+	ls = (Lockstep*)(((uintptr_t)allocation + 63) & ~(uintptr_t)63);
+	memset(ls, 0, sizeof(Lockstep));
+	ls->allocation = allocation;
+
+	for (lane = 0; lane < LOCKSTEP_LANES; lane++) {
+		ls->lanes[lane] = create_emu_from_snapshot(snapshot);
+		if (ls->lanes[lane] == NULL) {
+			destroy_lockstep(ls);
+			return NULL;
+		}
+	}
+
+	/* The lanes run the same code, so they share the decoded instructions of lane 0 */
+	for (lane = 1; lane < LOCKSTEP_LANES; lane++) {
+		destroy_decode_cache(ls->lanes[lane]->decode_cache);
+		ls->lanes[lane]->decode_cache = ls->lanes[0]->decode_cache;
+	}
+	return ls;
+}
+
+void destroy_lockstep(Lockstep* ls) {
+	int lane;
+
+	/* Lane 0 owns the shared decode cache, so it goes last */
+	for (lane = LOCKSTEP_LANES - 1; lane >= 0; lane--) {
+		if (ls->lanes[lane] != NULL) {
+			if (lane != 0 && ls->lanes[lane]->decode_cache == ls->lanes[0]->decode_cache) {
+				ls->lanes[lane]->decode_cache = NULL;
+			}
+			destroy_emu(ls->lanes[lane]);
+		}
+	}
+	free(ls->allocation);
+}
+
+void run_lockstep(Lockstep* ls, int count, uint32_t stop_eip, int* status) {
+	int lane;
+
+	for (lane = 0; lane < count; lane++) {
+		status[lane] = 0;
+	}
+	ls->waiting = count < 32 ? (1u << count) - 1 : 0xFFFFFFFF;
+	/* restore_snapshot may have freed the pages of the last run */
+	ls->window_page = NO_WINDOW;
+	schedule_lanes(ls, stop_eip);
+
+	while (ls->active != 0) {
+		Emulator* decoder;
+		DecodedInstruction* insn;
+
+		if (ls->eip == stop_eip) {
+			retire_lanes(ls, 0, status);
+			schedule_lanes(ls, stop_eip);
+			continue;
+		}
+
+		/* EIP - The end of the program Once but becomes 0 */
+		if (ls->eip == 0x00) {
+			printf("\n\nEnd of program.\n\n");
+			retire_lanes(ls, -1, status);
+			schedule_lanes(ls, stop_eip);
+			continue;
+		}
+
+		if (ls->eip == ls->merge_eip) {
+			merge_lanes(ls);
+		}
+
+		/* Decoding marks the page as code; writes to it must go through the emulators from then on */
+		if (ls->window_page == ls->eip >> GUEST_PAGE_SHIFT || ls->window_page == (ls->eip + 15) >> GUEST_PAGE_SHIFT) {
+			ls->window_page = NO_WINDOW;
+		}
+
+		/* Every lane runs the same code, so the first running lane decodes it */
+		decoder = ls->lanes[__builtin_ctz(ls->active)];
+		decoder->eip = ls->eip;
+		decoder->prefix_mode = ls->prefix_mode;
+		insn = fetch_decoded(decoder);
+		if (insn->func == NULL) {
+			printf("\n\nNot Implemented: %x\n", insn->opcode);
+			retire_lanes(ls, -1, status);
+			schedule_lanes(ls, stop_eip);
+			continue;
+		}
+
+		if (!step_vector(ls, insn)) {
+			step_scalar(ls, insn, stop_eip);
+		}
+	}
+}
@@ -0,0 +1,74 @@
+#ifndef LOCKSTEP_H_
+#define LOCKSTEP_H_
+
+#include <stdint.h>
+
+#include "emulator.h"
+#include "snapshot.h"
+
+/*
+ * Lockstep execution: LOCKSTEP_LANES guest contexts at the same EIP run one
+ * instruction at a time together. Registers and flags are kept structure of
+ * arrays, one vector per register, and the hot ALU, shift, mov and lea
+ * handlers have vector versions (AVX2 / AVX-512 where the host has them),
+ * as do jumps, calls and returns every lane takes to the same address.
+ * Every other instruction runs its scalar handler on each lane. Lanes that
+ * go different ways at a branch wait for each other: the deepest in the
+ * stack, then the lowest EIP, runs first, and the others join it when it
+ * reaches their EIP. The guest code must be the same in every lane, and the
+ * lanes share one decode cache.
+ *
+ * This is not a throughput mode for the Continuum keygen: its keys pick
+ * different case bodies through indirect calls, so on average only about 2
+ * of 8 lanes run together, and a sweep (-l) does about 6.4k keys/sec on one
+ * thread against 13.6k for block mode (-b). Use -b or -x for speed.
+ */
+
+/* Contexts run together; 16 fills an AVX-512 register */
+#ifndef LOCKSTEP_LANES
+#define LOCKSTEP_LANES (8)
+#endif
+
+/* One 32-bit value per lane (GCC vector extension) */
+typedef uint32_t LaneVector __attribute__((vector_size(4 * LOCKSTEP_LANES)));
+
+typedef struct Lockstep {
+  /* Per lane state of the running lanes */
+  LaneVector registers[REGISTERS_COUNT];
+  LaneVector eflags;
+  LaneVector lazy_dst;
+  LaneVector lazy_src;
+  LaneVector lazy_res;
+  /* State every running lane shares */
+  uint32_t lazy_op;
+  uint32_t lazy_bits;
+  uint32_t prefix_mode;
+  uint32_t eip;
+  /* Lanes running together, one bit per lane */
+  uint32_t active;
+  /* Lanes stopped elsewhere until the running ones reach them; their state is in their emulators */
+  uint32_t waiting;
+  /* Nearest EIP ahead of the running lanes where a waiting lane is, 0 for none */
+  uint32_t merge_eip;
+  /* Emulator of each lane: its memory, and its whole state outside run_lockstep */
+  Emulator* lanes[LOCKSTEP_LANES];
+  /* Stack page every lane last used, and each lane's writable copy of it, for direct loads and stores */
+  uint32_t window_page;
+  uint8_t* window[LOCKSTEP_LANES];
+  /* Block the vectors are aligned in */
+  void* allocation;
+} Lockstep;
+
+/* To create LOCKSTEP_LANES emulators sharing the pages of snapshot. Returns NULL when one can not be made */
+Lockstep* create_lockstep(Snapshot* snapshot);
+/* Discard the lockstep group and its emulators */
+void destroy_lockstep(Lockstep* ls);
+
+/*
+ * Run lanes 0 .. count - 1 from the state of their emulators until each
+ * reaches stop_eip. status[i] is 0, or -1 when lane i reached an
+ * unimplemented opcode or EIP 0; the emulators hold the final state.
+ */
+void run_lockstep(Lockstep* ls, int count, uint32_t stop_eip, int* status);
+
+#endif
@@ -6,40 +6,18 @@
 #include "emulator.h"
 #include "emulator_function.h"
 #include "instruction.h"
+#include "decode_cache.h"
+#include "block_cache.h"
+#include "continuum.h"
+#include "snapshot.h"
+#include "sweep.h"
+#include "trace.h"
+#include "profile.h"
 
 char* registers_name[] = {
 	"EAX", "ECX", "EDX", "EBX", "ESP", "EBP", "ESI", "EDI"
 };
 
-/* Emulator To 512 bytes copy the contents of the binary file to the memory */
-static void read_binary(Emulator* emu, const char* filename) {
-	FILE* binary;
-
-	binary = fopen(filename, "rb");
-
-	if (binary == NULL) {
-		printf("%s file can not be opened\n", filename);
-		system("pause");
-	}
-
-	fseek(binary,0,SEEK_END);
-	long code_size = ftell(binary);
-	long current_offset = PROGRAM_ORIGIN;
-	code_size += PROGRAM_ORIGIN;
-	rewind(binary); //start from beginning
-
-	long temp_current_offset;
-	int i = 0;
-	unsigned char buffer[0x200];
-
-	while (current_offset < code_size) {
-		/* Read the machine language file (up to 512 Bytes) at a time */
-		current_offset += fread(emu->memory + current_offset, 1, 0x200, binary);
-	}
-
-	fclose(binary);
-}
-
 /* It outputs the value of the general-purpose registers and a program counter to the standard output */
 static void dump_registers(Emulator* emu) {
 	int i;
@@ -70,27 +48,24 @@ static void dump_stack(Emulator* emu) {
 		printf("%x: %08x\n", sp, get_memory32(emu, sp));
 }
 
-/* To create an emulator */
-Emulator* create_emu(size_t size) {
-	Emulator* emu = malloc(sizeof(Emulator));
-	emu->memory = malloc(size);
+/* Snapshot files -i can chain, each incremental on the one before */
+#define MAX_IMAGES (8)
 
-	emu->eflags = 0;
-	emu->prefix_mode = 0;
-
-	//if current segment is CS (CODE) default modes are 32 bit.
-	emu->prefix_mode |= PREFIX_OPSIZE_MODE_32_BIT | PREFIX_ADDRESS_MODE_32_BIT;
-
-	/* All the initial value of the general-purpose register to 0 */
-	memset(emu->registers, 0, sizeof(emu->registers));
-
-	return emu;
-}
+/* Load the chain of snapshot files. Returns how many, or -1 when one can not be loaded */
+static int load_images(const char** files, int count, Snapshot** images) {
+	int i;
 
-/* Discard the emulator */
-void destroy_emu(Emulator* emu) {
-	free(emu->memory);
-	free(emu);
+	for (i = 0; i < count; i++) {
+		images[i] = load_snapshot(files[i], i > 0 ? images[i - 1] : NULL);
+		if (images[i] == NULL) {
+			printf("%s can not be loaded: not a snapshot file, or incremental on another one\n", files[i]);
+			while (--i >= 0) {
+				destroy_snapshot(images[i]);
+			}
+			return -1;
+		}
+	}
+	return count;
 }
 
 /* To ensure the emulator */
@@ -109,43 +84,142 @@ int opt_remove_at(int argc, char* argv[], int index) {
 
 int main(int argc, char* argv[]) {
 	unsigned int debug = 1;
+	unsigned int block_mode = 0;
+	unsigned int jit_mode = 0;
+	unsigned int run_mode = 0;
+	unsigned int lockstep_mode = 0;
+	SweepConfig sweep;
+	const char* key_file = NULL;
+	const char* key_range = NULL;
+	const char* trace_file = NULL;
+	Trace* trace = NULL;
+	const char* image_files[MAX_IMAGES];
+	Snapshot* images[MAX_IMAGES];
+	int image_count = 0;
+	const char* save_file = NULL;
+	uint32_t save_eip = 0;
 	Emulator* emu;
+	int arg;
+
+	memset(&sweep, 0, sizeof(sweep));
+	sweep.output = "sweep.bin";
+
+	for (arg = 1; arg < argc; arg++) {
+		/* -b: run by basic block, without the per-instruction trace */
+		if (strcmp(argv[arg], "-b") == 0) {
+			block_mode = 1;
+			argc = opt_remove_at(argc, argv, arg);
+			arg--;
+		} else if (strcmp(argv[arg], "-x") == 0) {
+			/* -x: block mode with hot blocks translated to host code */
+			block_mode = 1;
+			jit_mode = 1;
+			argc = opt_remove_at(argc, argv, arg);
+			arg--;
+		} else if (strcmp(argv[arg], "-r") == 0) {
+			/* -r: run instruction by instruction without the trace */
+			run_mode = 1;
+			argc = opt_remove_at(argc, argv, arg);
+			arg--;
+		} else if (strcmp(argv[arg], "-l") == 0) {
+			/* -l: sweep LOCKSTEP_LANES keys at a time in lockstep; slower than -b on the keygen, see lockstep.h */
+			lockstep_mode = 1;
+			argc = opt_remove_at(argc, argv, arg);
+			arg--;
+		} else if (arg + 1 < argc && (strcmp(argv[arg], "-s") == 0 || strcmp(argv[arg], "-k") == 0
+				|| strcmp(argv[arg], "-o") == 0 || strcmp(argv[arg], "-j") == 0
+				|| strcmp(argv[arg], "-t") == 0 || strcmp(argv[arg], "-i") == 0
+				|| strcmp(argv[arg], "-w") == 0 || strcmp(argv[arg], "-m") == 0)) {
+			/* -s FIRST-LAST / -k FILE: sweep a key range or the keys of a file, -o FILE: records, -j N: threads */
+			/* -t FILE: binary trace of every instruction instead of the text one (tools/trace_render prints it) */
+			/* -i FILE: start from a snapshot file instead of the image, again for each incremental one on top of it */
+			/* -w FILE: save the machine before the run, or when EIP first reaches -m EIP; only the changes when started with -i */
+			switch (argv[arg][1]) {
+				case 's': key_range = argv[arg + 1]; break;
+				case 'k': key_file = argv[arg + 1]; break;
+				case 'o': sweep.output = argv[arg + 1]; break;
+				case 'j': sweep.threads = atoi(argv[arg + 1]); break;
+				case 't': trace_file = argv[arg + 1]; break;
+				case 'w': save_file = argv[arg + 1]; break;
+				case 'm': save_eip = strtoul(argv[arg + 1], NULL, 16); break;
+				case 'i':
+					if (image_count == MAX_IMAGES) {
+						printf("at most %d snapshot files\n", MAX_IMAGES);
+						return 1;
+					}
+					image_files[image_count++] = argv[arg + 1];
+					break;
+			}
+			argc = opt_remove_at(argc, argv, arg);
+			argc = opt_remove_at(argc, argv, arg);
+			arg--;
+		}
+	}
 
 	/* Initialization of the instruction set */
 	init_instructions();
+	PROFILE_START();
 
-	/* Make the emulator. Specified in the EIP and ESP of argument */
-	emu = create_emu(MEMORY_SIZE);
+	if (load_images(image_files, image_count, images) < 0) {
+		return 1;
+	}
 
-	/* Read binary given by the argument */
-	read_binary(emu, "Continuum40.bin");
+	if (key_range != NULL || key_file != NULL) {
+		if (key_file != NULL) {
+			long count = load_key_file(key_file, &sweep.keys);
+			if (count < 0) {
+				return 1;
+			}
+			sweep.count = count;
+		} else {
+			char* end;
+			uint32_t last;
+
+			sweep.first_key = strtoul(key_range, &end, 16);
+			last = *end == '-' ? strtoul(end + 1, NULL, 16) : sweep.first_key;
+			sweep.count = last >= sweep.first_key ? (uint64_t)last - sweep.first_key + 1 : 0;
+		}
+		sweep.image = image_count > 0 ? images[image_count - 1] : NULL;
+		sweep.run_mode = lockstep_mode ? SWEEP_RUN_LOCKSTEP : jit_mode ? SWEEP_RUN_JIT : block_mode ? SWEEP_RUN_BLOCKS : SWEEP_RUN_INSTRUCTIONS;
+		arg = run_sweep(&sweep);
+		free(sweep.keys);
+		while (--image_count >= 0) {
+			destroy_snapshot(images[image_count]);
+		}
+		return arg == 0 ? 0 : 1;
+	}
 
+	if (image_count > 0) {
+		/* The saved machine, set up already */
+		emu = create_emu_from_snapshot(images[image_count - 1]);
+	} else {
+		/* Make the emulator. Specified in the EIP and ESP of argument */
+		emu = create_emu();
 
-	/* To those specified the initial value of the registers */
-	emu->eip = 0x00457D60; //start of function 0x457D60
-	uint32_t KEY = 0xF53E944B;
-	emu->registers[EAX] = 0x0012F8F8;
-	emu->registers[ECX] = 0x0012F8F8;
-	emu->registers[EDX] = KEY; //<-- Key
-	emu->registers[EBX] = 0xFFFFFFFF;
-	emu->registers[ESP] = 0x0012E8D0;
-	emu->registers[EBP] = 0x0012F91C;
-	emu->registers[ESI] = KEY; //<-- Key
-	emu->registers[EDI] = 0x00000400;
+		/* Read binary given by the argument */
+		if (read_binary(emu, CONTINUUM_IMAGE) < 0) {
+			destroy_emu(emu);
+			return 1;
+		}
 
-	//Fix esp and [esp+4] value this is to fake emulate passing key into function
-	set_memory32(emu, 0x0012E8D0, KEY);
-	set_memory32(emu, 0x0012E8D4, KEY);
+		uint32_t KEY = 0xF53E944B;
+		setup_continuum(emu, KEY);
+	}
 
-	//Write pointer at 0x0012F8F8 that goes to address 0x0012F880 where virtual buffer
-	set_memory32(emu, 0x0012F8F8, 0x0012F880);
+	if (save_file != NULL) {
+		Snapshot* snapshot;
 
-	//zero the 80 byte virtual buffer
-	unsigned int i;
-	unsigned int j = 0;
+		if (save_eip != 0 && run_instructions(emu, save_eip) != 0) {
+			printf("EIP %X was not reached\n", save_eip);
+		}
+		snapshot = take_snapshot(emu);
+		if (save_snapshot(snapshot, image_count > 0 ? images[image_count - 1] : NULL, save_file) != 0) {
+			printf("%s file can not be written\n", save_file);
+		}
+		destroy_snapshot(snapshot);
+	}
 
-	for( i = 0x0012F880; i < 0x0012F880+80; i++)
-		set_memory8(emu, i, 0);
+	unsigned int i;
 
 	/*
 	Step 1 start registers and stuff
@@ -175,22 +249,44 @@ int main(int argc, char* argv[]) {
 	}
 	*/
 
-	while (emu->eip != 0x00458BD0) {
-		uint8_t code = get_code8(emu, 0);
+	if (jit_mode && !set_block_jit(emu, 1)) {
+		printf("JIT not supported on this host, interpreting blocks\n");
+	}
+
+	if (block_mode) {
+		run_blocks(emu, CONTINUUM_STOP_EIP);
+	} else if (run_mode) {
+		run_instructions(emu, CONTINUUM_STOP_EIP);
+	} else if (trace_file != NULL) {
+		trace = open_trace(trace_file, TRACE_DEFAULT_RECORDS);
+		if (trace == NULL) {
+			destroy_emu(emu);
+			return 1;
+		}
+		run_traced(emu, CONTINUUM_STOP_EIP, trace);
+		close_trace(trace);
+	}
+
+	while (!block_mode && !run_mode && trace == NULL && emu->eip != CONTINUUM_STOP_EIP) {
+		/* Decoded once per address, later passes come from the cache */
+		DecodedInstruction* insn = fetch_decoded(emu);
 
 		/* And outputs the binary to be run with the current program counter */
 		if (debug) {
-			printf("EIP = %X, Code = %02X\n", emu->eip, code);
+			printf("EIP = %X, Code = %02X\n", emu->eip, insn->opcode);
 		}
         
 		//dump_registers(emu);
-		if (instructions[code] == NULL) {
-			printf("\n\nNot Implemented: %x\n", code);
+		if (insn->func == NULL) {
+			printf("\n\nNot Implemented: %x\n", insn->opcode);
 			break;
 		}
 
 		/* Execution of an instruction */
-		instructions[code](emu);
+		emu->insn = insn;
+		PROFILE_BEGIN(emu);
+		insn->func(emu);
+		PROFILE_END();
 		dump_registers(emu);
 		printf("\n--------------------------------\n");
 		/* EIP - The end of the program Once but becomes 0 */
@@ -206,7 +302,7 @@ int main(int argc, char* argv[]) {
 //23 D4 AB 77 72 3A 6F 7F 79 CD 5 DD D7 8D AD 24 13 D3 0 F4 ED 99
 // 2 99 F4 83 7D FF 69 FD BC EF 23 90 C6 C9 B1 
 	printf("Buffer (1) = \n");
-	for(i=0x0012F880;i<0x0012F880+80;i++) {
+	for(i=CONTINUUM_BUFFER;i<CONTINUUM_BUFFER+CONTINUUM_BUFFER_SIZE;i++) {
 		printf("%X ", get_memory8(emu, i));
 	}
 	printf("\n");
@@ -214,12 +310,19 @@ int main(int argc, char* argv[]) {
 //7E 9D FD 9C ED 71 9B 39 5E 12 46 37 A 8 AD DF 1F 55 E2 F6 CE EB EE 23 3 41 1F 5E
 //A8 B1 5F 4D 38 74 60 46 50 A2 B5 12 7B 3A 41 A5 F2 C3 9E CB 14 7 7 DA A1 54 61
 //D4 E0 E0 41 4E 7 16 F9 FD 4A 28 53 97 6D 4D 21 F2 91 2A 26 34 BB 9D B7 BA
-//newest generated values
+//Generated before rol / ror by CL rotated all 32 bits
 //81 9C 2F F6 45 5 17 A7 60 5F 9F DC 1B BF 77 7E D8 E1 D1 E2 79 5D 46 4 65 D5 73 9
 //E 45 80 D5 32 8B EC A8 3E C7 9 65 D5 E9 E EA 0 83 1 6E 58 29 37 71 E5 3D 94 E3 6
 //6 50 9 4A 9 72 73 52 53 4A 69 78 DF 8 2 4F 2E 67 55 F9 A3 C2 9A 35 8F
+//newest generated values
+//47 C4 B6 EF 44 E C8 3D D4 D5 2B A2 A7 81 CD 2C 46 BE 15 E0 6 52 3E FB 2E 3A 83 B3
+//F1 3C F5 A4 1C 13 16 89 B2 BF FA A3 D4 49 24 63 63 46 BC 96 C9 D4 4 C9 4D FE 2C
+//A 10 73 82 92 87 A5 CC CF 63 AD 28 EB D5 65 66 B6 F8 1 4A F0 30 74 89 69
 	dump_stack(emu);
 	destroy_emu(emu);
+	while (--image_count >= 0) {
+		destroy_snapshot(images[image_count]);
+	}
 	system("pause");
 	return 0;
 }
@@ -7,147 +7,214 @@
 
 #include "modrm.h"
 #include "emulator_function.h"
+#include "decode_cache.h"
 
-void parse_modrm(Emulator* emu, ModRM* modrm, bool mode_16bit) {
-	uint8_t code;
-
-	assert(emu != NULL && modrm != NULL);
+/* Register direct operand: no address */
+static uint32_t address_register(Emulator* emu, const ModRM* modrm) {
+	printf("not implemented ModRM mod\n");
+	exit(0);
+}
 
-	memset(modrm, 0, sizeof(ModRM)); // Initialize all to 0
+/* [disp32], or a SIB byte with neither base nor index */
+static uint32_t address_disp(Emulator* emu, const ModRM* modrm) {
+	return modrm->disp32;
+}
 
-	code = get_code8(emu, 0);
-	modrm->mod = (code >> 6) & 0x03;
-	modrm->opcode = (code >> 3) & 0x07;
-	modrm->rm = code & 0x07;
+/* [reg] */
+static uint32_t address_base(Emulator* emu, const ModRM* modrm) {
+	return emu->registers[modrm->rm];
+}
 
-	emu->eip += 1;
+/* [reg + disp8/disp32] */
+static uint32_t address_base_disp(Emulator* emu, const ModRM* modrm) {
+	return emu->registers[modrm->rm] + modrm->disp32;
+}
 
-	if (modrm->mod != 3 && modrm->rm == 4) {
-		modrm->sib = get_code8(emu, 0);
-		emu->eip += 1;
-	}
+/* [base + index * scale + disp] */
+static uint32_t address_sib(Emulator* emu, const ModRM* modrm) {
+	uint8_t sib = modrm->sib;
+	return emu->registers[sib & 0x07] + (emu->registers[(sib >> 3) & 0x07] << (sib >> 6)) + modrm->disp32;
+}
 
-	if ((modrm->mod == 0 && modrm->rm == 5) || modrm->mod == 2) {
-		modrm->disp32 = get_sign_code32(emu, 0);
-		emu->eip += 4;
-		/* must use mode_16bit because if not used, will increase EIP by 2 when not needed. */
-	} else if (mode_16bit && (modrm->mod == 0 && modrm->rm == 6) || modrm->mod == 2) {
-		modrm->disp16 = get_sign_code16(emu, 0);
-		emu->eip += 2;
-	} else if (modrm->mod == 1) {
-		modrm->disp8 = get_sign_code8(emu, 0);
-		emu->eip += 1;
-	}
+/* [base + disp], index 4 is none */
+static uint32_t address_sib_base(Emulator* emu, const ModRM* modrm) {
+	return emu->registers[modrm->sib & 0x07] + modrm->disp32;
 }
 
-/* SIB evaluation (self-implementation) */
-uint32_t eval_sib(Emulator* emu, ModRM* modrm) {
+/* [index * scale + disp], base 5 is none */
+static uint32_t address_sib_index(Emulator* emu, const ModRM* modrm) {
 	uint8_t sib = modrm->sib;
-	uint8_t scale = (sib >> 6) & 0x03;   //((sib & 0xC0) >> 6); //old broken code
-	uint8_t base  = sib & 0x07;            //((sib & 0x38) >> 3); //old broken code
-	uint8_t index = (sib >> 3) & 0x07;   //(sib & 0x03);         //old broken code
-	uint32_t r32b, r32i;
+	return (emu->registers[(sib >> 3) & 0x07] << (sib >> 6)) + modrm->disp32;
+}
 
-	if (base == 5) {
-		r32b = 0;
-	} else {
-		r32b = get_register32(emu, base);
-	}
+/* 16-bit forms wrap around within the first 64 KB */
+#define REG16(index) (emu->registers[index] & 0xffff)
 
-	if (index == 4) {
-		return r32b;
-	} else {
-		r32i = get_register32(emu, index);
-	}
+static uint32_t address16_bx_si(Emulator* emu, const ModRM* modrm) {
+	return (REG16(BX) + REG16(SI) + modrm->disp32) & 0xffff;
+}
 
-	if (scale == 0) {
-		return r32b + r32i;
-	} else if (scale == 1) {
-		return r32b + r32i * 2;
-	} else if (scale == 2) {
-		return r32b + r32i * 4;
-	} else {  /* scale == 3 */
-		return r32b + r32i * 8;
-	}
+static uint32_t address16_bx_di(Emulator* emu, const ModRM* modrm) {
+	return (REG16(BX) + REG16(DI) + modrm->disp32) & 0xffff;
 }
 
-uint32_t get_index_address(Emulator* emu, ModRM* modrm) {
-	if (modrm->rm == 0) {
-		return (uint32_t)get_register16(emu, BX) + (uint32_t)get_register32(emu, SI);
-	} else if (modrm->rm == 1) {
-		return (uint32_t)get_register16(emu, BX) + (uint32_t)get_register32(emu, DI);
-	} else if (modrm->rm == 2) {
-		return (uint32_t)get_register16(emu, BP) + (uint32_t)get_register32(emu, SI);
-	} else if (modrm->rm == 3) {
-		return (uint32_t)get_register16(emu, BP) + (uint32_t)get_register32(emu, DI);
-	} else if (modrm->rm == 4) {
-		return (uint32_t)get_register16(emu, SI);
-	} else if (modrm->rm == 5) {
-		return (uint32_t)get_register16(emu, DI);
-	} else if (modrm->rm == 6) {
-		return (uint32_t)get_register16(emu, BP);
-	} else if (modrm->rm == 7) {
-		return (uint32_t)get_register16(emu, BX);
-	}
+static uint32_t address16_bp_si(Emulator* emu, const ModRM* modrm) {
+	return (REG16(BP) + REG16(SI) + modrm->disp32) & 0xffff;
+}
+
+static uint32_t address16_bp_di(Emulator* emu, const ModRM* modrm) {
+	return (REG16(BP) + REG16(DI) + modrm->disp32) & 0xffff;
+}
+
+static uint32_t address16_si(Emulator* emu, const ModRM* modrm) {
+	return (REG16(SI) + modrm->disp32) & 0xffff;
+}
+
+static uint32_t address16_di(Emulator* emu, const ModRM* modrm) {
+	return (REG16(DI) + modrm->disp32) & 0xffff;
+}
+
+static uint32_t address16_bp(Emulator* emu, const ModRM* modrm) {
+	return (REG16(BP) + modrm->disp32) & 0xffff;
+}
+
+static uint32_t address16_bx(Emulator* emu, const ModRM* modrm) {
+	return (REG16(BX) + modrm->disp32) & 0xffff;
+}
+
+static uint32_t address16_disp(Emulator* emu, const ModRM* modrm) {
+	return modrm->disp32 & 0xffff;
 }
 
-uint32_t calc_memory_address16(Emulator* emu, ModRM* modrm) {
-	/* Register indirect reference types */
-	if (modrm->mod == 0) {
-		if (modrm->rm == 6) {
-			return modrm->disp16;
-		} else {
-			return get_index_address(emu, modrm);
+/* What follows a ModRM byte and how its address is computed */
+typedef struct {
+	/* A SIB byte follows */
+	uint8_t sib;
+	/* Displacement bytes (after the SIB byte) */
+	uint8_t disp;
+	address_func_t* address;
+} ModRMForm;
+
+/* The form only depends on mod and rm, the reg field repeats each row 8 times */
+#define REPEAT_REG(...) __VA_ARGS__, __VA_ARGS__, __VA_ARGS__, __VA_ARGS__, \
+	__VA_ARGS__, __VA_ARGS__, __VA_ARGS__, __VA_ARGS__
+
+#define REGISTER_ROW \
+	{ 0, 0, address_register }, { 0, 0, address_register }, { 0, 0, address_register }, { 0, 0, address_register }, \
+	{ 0, 0, address_register }, { 0, 0, address_register }, { 0, 0, address_register }, { 0, 0, address_register }
+
+#define MODRM32_ROW(disp, base) \
+	{ 0, disp, base }, { 0, disp, base }, { 0, disp, base }, { 0, disp, base }, \
+	{ 1, disp, NULL }, { 0, disp, base }, { 0, disp, base }, { 0, disp, base }
+
+static const ModRMForm modrm_forms32[256] = {
+	REPEAT_REG({ 0, 0, address_base }, { 0, 0, address_base }, { 0, 0, address_base }, { 0, 0, address_base },
+		{ 1, 0, NULL }, { 0, 4, address_disp }, { 0, 0, address_base }, { 0, 0, address_base }),
+	REPEAT_REG(MODRM32_ROW(1, address_base_disp)),
+	REPEAT_REG(MODRM32_ROW(4, address_base_disp)),
+	REPEAT_REG(REGISTER_ROW),
+};
+
+#define MODRM16_ROW(disp) \
+	{ 0, disp, address16_bx_si }, { 0, disp, address16_bx_di }, { 0, disp, address16_bp_si }, { 0, disp, address16_bp_di }, \
+	{ 0, disp, address16_si }, { 0, disp, address16_di }, { 0, disp, address16_bp }, { 0, disp, address16_bx }
+
+static const ModRMForm modrm_forms16[256] = {
+	REPEAT_REG({ 0, 0, address16_bx_si }, { 0, 0, address16_bx_di }, { 0, 0, address16_bp_si }, { 0, 0, address16_bp_di },
+		{ 0, 0, address16_si }, { 0, 0, address16_di }, { 0, 2, address16_disp }, { 0, 0, address16_bx }),
+	REPEAT_REG(MODRM16_ROW(1)),
+	REPEAT_REG(MODRM16_ROW(2)),
+	REPEAT_REG(REGISTER_ROW),
+};
+
+/*
+ * Address of each SIB byte, under mod 0 and under mod 1 and 2. Base 5 is
+ * no base under mod 0, where a disp32 follows the SIB byte instead, and
+ * EBP under mod 1 and 2.
+ */
+#define SIB_ROW(with_base, base5) \
+	with_base, with_base, with_base, with_base, with_base, base5, with_base, with_base
+
+/* Index 4 is none */
+#define SIB_SCALE(base5, base5_no_index) \
+	SIB_ROW(address_sib, base5), SIB_ROW(address_sib, base5), \
+	SIB_ROW(address_sib, base5), SIB_ROW(address_sib, base5), \
+	SIB_ROW(address_sib_base, base5_no_index), SIB_ROW(address_sib, base5), \
+	SIB_ROW(address_sib, base5), SIB_ROW(address_sib, base5)
+
+static address_func_t* const sib_forms[2][256] = {
+	{
+		SIB_SCALE(address_sib_index, address_disp), SIB_SCALE(address_sib_index, address_disp),
+		SIB_SCALE(address_sib_index, address_disp), SIB_SCALE(address_sib_index, address_disp),
+	},
+	{
+		SIB_SCALE(address_sib, address_sib_base), SIB_SCALE(address_sib, address_sib_base),
+		SIB_SCALE(address_sib, address_sib_base), SIB_SCALE(address_sib, address_sib_base),
+	},
+};
+
+int decode_modrm(Emulator* emu, ModRM* modrm, int index, bool mode_16bit) {
+	const ModRMForm* form;
+	uint8_t code;
+	int disp;
+
+	assert(emu != NULL && modrm != NULL);
+
+	code = get_code8(emu, index);
+	form = mode_16bit ? &modrm_forms16[code] : &modrm_forms32[code];
+	modrm->mod = code >> 6;
+	modrm->opcode = (code >> 3) & 0x07;
+	modrm->rm = code & 0x07;
+	modrm->sib = 0;
+	modrm->address = form->address;
+	disp = form->disp;
+
+	if (form->sib) {
+		modrm->sib = get_code8(emu, index + 1);
+		modrm->address = sib_forms[modrm->mod != 0][modrm->sib];
+		if (modrm->mod == 0 && (modrm->sib & 0x07) == 5) {
+			disp = 4;
 		}
-		/* Register indirect reference + 8bit displacement type */
-	} else if (modrm->mod == 1) {
-		return get_index_address(emu, modrm) + modrm->disp8;
-		/* Register indirect reference + 16bit displacement type */
-	} else if (modrm->mod == 2) {
-		return get_index_address(emu, modrm) + modrm->disp16;
-		/*Register direct reference type */
-	} else {
-		printf("not implemented ModRM mod\n");
-		exit(0);
 	}
+	index += 1 + form->sib;
+
+	switch (disp) {
+		case 1:
+			modrm->disp32 = get_sign_code8(emu, index);
+			break;
+		case 2:
+			modrm->disp32 = (int16_t)get_sign_code16(emu, index);
+			break;
+		case 4:
+			modrm->disp32 = get_sign_code32(emu, index);
+			break;
+		default:
+			modrm->disp32 = 0;
+	}
+
+	return 1 + form->sib + disp;
 }
 
-uint32_t calc_memory_address32(Emulator* emu, ModRM* modrm) {
-	/* Register indirect reference types */
-	if (modrm->mod == 0) {
-		if (modrm->rm == 4) {
-			return eval_sib(emu, modrm);
-		} else if (modrm->rm == 5) {
-			return modrm->disp32;
-		} else {
-			return get_register32(emu, modrm->rm);
-		}
-		/* Register indirect reference + 8bit displacement type */
-	} else if (modrm->mod == 1) {
-		if (modrm->rm == 4) {
-			return eval_sib(emu, modrm) + modrm->disp8;
-		} else {
-			return get_register32(emu, modrm->rm) + modrm->disp8;
-		}
-		/* Register indirect reference + 32bit displacement type */
-	} else if (modrm->mod == 2) {
-		if (modrm->rm == 4) {
-			return eval_sib(emu, modrm) + modrm->disp32;
-		} else {
-			return get_register32(emu, modrm->rm) + modrm->disp32;
-		}
-		/* Register direct reference type */
-	} else {
-		printf("not implemented ModRM mod\n");
-		exit(0);
+void parse_modrm(Emulator* emu, ModRM* modrm, bool mode_16bit) {
+	DecodedInstruction* insn = emu->insn;
+
+	/* Reuse the ModRM decoded for this instruction when it sits where the handler expects it */
+	if (insn != NULL && insn->modrm_offset != 0
+			&& emu->eip == insn->eip + insn->modrm_offset
+			&& insn->modrm_16bit == mode_16bit) {
+		*modrm = insn->modrm;
+		emu->eip += insn->modrm_length;
+		return;
 	}
+
+	emu->eip += decode_modrm(emu, modrm, 0, mode_16bit);
 }
 
 uint8_t get_rm8(Emulator* emu, ModRM* modrm) {
 	if (modrm->mod == 3) {
 		return get_register8(emu, modrm->rm);
 	} else {
-		uint32_t address = calc_memory_address32(emu, modrm);
+		uint32_t address = calc_memory_address(emu, modrm);
 		return get_memory8(emu, address);
 	}
 }
@@ -156,7 +223,7 @@ uint16_t get_rm16(Emulator* emu, ModRM* modrm) {
 	if (modrm->mod == 3) {
 		return get_register16(emu, modrm->rm);
 	} else {
-		uint32_t address = calc_memory_address16(emu, modrm);
+		uint32_t address = calc_memory_address(emu, modrm);
 		return get_memory16(emu, address);
 	}
 }
@@ -165,7 +232,7 @@ uint32_t get_rm32(Emulator* emu, ModRM* modrm) {
 	if (modrm->mod == 3) {
 		return get_register32(emu, modrm->rm);
 	} else {
-		uint32_t address = calc_memory_address32(emu, modrm);
+		uint32_t address = calc_memory_address(emu, modrm);
 		return get_memory32(emu, address);
 	}
 }
@@ -174,7 +241,7 @@ void set_rm8(Emulator* emu, ModRM* modrm, uint8_t value) {
 	if (modrm->mod == 3) {
 		set_register8(emu, modrm->rm, value);
 	} else {
-		uint32_t address = calc_memory_address32(emu, modrm);
+		uint32_t address = calc_memory_address(emu, modrm);
 		set_memory8(emu, address, value);
 	}
 }
@@ -183,7 +250,7 @@ void set_rm16(Emulator* emu, ModRM* modrm, uint16_t value) {
 	if (modrm->mod == 3) {
 		set_register16(emu, modrm->rm, value);
 	} else {
-		uint32_t address = calc_memory_address16(emu, modrm);
+		uint32_t address = calc_memory_address(emu, modrm);
 		set_memory16(emu, address, value);
 	}
 }
@@ -192,7 +259,7 @@ void set_rm32(Emulator* emu, ModRM* modrm, uint32_t value) {
 	if (modrm->mod == 3) {
 		set_register32(emu, modrm->rm, value);
 	} else {
-		uint32_t address = calc_memory_address32(emu, modrm);
+		uint32_t address = calc_memory_address(emu, modrm);
 		set_memory32(emu, address, value);
 	}
 }
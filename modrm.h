@@ -6,8 +6,13 @@
 
 #include "emulator.h"
 
+struct ModRM;
+
+/* Effective address of a memory operand, picked for its ModRM (and SIB) form when decoded */
+typedef uint32_t address_func_t(Emulator* emu, const struct ModRM* modrm);
+
 /* Structure that represents the ModRM */
-typedef struct {
+typedef struct ModRM {
   uint8_t mod;
 
   /* opcode and reg_index the same alias */
@@ -21,19 +26,26 @@ typedef struct {
   /* Use when SIB is a combination of mod / rm necessary*/
   uint8_t sib;
 
+  /* Sign extended to 32 bits whatever its size, so disp8 and disp16 read the same value */
   union {
     int8_t disp8; /* disp8 is signed integer*/
     int16_t disp16;
     uint32_t disp32;
   };
+
+  address_func_t* address;
 } ModRM;
 
 /* ModRM, SIB, To analyze the displacement */
 void parse_modrm(Emulator* emu, ModRM* modrm, bool mode_16bit);
 
+/* ModRM, SIB, displacement at index bytes after the program counter, in 16-bit address forms when mode_16bit. Returns the number of bytes used */
+int decode_modrm(Emulator* emu, ModRM* modrm, int index, bool mode_16bit);
+
 /* ModRM To calculate the effective address of the memory on the basis of the content */
-uint32_t calc_memory_address16(Emulator* emu, ModRM* modrm);
-uint32_t calc_memory_address32(Emulator* emu, ModRM* modrm);
+static inline uint32_t calc_memory_address(Emulator* emu, const ModRM* modrm) {
+  return modrm->address(emu, modrm);
+}
 
 /* Memory / register accessor 32-bit version */
 uint32_t get_rm32(Emulator* emu, ModRM* modrm);
@@ -0,0 +1,234 @@
+#include "profile.h"
+
+#ifdef PROFILE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "emulator_function.h"
+#include "instruction.h"
+#include "decode_cache.h"
+
+/* Guest addresses tracked (open addressing); later new addresses are only counted in the totals */
+#define PROFILE_EIP_BITS (16)
+#define PROFILE_EIP_SLOTS (1 << PROFILE_EIP_BITS)
+/* Rows of the address table in the report */
+#define PROFILE_TOP_EIPS (50)
+/* No sub-opcode recorded */
+#define PROFILE_NO_SUB (0xFFFFFFFF)
+
+typedef struct ProfileEntry {
+	uint64_t count;
+	uint64_t cycles;
+} ProfileEntry;
+
+typedef struct EipEntry {
+	uint32_t eip;
+	uint32_t used;
+	uint8_t opcode;
+	uint32_t sub;
+	ProfileEntry total;
+} EipEntry;
+
+static ProfileEntry opcodes[256];
+/* Group opcodes are listed in groups[] and counted per sub-opcode */
+static const uint8_t groups[] = { 0x0F, 0x81, 0x83, 0xC1, 0xD1, 0xD3, 0xF7, 0xFF };
+#define PROFILE_GROUPS (sizeof(groups) / sizeof(groups[0]))
+static int8_t group_index[256];
+static ProfileEntry group_subs[PROFILE_GROUPS][256];
+static EipEntry eips[PROFILE_EIP_SLOTS];
+static ProfileEntry total;
+
+/* The instruction being timed */
+static uint32_t current_eip;
+static uint8_t current_opcode;
+static uint32_t current_sub;
+static uint64_t current_start;
+
+static inline uint64_t read_cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+static const char* opcode_name(uint8_t opcode) {
+	return instruction_names[opcode] != NULL ? instruction_names[opcode] : "unknown";
+}
+
+static EipEntry* lookup_eip(uint32_t eip) {
+	uint32_t slot = (eip * 0x9E3779B1u) >> (32 - PROFILE_EIP_BITS);
+	int probes;
+
+	for (probes = 0; probes < PROFILE_EIP_SLOTS; probes++) {
+		EipEntry* entry = &eips[slot];
+
+		if (!entry->used) {
+			entry->used = 1;
+			entry->eip = eip;
+			return entry;
+		}
+		if (entry->eip == eip) {
+			return entry;
+		}
+		slot = (slot + 1) & (PROFILE_EIP_SLOTS - 1);
+	}
+	return NULL;
+}
+
+void profile_begin(Emulator* emu) {
+	current_eip = emu->eip;
+	current_opcode = emu->insn != NULL ? emu->insn->opcode : get_code8(emu, 0);
+	current_sub = PROFILE_NO_SUB;
+	current_start = read_cycles();
+}
+
+void profile_group(uint32_t sub) {
+	current_sub = sub & 0xFF;
+}
+
+void profile_end(void) {
+	uint64_t cycles = read_cycles() - current_start;
+	EipEntry* entry;
+
+	opcodes[current_opcode].count++;
+	opcodes[current_opcode].cycles += cycles;
+	total.count++;
+	total.cycles += cycles;
+
+	if (current_sub != PROFILE_NO_SUB && group_index[current_opcode] >= 0) {
+		ProfileEntry* sub = &group_subs[group_index[current_opcode]][current_sub];
+		sub->count++;
+		sub->cycles += cycles;
+	}
+
+	entry = lookup_eip(current_eip);
+	if (entry != NULL) {
+		entry->opcode = current_opcode;
+		entry->sub = current_sub;
+		entry->total.count++;
+		entry->total.cycles += cycles;
+	}
+}
+
+/* Row of the sorted tables */
+typedef struct ProfileRow {
+	char name[64];
+	ProfileEntry entry;
+} ProfileRow;
+
+static int compare_rows(const void* a, const void* b) {
+	uint64_t x = ((const ProfileRow*)a)->entry.cycles;
+	uint64_t y = ((const ProfileRow*)b)->entry.cycles;
+	return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static void write_rows(FILE* file, const char* title, ProfileRow* rows, int count, int limit) {
+	int i;
+
+	qsort(rows, count, sizeof(ProfileRow), compare_rows);
+	fprintf(file, "\n%s\n", title);
+	fprintf(file, "%12s %7s %14s %7s %9s  %s\n", "count", "%count", "cycles", "%cycles", "cyc/insn", "instruction");
+	for (i = 0; i < count && i < limit; i++) {
+		ProfileEntry* e = &rows[i].entry;
+		fprintf(file, "%12llu %6.2f%% %14llu %6.2f%% %9.1f  %s\n",
+				(unsigned long long)e->count, total.count ? 100.0 * e->count / total.count : 0,
+				(unsigned long long)e->cycles, total.cycles ? 100.0 * e->cycles / total.cycles : 0,
+				e->count ? (double)e->cycles / e->count : 0, rows[i].name);
+	}
+}
+
+/* Opcode, sub-opcode and handler: "83 /5 code_83", "0F AF code_0f" */
+static void instruction_label(char* out, size_t size, uint8_t opcode, uint32_t sub) {
+	if (sub == PROFILE_NO_SUB) {
+		snprintf(out, size, "%02X %s", opcode, opcode_name(opcode));
+	} else if (opcode == 0x0F) {
+		snprintf(out, size, "0F %02X %s", sub, opcode_name(opcode));
+	} else {
+		snprintf(out, size, "%02X /%u %s", opcode, sub, opcode_name(opcode));
+	}
+}
+
+static void write_report(void) {
+	ProfileRow* rows = malloc(sizeof(ProfileRow) * (PROFILE_EIP_SLOTS > 256 * PROFILE_GROUPS ? PROFILE_EIP_SLOTS : 256 * PROFILE_GROUPS));
+	FILE* report = fopen(PROFILE_REPORT, "w");
+	FILE* folded = fopen(PROFILE_FOLDED, "w");
+	int count, i, g, s;
+
+	if (report == NULL || folded == NULL) {
+		printf("profile files can not be created\n");
+		goto done;
+	}
+
+	fprintf(report, "%llu instructions, %llu cycles\n", (unsigned long long)total.count, (unsigned long long)total.cycles);
+
+	for (i = 0, count = 0; i < 256; i++) {
+		if (opcodes[i].count != 0) {
+			instruction_label(rows[count].name, sizeof(rows[count].name), i, PROFILE_NO_SUB);
+			rows[count++].entry = opcodes[i];
+		}
+	}
+	write_rows(report, "By opcode:", rows, count, count);
+
+	for (g = 0, count = 0; g < PROFILE_GROUPS; g++) {
+		for (s = 0; s < 256; s++) {
+			if (group_subs[g][s].count != 0) {
+				instruction_label(rows[count].name, sizeof(rows[count].name), groups[g], s);
+				rows[count++].entry = group_subs[g][s];
+			}
+		}
+	}
+	write_rows(report, "By group sub-opcode:", rows, count, count);
+
+	for (i = 0, count = 0; i < PROFILE_EIP_SLOTS; i++) {
+		EipEntry* entry = &eips[i];
+		char label[40];
+
+		if (!entry->used) {
+			continue;
+		}
+		instruction_label(label, sizeof(label), entry->opcode, entry->sub);
+		snprintf(rows[count].name, sizeof(rows[count].name), "%08X %s", entry->eip, label);
+		rows[count++].entry = entry->total;
+
+		/* Collapsed stack: instruction;sub-opcode;address cycles */
+		fprintf(folded, "px86;%s", opcode_name(entry->opcode));
+		if (entry->sub != PROFILE_NO_SUB) {
+			fprintf(folded, entry->opcode == 0x0F ? ";0F_%02X" : ";/%u", entry->sub);
+		}
+		fprintf(folded, ";%08X %llu\n", entry->eip, (unsigned long long)entry->total.cycles);
+	}
+	write_rows(report, "Hottest guest addresses:", rows, count, PROFILE_TOP_EIPS);
+
+	printf("profile written to %s and %s\n", PROFILE_REPORT, PROFILE_FOLDED);
+
+done:
+	if (report != NULL) {
+		fclose(report);
+	}
+	if (folded != NULL) {
+		fclose(folded);
+	}
+	free(rows);
+}
+
+void profile_start(void) {
+	int i;
+
+	memset(group_index, -1, sizeof(group_index));
+	for (i = 0; i < PROFILE_GROUPS; i++) {
+		group_index[groups[i]] = i;
+	}
+	atexit(write_report);
+}
+
+#endif
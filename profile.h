@@ -0,0 +1,45 @@
+#ifndef PROFILE_H_
+#define PROFILE_H_
+
+#include <stdint.h>
+
+#include "emulator.h"
+
+/*
+ * Per-instruction profiler, only built with -DPROFILE (make px86_profile).
+ * Counts executions and host cycles per primary opcode, per sub-opcode of
+ * the group opcodes and per guest EIP, and at exit writes PROFILE_REPORT
+ * (sorted tables) and PROFILE_FOLDED (collapsed stacks for flamegraph.pl).
+ * The counters are not thread safe: profile sweeps with -j 1. Blocks run
+ * as host code under -x are not counted.
+ * Without PROFILE every hook below expands to nothing.
+ */
+#define PROFILE_REPORT "profile.txt"
+#define PROFILE_FOLDED "profile.folded"
+
+#ifdef PROFILE
+
+/* Write the report files when the program exits */
+void profile_start(void);
+/* The instruction emu->insn is about to run */
+void profile_begin(Emulator* emu);
+/* Sub-opcode of the running group instruction (ModRM reg field, second byte of 0x0F) */
+void profile_group(uint32_t sub);
+/* The instruction is done; charge its cycles */
+void profile_end(void);
+
+#define PROFILE_START() profile_start()
+#define PROFILE_BEGIN(emu) profile_begin(emu)
+#define PROFILE_GROUP(sub) profile_group(sub)
+#define PROFILE_END() profile_end()
+
+#else
+
+#define PROFILE_START() do { } while (0)
+#define PROFILE_BEGIN(emu) do { } while (0)
+#define PROFILE_GROUP(sub) do { } while (0)
+#define PROFILE_END() do { } while (0)
+
+#endif
+
+#endif
@@ -0,0 +1,322 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "snapshot.h"
+#include "emulator_function.h"
+#include "guest_memory.h"
+#include "decode_cache.h"
+
+Snapshot* take_snapshot(Emulator* emu) {
+	Snapshot* snapshot = malloc(sizeof(Snapshot));
+	int i, j;
+
+	flush_lazy_flags(emu);
+	memcpy(snapshot->registers, emu->registers, sizeof(snapshot->registers));
+	snapshot->eflags = emu->eflags;
+	snapshot->prefix_mode = emu->prefix_mode;
+	snapshot->eip = emu->eip;
+
+	/* Only the pages the emulator has are copied */
+	for (i = 0; i < GUEST_DIRECTORY_ENTRIES; i++) {
+		PageTable* table = emu->page_directory[i];
+		PageTable* copy = NULL;
+
+		if (table != NULL) {
+			copy = calloc(1, sizeof(PageTable));
+			for (j = 0; j < GUEST_TABLE_ENTRIES; j++) {
+				if (table->flags[j] & PAGE_MAPPED) {
+					/* Never written: the file mapping is already a frozen copy */
+					copy->pages[j] = table->pages[j];
+					copy->flags[j] = PAGE_MAPPED;
+				} else if (table->pages[j] != NULL) {
+					copy->pages[j] = malloc(GUEST_PAGE_SIZE);
+					memcpy(copy->pages[j], table->pages[j], GUEST_PAGE_SIZE);
+				}
+			}
+		}
+		snapshot->page_directory[i] = copy;
+	}
+
+	snapshot->id = 0;
+	snapshot->mappings = NULL;
+	snapshot->mapping_count = 0;
+	for (i = 0; i < (int)emu->mapping_count; i++) {
+		hold_mapping(&snapshot->mappings, &snapshot->mapping_count, emu->mappings[i]);
+	}
+
+	return snapshot;
+}
+
+void destroy_snapshot(Snapshot* snapshot) {
+	int i, j;
+
+	for (i = 0; i < GUEST_DIRECTORY_ENTRIES; i++) {
+		PageTable* table = snapshot->page_directory[i];
+
+		if (table != NULL) {
+			for (j = 0; j < GUEST_TABLE_ENTRIES; j++) {
+				if (!(table->flags[j] & (PAGE_MAPPED | PAGE_SHARED))) {
+					free(table->pages[j]);
+				}
+			}
+			free(table);
+		}
+	}
+	release_mappings(snapshot->mappings, snapshot->mapping_count);
+	free(snapshot);
+}
+
+/* Start of a snapshot file */
+typedef struct SnapshotFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t page_count;
+  /* Id of the snapshot stored, and of the one an incremental file holds the changes from (0 for a full file) */
+  uint64_t id;
+  uint64_t base_id;
+  uint32_t registers[REGISTERS_COUNT];
+  uint32_t eflags;
+  uint32_t prefix_mode;
+  uint32_t eip;
+  uint32_t reserved;
+} SnapshotFileHeader;
+
+/* Page of snapshot at page number, NULL when it holds nothing */
+static const uint8_t* snapshot_page(Snapshot* snapshot, uint32_t number) {
+	PageTable* table = snapshot->page_directory[number >> GUEST_TABLE_SHIFT];
+
+	return table != NULL ? table->pages[number & (GUEST_TABLE_ENTRIES - 1)] : NULL;
+}
+
+/* FNV-1a of the registers and every non-zero page with its number; never 0 */
+static uint64_t snapshot_id(Snapshot* snapshot) {
+	uint64_t hash = 0xCBF29CE484222325ULL;
+	uint32_t state[REGISTERS_COUNT + 3], number;
+	size_t i;
+
+	if (snapshot->id != 0) {
+		return snapshot->id;
+	}
+
+	memcpy(state, snapshot->registers, sizeof(snapshot->registers));
+	state[REGISTERS_COUNT] = snapshot->eflags;
+	state[REGISTERS_COUNT + 1] = snapshot->prefix_mode;
+	state[REGISTERS_COUNT + 2] = snapshot->eip;
+	for (i = 0; i < sizeof(state); i++) {
+		hash = (hash ^ ((uint8_t*)state)[i]) * 0x100000001B3ULL;
+	}
+
+	for (number = 0; number < GUEST_DIRECTORY_ENTRIES * GUEST_TABLE_ENTRIES; number++) {
+		const uint8_t* page = snapshot_page(snapshot, number);
+
+		if (page == NULL || memcmp(page, zero_page, GUEST_PAGE_SIZE) == 0) {
+			continue;
+		}
+		for (i = 0; i < sizeof(number); i++) {
+			hash = (hash ^ ((uint8_t*)&number)[i]) * 0x100000001B3ULL;
+		}
+		for (i = 0; i < GUEST_PAGE_SIZE; i++) {
+			hash = (hash ^ page[i]) * 0x100000001B3ULL;
+		}
+	}
+
+	snapshot->id = hash != 0 ? hash : 1;
+	return snapshot->id;
+}
+
+/* Whether page number of snapshot has to be stored: it differs from base, or from zero without one */
+static int page_changed(Snapshot* snapshot, Snapshot* base, uint32_t number) {
+	const uint8_t* page = snapshot_page(snapshot, number);
+	const uint8_t* original = base != NULL ? snapshot_page(base, number) : NULL;
+
+	if (page == original) {
+		return 0;
+	}
+	return memcmp(page != NULL ? page : zero_page, original != NULL ? original : zero_page, GUEST_PAGE_SIZE) != 0;
+}
+
+/* Offset of the first page in a file of page_count pages */
+static size_t snapshot_data_offset(uint32_t page_count) {
+	size_t size = sizeof(SnapshotFileHeader) + page_count * sizeof(uint32_t);
+
+	return (size + GUEST_PAGE_SIZE - 1) & ~(size_t)(GUEST_PAGE_SIZE - 1);
+}
+
+int save_snapshot(Snapshot* snapshot, Snapshot* base, const char* filename) {
+	SnapshotFileHeader header;
+	uint32_t* numbers = NULL;
+	uint32_t number, i;
+	size_t written;
+	FILE* file;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SNAPSHOT_FILE_MAGIC, sizeof(header.magic));
+	header.version = SNAPSHOT_FILE_VERSION;
+	header.id = snapshot_id(snapshot);
+	header.base_id = base != NULL ? snapshot_id(base) : 0;
+	memcpy(header.registers, snapshot->registers, sizeof(header.registers));
+	header.eflags = snapshot->eflags;
+	header.prefix_mode = snapshot->prefix_mode;
+	header.eip = snapshot->eip;
+
+	for (number = 0; number < GUEST_DIRECTORY_ENTRIES * GUEST_TABLE_ENTRIES; number++) {
+		if (page_changed(snapshot, base, number)) {
+			numbers = realloc(numbers, (header.page_count + 1) * sizeof(uint32_t));
+			numbers[header.page_count++] = number;
+		}
+	}
+
+	file = fopen(filename, "wb");
+	if (file == NULL) {
+		free(numbers);
+		return -1;
+	}
+
+	written = fwrite(&header, sizeof(header), 1, file);
+	written += fwrite(numbers, sizeof(uint32_t), header.page_count, file);
+	for (i = sizeof(header) + header.page_count * sizeof(uint32_t); i < snapshot_data_offset(header.page_count); i++) {
+		fputc(0, file);
+	}
+	for (i = 0; i < header.page_count; i++) {
+		const uint8_t* page = snapshot_page(snapshot, numbers[i]);
+
+		written += fwrite(page != NULL ? page : zero_page, GUEST_PAGE_SIZE, 1, file);
+	}
+
+	free(numbers);
+	if (fclose(file) != 0 || written != 1 + 2 * (size_t)header.page_count) {
+		return -1;
+	}
+	return 0;
+}
+
+Snapshot* load_snapshot(const char* filename, Snapshot* base) {
+	FileMapping* mapping = open_mapping(filename);
+	FileMapping** mappings = NULL;
+	uint32_t mapping_count = 0;
+	SnapshotFileHeader header;
+	const uint32_t* numbers;
+	Snapshot* snapshot;
+	int valid;
+	uint32_t i;
+	int j;
+
+	if (mapping == NULL) {
+		return NULL;
+	}
+	hold_mapping(&mappings, &mapping_count, mapping);
+
+	memset(&header, 0, sizeof(header));
+	if (mapping->size >= sizeof(header)) {
+		memcpy(&header, mapping->data, sizeof(header));
+	}
+	valid = memcmp(header.magic, SNAPSHOT_FILE_MAGIC, sizeof(header.magic)) == 0 && header.version == SNAPSHOT_FILE_VERSION
+		&& header.page_count <= GUEST_DIRECTORY_ENTRIES * GUEST_TABLE_ENTRIES
+		&& mapping->size >= snapshot_data_offset(header.page_count) + (size_t)header.page_count * GUEST_PAGE_SIZE
+		&& (header.base_id != 0) == (base != NULL) && (base == NULL || snapshot_id(base) == header.base_id);
+
+	numbers = (const uint32_t*)(mapping->data + sizeof(header));
+	for (i = 0; valid && i < header.page_count; i++) {
+		valid = numbers[i] < GUEST_DIRECTORY_ENTRIES * GUEST_TABLE_ENTRIES;
+	}
+	if (!valid) {
+		release_mappings(mappings, mapping_count);
+		return NULL;
+	}
+
+	snapshot = calloc(1, sizeof(Snapshot));
+	memcpy(snapshot->registers, header.registers, sizeof(snapshot->registers));
+	snapshot->eflags = header.eflags;
+	snapshot->prefix_mode = header.prefix_mode;
+	snapshot->eip = header.eip;
+	snapshot->id = header.id;
+	snapshot->mappings = mappings;
+	snapshot->mapping_count = mapping_count;
+
+	/* Pages the file does not hold are the base's */
+	if (base != NULL) {
+		for (i = 0; i < GUEST_DIRECTORY_ENTRIES; i++) {
+			PageTable* table = base->page_directory[i];
+
+			if (table != NULL) {
+				PageTable* view = calloc(1, sizeof(PageTable));
+				for (j = 0; j < GUEST_TABLE_ENTRIES; j++) {
+					view->pages[j] = table->pages[j];
+					view->flags[j] = table->pages[j] != NULL ? PAGE_SHARED : 0;
+				}
+				snapshot->page_directory[i] = view;
+			}
+		}
+	}
+
+	for (i = 0; i < header.page_count; i++) {
+		PageTable** slot = &snapshot->page_directory[numbers[i] >> GUEST_TABLE_SHIFT];
+		uint32_t index = numbers[i] & (GUEST_TABLE_ENTRIES - 1);
+
+		if (*slot == NULL) {
+			*slot = calloc(1, sizeof(PageTable));
+		}
+		(*slot)->pages[index] = mapping->data + snapshot_data_offset(header.page_count) + (size_t)i * GUEST_PAGE_SIZE;
+		(*slot)->flags[index] = PAGE_MAPPED;
+	}
+
+	return snapshot;
+}
+
+Emulator* create_emu_from_snapshot(Snapshot* snapshot) {
+	Emulator* emu = create_emu();
+	int i, j;
+
+	for (i = 0; i < GUEST_DIRECTORY_ENTRIES; i++) {
+		PageTable* table = snapshot->page_directory[i];
+
+		if (table != NULL) {
+			PageTable* view = calloc(1, sizeof(PageTable));
+			for (j = 0; j < GUEST_TABLE_ENTRIES; j++) {
+				view->pages[j] = table->pages[j];
+				view->flags[j] = table->pages[j] != NULL ? PAGE_SHARED : 0;
+			}
+			emu->page_directory[i] = view;
+		}
+	}
+
+	emu->snapshot = snapshot;
+	memcpy(emu->registers, snapshot->registers, sizeof(emu->registers));
+	emu->eflags = snapshot->eflags;
+	emu->prefix_mode = snapshot->prefix_mode;
+	emu->eip = snapshot->eip;
+
+	return emu;
+}
+
+void restore_snapshot(Emulator* emu) {
+	Snapshot* snapshot = emu->snapshot;
+	uint32_t i;
+
+	for (i = 0; i < emu->dirty_count; i++) {
+		uint32_t address = emu->dirty_list[i] << GUEST_PAGE_SHIFT;
+		uint32_t index = GUEST_TABLE_INDEX(address);
+		PageTable* table = emu->page_directory[GUEST_DIRECTORY_INDEX(address)];
+		PageTable* original = snapshot->page_directory[GUEST_DIRECTORY_INDEX(address)];
+
+		/* Decoded instructions may come from the code the run wrote */
+		if (table->flags[index] & PAGE_CODE) {
+			invalidate_decoded(emu, address);
+		}
+
+		/* Drop the private copy and share the snapshot's page again */
+		free(table->pages[index]);
+		table->pages[index] = original != NULL ? original->pages[index] : NULL;
+		table->flags[index] = table->pages[index] != NULL ? PAGE_SHARED : 0;
+	}
+	emu->dirty_count = 0;
+
+	memcpy(emu->registers, snapshot->registers, sizeof(emu->registers));
+	emu->eflags = snapshot->eflags;
+	emu->lazy_op = LAZY_NONE;
+	emu->prefix_mode = snapshot->prefix_mode;
+	emu->eip = snapshot->eip;
+	emu->insn = NULL;
+}
@@ -0,0 +1,58 @@
+#ifndef SNAPSHOT_H_
+#define SNAPSHOT_H_
+
+#include <stdint.h>
+
+#include "emulator.h"
+
+/*
+ * Memory and registers of an emulator frozen at one point. Emulators made
+ * from it share its pages copy-on-write and list the pages they write, so
+ * putting one back only touches those pages.
+ */
+typedef struct Snapshot {
+  uint32_t registers[REGISTERS_COUNT];
+  uint32_t eflags;
+  uint32_t prefix_mode;
+  uint32_t eip;
+  /* Pages as they were, never written after the snapshot is taken.
+     Flagged PAGE_MAPPED when in a file mapping, PAGE_SHARED when the base snapshot owns them */
+  struct PageTable* page_directory[GUEST_DIRECTORY_ENTRIES];
+  /* File mappings its PAGE_MAPPED pages lie in */
+  struct FileMapping** mappings;
+  uint32_t mapping_count;
+  /* Hash of the registers and memory identifying it to incremental files, 0 until needed */
+  uint64_t id;
+} Snapshot;
+
+/*
+ * Snapshot file: a header with the registers and page count, the guest
+ * page numbers stored, then the pages themselves, each at a GUEST_PAGE_SIZE
+ * aligned offset so a loaded snapshot points into the mapped file. A full file stores every non-zero page; an incremental one names
+ * its base by id and stores only the pages that differ from it. Values are
+ * in host byte order.
+ */
+#define SNAPSHOT_FILE_MAGIC "PX86SNAP"
+#define SNAPSHOT_FILE_VERSION (1)
+
+/* Freeze the memory and registers of emu. Pages emu mapped from a file are shared, not copied */
+Snapshot* take_snapshot(Emulator* emu);
+/* Discard the snapshot. Every emulator made from it must be destroyed first */
+void destroy_snapshot(Snapshot* snapshot);
+
+/* Write snapshot to filename, only the pages that differ from base unless it is NULL. Returns 0, or -1 if it can not be written */
+int save_snapshot(Snapshot* snapshot, Snapshot* base, const char* filename);
+/*
+ * Map a snapshot file back in. An incremental file needs the snapshot it
+ * was saved against as base, which must then be destroyed after this one.
+ * Returns NULL if the file can not be opened, is not a snapshot file, or
+ * base is not the one it was saved against.
+ */
+Snapshot* load_snapshot(const char* filename, Snapshot* base);
+
+/* To create an emulator whose pages are shared with snapshot until written */
+Emulator* create_emu_from_snapshot(Snapshot* snapshot);
+/* Put the pages the emulator wrote and its registers back as they were in its snapshot */
+void restore_snapshot(Emulator* emu);
+
+#endif
@@ -0,0 +1,359 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "sweep.h"
+#include "emulator_function.h"
+#include "instruction.h"
+#include "decode_cache.h"
+#include "block_cache.h"
+#include "snapshot.h"
+#include "guest_memory.h"
+#include "lockstep.h"
+
+struct Sweep;
+
+typedef struct Worker {
+	pthread_t thread;
+	/* Chunks taken from the queue and not yet run: [next, end). Others steal from the end */
+	pthread_mutex_t lock;
+	uint64_t next;
+	uint64_t end;
+	struct Sweep* sweep;
+	int index;
+	Emulator* emu;
+	/* Used instead of emu by SWEEP_RUN_LOCKSTEP */
+	Lockstep* lockstep;
+	uint64_t keys_done;
+	uint64_t keys_failed;
+	double seconds;
+} Worker;
+
+typedef struct Sweep {
+	const SweepConfig* config;
+	int threads;
+	uint64_t chunk_count;
+	/* Guards queue_next, written, done and the output */
+	pthread_mutex_t lock;
+	pthread_cond_t written_cond;
+	uint64_t queue_next;
+	uint64_t written;
+	/* Finished chunks wait in slot chunk % window until every earlier chunk is written */
+	uint64_t window;
+	uint8_t* results;
+	uint32_t* done;
+	FILE* output;
+	/* Memory as loaded, before any key ran; every worker emulator is a view of it */
+	Snapshot* pristine;
+	Worker* workers;
+} Sweep;
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+long load_key_file(const char* filename, uint32_t** keys) {
+	FILE* file = fopen(filename, "r");
+	char line[64];
+	long count = 0;
+	long size = 1024;
+
+	if (file == NULL) {
+		printf("%s file can not be opened\n", filename);
+		return -1;
+	}
+
+	*keys = malloc(size * sizeof(uint32_t));
+	while (fgets(line, sizeof(line), file) != NULL) {
+		char* end;
+		uint32_t key = strtoul(line, &end, 16);
+
+		if (end == line) {
+			continue;
+		}
+		if (count == size) {
+			size *= 2;
+			*keys = realloc(*keys, size * sizeof(uint32_t));
+		}
+		(*keys)[count++] = key;
+	}
+
+	fclose(file);
+	return count;
+}
+
+/* One record: the key, then the buffer, or zeroes when the routine failed */
+static void write_record(Worker* worker, Emulator* emu, uint32_t key, int status, uint8_t* record) {
+	record[0] = key;
+	record[1] = key >> 8;
+	record[2] = key >> 16;
+	record[3] = key >> 24;
+	if (status == 0) {
+		read_memory(emu, CONTINUUM_BUFFER, record + 4, CONTINUUM_BUFFER_SIZE);
+	} else {
+		memset(record + 4, 0, CONTINUUM_BUFFER_SIZE);
+		worker->keys_failed++;
+	}
+}
+
+static void run_key(Worker* worker, uint32_t key, uint8_t* record) {
+	Sweep* sweep = worker->sweep;
+	Emulator* emu = worker->emu;
+	int status;
+
+	/* Only the pages the last key wrote are copied back */
+	restore_snapshot(emu);
+	setup_continuum(emu, key);
+
+	if (sweep->config->run_mode == SWEEP_RUN_INSTRUCTIONS) {
+		status = run_instructions(emu, CONTINUUM_STOP_EIP);
+	} else {
+		status = run_blocks(emu, CONTINUUM_STOP_EIP);
+	}
+
+	write_record(worker, emu, key, status, record);
+}
+
+/* Run the routine for count keys (at most LOCKSTEP_LANES) together */
+static void run_keys_lockstep(Worker* worker, const uint32_t* keys, int count, uint8_t* records) {
+	Lockstep* ls = worker->lockstep;
+	int status[LOCKSTEP_LANES];
+	int lane;
+
+	for (lane = 0; lane < count; lane++) {
+		restore_snapshot(ls->lanes[lane]);
+		setup_continuum(ls->lanes[lane], keys[lane]);
+	}
+
+	run_lockstep(ls, count, CONTINUUM_STOP_EIP, status);
+
+	for (lane = 0; lane < count; lane++) {
+		write_record(worker, ls->lanes[lane], keys[lane], status[lane], records + lane * SWEEP_RECORD_SIZE);
+	}
+}
+
+/* Next chunk for worker: the front of its own batch, else the back of another worker's, else a new batch */
+static int take_chunk(Worker* worker, uint64_t* chunk) {
+	Sweep* sweep = worker->sweep;
+	uint64_t first, last;
+	int i;
+
+	pthread_mutex_lock(&worker->lock);
+	if (worker->next < worker->end) {
+		*chunk = worker->next++;
+		pthread_mutex_unlock(&worker->lock);
+		return 1;
+	}
+	pthread_mutex_unlock(&worker->lock);
+
+	for (i = 1; i < sweep->threads; i++) {
+		Worker* victim = &sweep->workers[(worker->index + i) % sweep->threads];
+
+		pthread_mutex_lock(&victim->lock);
+		if (victim->next < victim->end) {
+			*chunk = --victim->end;
+			pthread_mutex_unlock(&victim->lock);
+			return 1;
+		}
+		pthread_mutex_unlock(&victim->lock);
+	}
+
+	pthread_mutex_lock(&sweep->lock);
+	/* Results are kept until they can be written in order, so stay within the window */
+	while (sweep->queue_next < sweep->chunk_count
+			&& sweep->queue_next + SWEEP_BATCH_CHUNKS > sweep->written + sweep->window) {
+		pthread_cond_wait(&sweep->written_cond, &sweep->lock);
+	}
+	if (sweep->queue_next >= sweep->chunk_count) {
+		pthread_mutex_unlock(&sweep->lock);
+		return 0;
+	}
+	first = sweep->queue_next;
+	last = first + SWEEP_BATCH_CHUNKS < sweep->chunk_count ? first + SWEEP_BATCH_CHUNKS : sweep->chunk_count;
+	sweep->queue_next = last;
+	pthread_mutex_unlock(&sweep->lock);
+
+	pthread_mutex_lock(&worker->lock);
+	worker->next = first + 1;
+	worker->end = last;
+	pthread_mutex_unlock(&worker->lock);
+
+	*chunk = first;
+	return 1;
+}
+
+/* Mark chunk finished and write out every finished chunk next in key order */
+static void finish_chunk(Sweep* sweep, uint64_t chunk, uint32_t count) {
+	pthread_mutex_lock(&sweep->lock);
+	sweep->done[chunk % sweep->window] = count;
+
+	while (sweep->written < sweep->chunk_count && sweep->done[sweep->written % sweep->window] != 0) {
+		uint64_t slot = sweep->written % sweep->window;
+
+		fwrite(sweep->results + slot * SWEEP_CHUNK_KEYS * SWEEP_RECORD_SIZE,
+				SWEEP_RECORD_SIZE, sweep->done[slot], sweep->output);
+		sweep->done[slot] = 0;
+		sweep->written++;
+	}
+
+	pthread_cond_broadcast(&sweep->written_cond);
+	pthread_mutex_unlock(&sweep->lock);
+}
+
+static void* run_worker(void* arg) {
+	Worker* worker = arg;
+	Sweep* sweep = worker->sweep;
+	const SweepConfig* config = sweep->config;
+	double start = now();
+	uint64_t chunk;
+
+	while (take_chunk(worker, &chunk)) {
+		uint8_t* records = sweep->results + (chunk % sweep->window) * SWEEP_CHUNK_KEYS * SWEEP_RECORD_SIZE;
+		uint64_t first = chunk * SWEEP_CHUNK_KEYS;
+		uint32_t count = config->count - first < SWEEP_CHUNK_KEYS ? config->count - first : SWEEP_CHUNK_KEYS;
+		uint32_t i;
+
+		if (worker->lockstep != NULL) {
+			uint32_t keys[LOCKSTEP_LANES];
+			uint32_t lanes, lane;
+
+			for (i = 0; i < count; i += lanes) {
+				lanes = count - i < LOCKSTEP_LANES ? count - i : LOCKSTEP_LANES;
+				for (lane = 0; lane < lanes; lane++) {
+					keys[lane] = config->keys != NULL ? config->keys[first + i + lane] : config->first_key + (uint32_t)(first + i + lane);
+				}
+				run_keys_lockstep(worker, keys, lanes, records + i * SWEEP_RECORD_SIZE);
+			}
+		} else {
+			for (i = 0; i < count; i++) {
+				uint32_t key = config->keys != NULL ? config->keys[first + i] : config->first_key + (uint32_t)(first + i);
+				run_key(worker, key, records + i * SWEEP_RECORD_SIZE);
+			}
+		}
+		worker->keys_done += count;
+
+		finish_chunk(sweep, chunk, count);
+	}
+
+	worker->seconds = now() - start;
+	return NULL;
+}
+
+int run_sweep(const SweepConfig* config) {
+	Sweep sweep;
+	double start, seconds;
+	uint64_t failed = 0;
+	Emulator* emu;
+	int i;
+
+	memset(&sweep, 0, sizeof(sweep));
+	sweep.config = config;
+	sweep.threads = config->threads;
+	if (sweep.threads <= 0) {
+#ifdef _SC_NPROCESSORS_ONLN
+		sweep.threads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+		if (sweep.threads <= 0) {
+			sweep.threads = 1;
+		}
+	}
+
+	sweep.output = fopen(config->output, "wb");
+	if (sweep.output == NULL) {
+		printf("%s file can not be opened\n", config->output);
+		return -1;
+	}
+
+	if (config->image != NULL) {
+		sweep.pristine = config->image;
+	} else {
+		emu = create_emu();
+		if (read_binary(emu, CONTINUUM_IMAGE) < 0) {
+			fclose(sweep.output);
+			destroy_emu(emu);
+			return -1;
+		}
+		sweep.pristine = take_snapshot(emu);
+		destroy_emu(emu);
+	}
+
+	sweep.chunk_count = (config->count + SWEEP_CHUNK_KEYS - 1) / SWEEP_CHUNK_KEYS;
+	sweep.window = 2 * SWEEP_BATCH_CHUNKS * sweep.threads;
+	sweep.results = malloc(sweep.window * SWEEP_CHUNK_KEYS * SWEEP_RECORD_SIZE);
+	sweep.done = calloc(sweep.window, sizeof(uint32_t));
+	pthread_mutex_init(&sweep.lock, NULL);
+	pthread_cond_init(&sweep.written_cond, NULL);
+
+	sweep.workers = calloc(sweep.threads, sizeof(Worker));
+	for (i = 0; i < sweep.threads; i++) {
+		Worker* worker = &sweep.workers[i];
+
+		worker->sweep = &sweep;
+		worker->index = i;
+		pthread_mutex_init(&worker->lock, NULL);
+		if (config->run_mode == SWEEP_RUN_LOCKSTEP) {
+			worker->lockstep = create_lockstep(sweep.pristine);
+		} else {
+			worker->emu = create_emu_from_snapshot(sweep.pristine);
+		}
+		if (worker->emu == NULL && worker->lockstep == NULL) {
+			/* Go on with the workers made so far */
+			printf("memory of worker %d can not be mapped\n", i);
+			pthread_mutex_destroy(&worker->lock);
+			sweep.threads = i;
+			break;
+		}
+		if (config->run_mode == SWEEP_RUN_JIT) {
+			set_block_jit(worker->emu, 1);
+		}
+	}
+	if (sweep.threads == 0) {
+		failed = config->count;
+	}
+
+	start = now();
+	for (i = 0; i < sweep.threads; i++) {
+		pthread_create(&sweep.workers[i].thread, NULL, run_worker, &sweep.workers[i]);
+	}
+	for (i = 0; i < sweep.threads; i++) {
+		pthread_join(sweep.workers[i].thread, NULL);
+	}
+	seconds = now() - start;
+
+	for (i = 0; i < sweep.threads; i++) {
+		Worker* worker = &sweep.workers[i];
+
+		printf("thread %d: %llu keys, %.0f keys/sec\n", i, (unsigned long long)worker->keys_done,
+				worker->seconds > 0 ? worker->keys_done / worker->seconds : 0);
+		failed += worker->keys_failed;
+		if (worker->lockstep != NULL) {
+			destroy_lockstep(worker->lockstep);
+		} else {
+			destroy_emu(worker->emu);
+		}
+		pthread_mutex_destroy(&worker->lock);
+	}
+	printf("total: %llu keys in %.3f s, %.0f keys/sec", (unsigned long long)config->count, seconds,
+			seconds > 0 ? config->count / seconds : 0);
+	if (failed != 0) {
+		printf(", %llu keys did not return", (unsigned long long)failed);
+	}
+	printf("\n");
+
+	pthread_cond_destroy(&sweep.written_cond);
+	pthread_mutex_destroy(&sweep.lock);
+	free(sweep.workers);
+	free(sweep.done);
+	free(sweep.results);
+	if (config->image == NULL) {
+		destroy_snapshot(sweep.pristine);
+	}
+	fclose(sweep.output);
+	return 0;
+}
@@ -0,0 +1,47 @@
+#ifndef SWEEP_H_
+#define SWEEP_H_
+
+#include <stdint.h>
+
+#include "continuum.h"
+#include "snapshot.h"
+
+/* Keys handed to a worker at a time, and batches of chunks a worker takes from the queue */
+#define SWEEP_CHUNK_KEYS (256)
+#define SWEEP_BATCH_CHUNKS (4)
+
+/* Runner each worker uses for the key routine */
+#define SWEEP_RUN_INSTRUCTIONS (0)
+#define SWEEP_RUN_BLOCKS (1)
+#define SWEEP_RUN_JIT (2)
+/* LOCKSTEP_LANES keys at a time (lockstep.h) */
+#define SWEEP_RUN_LOCKSTEP (3)
+
+/* One output record: the key (little-endian) followed by the buffer the routine left */
+#define SWEEP_RECORD_SIZE (4 + CONTINUUM_BUFFER_SIZE)
+
+typedef struct SweepConfig {
+  /* Keys first_key, first_key + 1, ... when keys is NULL, else keys[0 .. count - 1] */
+  uint32_t first_key;
+  uint32_t* keys;
+  uint64_t count;
+  /* Worker threads, 0 for one per online CPU */
+  int threads;
+  /* SWEEP_RUN_* */
+  int run_mode;
+  const char* output;
+  /* Memory every key starts from, NULL to load CONTINUUM_IMAGE */
+  Snapshot* image;
+} SweepConfig;
+
+/* Read a text file of hexadecimal keys, one per line. Returns the key count, or -1 on error */
+long load_key_file(const char* filename, uint32_t** keys);
+
+/*
+ * Run the key routine for every key on a pool of worker threads and write
+ * the records to config->output in key order. Reports keys/sec per thread
+ * and in total. Returns 0, or -1 if the image or the output can not be opened.
+ */
+int run_sweep(const SweepConfig* config);
+
+#endif
@@ -0,0 +1,104 @@
+/*
+ * Renders a binary trace written by px86 -t FILE as the text the debug
+ * loop of main.c prints for every instruction.
+ *   trace_render trace.bin > log.txt
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "emulator.h"
+#include "emulator_function.h"
+#include "trace.h"
+
+static const char* registers_name[] = {
+	"EAX", "ECX", "EDX", "EBX", "ESP", "EBP", "ESI", "EDI"
+};
+
+static void render(const TraceRecord* record, const uint32_t* registers) {
+	uint32_t flags = record->eflags;
+	int i;
+
+	printf("EIP = %X, Code = %02X\n", record->eip, record->code[0]);
+	printf("[REGISTERS]\n");
+	for (i = 0; i < REGISTERS_COUNT; i++)
+		printf("%s = %08x\n", registers_name[i], registers[i]);
+	printf("EIP = %08x\n", record->next_eip);
+	printf("\n[FLAGS]\n");
+	printf("C: %d P %d A: %d Z: %d S: %d T: %d D: %d O: %d\n",
+	       (flags & CARRY_FLAG) != 0,
+	       (flags & PARITY_FLAG) != 0,
+	       (flags & AUX_FLAG) != 0,
+	       (flags & ZERO_FLAG) != 0,
+	       (flags & SIGN_FLAG) != 0,
+	       (flags & TRAP_FLAG) != 0,
+	       (flags & DIR_FLAG) != 0,
+	       (flags & OVERFLOW_FLAG) != 0);
+	printf("\n--------------------------------\n");
+}
+
+int main(int argc, char* argv[]) {
+	uint32_t registers[REGISTERS_COUNT];
+	TraceHeader header;
+	TraceRecord* records;
+	uint64_t first, n, skipped = 0;
+	int have_registers = 0;
+	FILE* file;
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s TRACE_FILE\n", argv[0]);
+		return 1;
+	}
+
+	file = fopen(argv[1], "rb");
+	if (file == NULL) {
+		fprintf(stderr, "%s file can not be opened\n", argv[1]);
+		return 1;
+	}
+	if (fread(&header, sizeof(header), 1, file) != 1
+			|| memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0
+			|| header.record_size != sizeof(TraceRecord) || header.capacity == 0) {
+		fprintf(stderr, "%s is not a px86 trace\n", argv[1]);
+		fclose(file);
+		return 1;
+	}
+
+	records = malloc((size_t)header.capacity * sizeof(TraceRecord));
+	if (fread(records, sizeof(TraceRecord), header.capacity, file) != header.capacity) {
+		fprintf(stderr, "%s is truncated\n", argv[1]);
+		fclose(file);
+		free(records);
+		return 1;
+	}
+	fclose(file);
+
+	/* The ring holds the last capacity records */
+	first = header.count > header.capacity ? header.count - header.capacity : 0;
+	for (n = first; n < header.count; n++) {
+		const TraceRecord* record = &records[n % header.capacity];
+		int i, v;
+
+		/* Registers are only known from the first record that stores them all */
+		if (record->changed == (1 << REGISTERS_COUNT) - 1) {
+			have_registers = 1;
+		}
+		if (!have_registers) {
+			skipped++;
+			continue;
+		}
+
+		for (i = 0, v = 0; i < REGISTERS_COUNT; i++) {
+			if (record->changed & (1 << i)) {
+				registers[i] = record->values[v++];
+			}
+		}
+		render(record, registers);
+	}
+
+	if (skipped != 0) {
+		fprintf(stderr, "%llu records before the first keyframe skipped\n", (unsigned long long)skipped);
+	}
+	free(records);
+	return 0;
+}
@@ -0,0 +1,146 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#define TRACE_MMAP (1)
+#else
+#define TRACE_MMAP (0)
+#endif
+
+#include "trace.h"
+#include "emulator_function.h"
+#include "instruction.h"
+#include "decode_cache.h"
+
+Trace* open_trace(const char* filename, uint32_t capacity) {
+	Trace* trace = malloc(sizeof(Trace));
+
+	memset(trace, 0, sizeof(Trace));
+	trace->filename = filename;
+	trace->size = sizeof(TraceHeader) + (uint64_t)capacity * sizeof(TraceRecord);
+
+#if TRACE_MMAP
+	{
+		int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+		if (fd < 0 || ftruncate(fd, trace->size) != 0) {
+			printf("%s file can not be created\n", filename);
+			if (fd >= 0) {
+				close(fd);
+			}
+			free(trace);
+			return NULL;
+		}
+		trace->base = mmap(NULL, trace->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if (trace->base == MAP_FAILED) {
+			printf("%s file can not be mapped\n", filename);
+			free(trace);
+			return NULL;
+		}
+	}
+#else
+	trace->base = calloc(1, trace->size);
+#endif
+
+	trace->header = trace->base;
+	trace->records = (TraceRecord*)(trace->header + 1);
+	memcpy(trace->header->magic, TRACE_MAGIC, sizeof(trace->header->magic));
+	trace->header->record_size = sizeof(TraceRecord);
+	trace->header->capacity = capacity;
+	trace->header->count = 0;
+
+	return trace;
+}
+
+void close_trace(Trace* trace) {
+#if TRACE_MMAP
+	munmap(trace->base, trace->size);
+#else
+	FILE* file = fopen(trace->filename, "wb");
+
+	if (file == NULL) {
+		printf("%s file can not be created\n", trace->filename);
+	} else {
+		fwrite(trace->base, 1, trace->size, file);
+		fclose(file);
+	}
+	free(trace->base);
+#endif
+	free(trace);
+}
+
+/* Fill in what the instruction of record left behind and move to the next slot */
+static void finish_record(Trace* trace, TraceRecord* record, Emulator* emu) {
+	uint32_t changed = 0;
+	int i, n;
+
+	record->next_eip = emu->eip;
+	flush_lazy_flags(emu);
+	record->eflags = emu->eflags;
+
+	/* Branch free: which registers change differs from one instruction to the next */
+	for (i = 0; i < REGISTERS_COUNT; i++) {
+		changed |= (uint32_t)(emu->registers[i] != trace->registers[i]) << i;
+	}
+	if (trace->keyframe_in-- == 0) {
+		changed = (1 << REGISTERS_COUNT) - 1;
+		trace->keyframe_in = TRACE_KEYFRAME_INTERVAL - 1;
+	}
+	record->changed = changed;
+
+	/* Every register is stored, n only moves past the changed ones */
+	for (i = 0, n = 0; i < REGISTERS_COUNT; i++) {
+		record->values[n] = emu->registers[i];
+		n += (changed >> i) & 1;
+	}
+	memcpy(trace->registers, emu->registers, sizeof(trace->registers));
+
+	trace->header->count++;
+	if (++trace->slot == trace->header->capacity) {
+		trace->slot = 0;
+	}
+}
+
+int run_traced(Emulator* emu, uint32_t stop_eip, Trace* trace) {
+	while (emu->eip != stop_eip) {
+		DecodedInstruction* insn = fetch_decoded(emu);
+		TraceRecord* record;
+		uint32_t code;
+
+		if (insn->func == NULL) {
+			printf("\n\nNot Implemented: %x\n", insn->opcode);
+			emu->insn = NULL;
+			return -1;
+		}
+
+		record = &trace->records[trace->slot];
+		record->eip = emu->eip;
+		code = get_code32(emu, 0);
+		if (insn->length < sizeof(record->code)) {
+			code &= (1 << (insn->length * 8)) - 1;
+		}
+		record->code[0] = code;
+		record->code[1] = code >> 8;
+		record->code[2] = code >> 16;
+		record->code[3] = code >> 24;
+
+		emu->insn = insn;
+		insn->func(emu);
+		finish_record(trace, record, emu);
+
+		/* EIP - The end of the program Once but becomes 0 */
+		if (emu->eip == 0x00) {
+			printf("\n\nEnd of program.\n\n");
+			emu->insn = NULL;
+			return -1;
+		}
+	}
+
+	emu->insn = NULL;
+	return 0;
+}
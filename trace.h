@@ -0,0 +1,65 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdint.h>
+
+#include "emulator.h"
+
+#define TRACE_MAGIC "PX86TRC1"
+
+/* Records kept by default: the last 256 K instructions */
+#ifndef TRACE_DEFAULT_RECORDS
+#define TRACE_DEFAULT_RECORDS (1 << 18)
+#endif
+
+/* Every this many records all registers are stored, so that a wrapped ring can be rendered from there */
+#define TRACE_KEYFRAME_INTERVAL (256)
+
+/* One executed instruction */
+typedef struct TraceRecord {
+  /* Address of the instruction and EIP after it */
+  uint32_t eip;
+  uint32_t next_eip;
+  /* EFLAGS after it, lazy flags folded in */
+  uint32_t eflags;
+  /* First bytes of the instruction, code[0] is the opcode */
+  uint8_t code[4];
+  /* Registers it changed, one bit per register; all bits on a keyframe */
+  uint8_t changed;
+  uint8_t reserved[3];
+  /* New values of the changed registers, in register order */
+  uint32_t values[REGISTERS_COUNT];
+} TraceRecord;
+
+/* Start of the trace file, followed by capacity records */
+typedef struct TraceHeader {
+  char magic[8];
+  uint32_t record_size;
+  uint32_t capacity;
+  /* Records ever written; record n is in slot n % capacity */
+  uint64_t count;
+} TraceHeader;
+
+typedef struct Trace {
+  TraceHeader* header;
+  TraceRecord* records;
+  /* Registers as of the last record */
+  uint32_t registers[REGISTERS_COUNT];
+  /* Slot of the next record (header->count % capacity) and records left until the next keyframe */
+  uint32_t slot;
+  uint32_t keyframe_in;
+  /* Mapped file, or a heap buffer written out by close_trace where mmap is not available */
+  void* base;
+  uint64_t size;
+  const char* filename;
+} Trace;
+
+/* Create filename as a ring of capacity records. Returns NULL if it can not be created */
+Trace* open_trace(const char* filename, uint32_t capacity);
+/* Finish the trace file and release the trace */
+void close_trace(Trace* trace);
+
+/* run_instructions, appending a record to trace for every instruction */
+int run_traced(Emulator* emu, uint32_t stop_eip, Trace* trace);
+
+#endif